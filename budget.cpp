@@ -0,0 +1,262 @@
+#include "budget.h"
+#include "logger.h"
+
+
+ByteBudget::ByteBudget(size_t limit_arg, ByteBudget* parent_arg)
+    : parent(parent_arg), limit(limit_arg), used(0), entries(0), peak(0),
+      dropped(0), dropped_bytes(0), blocked(0), disconnects(0), waiters(0)
+{
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&room, NULL);
+}
+
+
+ByteBudget::~ByteBudget()
+{
+    pthread_cond_destroy(&room);
+    pthread_mutex_destroy(&mutex);
+}
+
+
+void ByteBudget::SetLimit(size_t limit_arg)
+{
+    __atomic_store_n(&limit, limit_arg, __ATOMIC_SEQ_CST);
+    WakeAll();
+}
+
+
+size_t ByteBudget::GetLimit() const
+{
+    return __atomic_load_n(&limit, __ATOMIC_RELAXED);
+}
+
+
+/*
+    Must be called before anything is charged.
+*/
+void ByteBudget::SetParent(ByteBudget* parent_arg)
+{
+    parent = parent_arg;
+}
+
+
+bool ByteBudget::TryCharge(size_t bytes)
+{
+    if(!Reserve(bytes))
+        return false;
+    if(parent && !parent->TryCharge(bytes))
+    {
+        Subtract(bytes);
+        WakeWaiters();  // someone may have checked for room while we held it
+        return false;
+    }
+    return true;
+}
+
+
+void ByteBudget::Charge(size_t bytes)
+{
+    Add(bytes);
+    if(parent)
+        parent->Charge(bytes);
+}
+
+
+void ByteBudget::Credit(size_t bytes)
+{
+    Subtract(bytes);
+    if(parent)
+        parent->Credit(bytes);
+    else
+        WakeWaiters();
+}
+
+
+bool ByteBudget::IsOver(bool with_parent) const
+{
+    size_t current_limit = __atomic_load_n(&limit, __ATOMIC_RELAXED);
+    if(current_limit && __atomic_load_n(&used, __ATOMIC_RELAXED) > current_limit)
+        return true;
+    return with_parent && parent && parent->IsOver();
+}
+
+
+/*
+    Waiters sleep on the root budget, which every credit in the tree ends up
+    at.  A waiter announces itself before checking for room, and Credit
+    subtracts before checking for waiters, so either the waiter sees the
+    room or Credit sees the waiter.
+*/
+bool ByteBudget::WaitForRoom(size_t bytes, const bool* abort)
+{
+    ByteBudget* root = GetRoot();
+    bool counted = false;
+    pthread_mutex_lock(&root->mutex);
+    __atomic_add_fetch(&root->waiters, 1, __ATOMIC_SEQ_CST);
+    while(!__atomic_load_n(abort, __ATOMIC_ACQUIRE) && !Fits(bytes))
+    {
+        if(!counted)
+        {
+            CountBlocked();
+            counted = true;
+        }
+        pthread_cond_wait(&root->room, &root->mutex);
+    }
+    __atomic_sub_fetch(&root->waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&root->mutex);
+    return !__atomic_load_n(abort, __ATOMIC_ACQUIRE);
+}
+
+
+void ByteBudget::WakeAll()
+{
+    ByteBudget* root = GetRoot();
+    pthread_mutex_lock(&root->mutex);
+    pthread_cond_broadcast(&root->room);
+    pthread_mutex_unlock(&root->mutex);
+}
+
+
+void ByteBudget::CountDrop(size_t bytes)
+{
+    __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&dropped_bytes, bytes, __ATOMIC_RELAXED);
+    if(parent)
+        parent->CountDrop(bytes);
+}
+
+
+void ByteBudget::CountBlocked()
+{
+    __atomic_add_fetch(&blocked, 1, __ATOMIC_RELAXED);
+    if(parent)
+        parent->CountBlocked();
+}
+
+
+void ByteBudget::CountDisconnect()
+{
+    __atomic_add_fetch(&disconnects, 1, __ATOMIC_RELAXED);
+    if(parent)
+        parent->CountDisconnect();
+}
+
+
+void ByteBudget::GetStats(QueueStats& stats) const
+{
+    stats.queued = __atomic_load_n(&entries, __ATOMIC_RELAXED);
+    stats.queued_bytes = __atomic_load_n(&used, __ATOMIC_RELAXED);
+    stats.peak_bytes = __atomic_load_n(&peak, __ATOMIC_RELAXED);
+    stats.dropped = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+    stats.dropped_bytes = __atomic_load_n(&dropped_bytes, __ATOMIC_RELAXED);
+    stats.blocked = __atomic_load_n(&blocked, __ATOMIC_RELAXED);
+    stats.disconnects = __atomic_load_n(&disconnects, __ATOMIC_RELAXED);
+}
+
+
+bool ByteBudget::Reserve(size_t bytes)
+{
+    size_t current = __atomic_load_n(&used, __ATOMIC_RELAXED);
+    for(;;)
+    {
+        size_t current_limit = __atomic_load_n(&limit, __ATOMIC_RELAXED);
+        if(current_limit && current > 0 && current + bytes > current_limit)
+            return false;
+        if(__atomic_compare_exchange_n(&used, &current, current + bytes, true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            break;
+    }
+    __atomic_add_fetch(&entries, 1, __ATOMIC_RELAXED);
+    size_t high = __atomic_load_n(&peak, __ATOMIC_RELAXED);
+    while(current + bytes > high && !__atomic_compare_exchange_n(&peak, &high, current + bytes, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    return true;
+}
+
+
+bool ByteBudget::Fits(size_t bytes) const
+{
+    size_t current = __atomic_load_n(&used, __ATOMIC_SEQ_CST);
+    size_t current_limit = __atomic_load_n(&limit, __ATOMIC_RELAXED);
+    if(current_limit && current > 0 && current + bytes > current_limit)
+        return false;
+    return parent == NULL || parent->Fits(bytes);
+}
+
+
+void ByteBudget::Add(size_t bytes)
+{
+    size_t now = __atomic_add_fetch(&used, bytes, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&entries, 1, __ATOMIC_RELAXED);
+    size_t high = __atomic_load_n(&peak, __ATOMIC_RELAXED);
+    while(now > high && !__atomic_compare_exchange_n(&peak, &high, now, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+
+void ByteBudget::Subtract(size_t bytes)
+{
+    __atomic_sub_fetch(&used, bytes, __ATOMIC_SEQ_CST);
+    __atomic_sub_fetch(&entries, 1, __ATOMIC_RELAXED);
+}
+
+
+/*
+    See WaitForRoom for why this doesn't need the lock to look at waiters.
+*/
+void ByteBudget::WakeWaiters()
+{
+    ByteBudget* root = GetRoot();
+    if(__atomic_load_n(&root->waiters, __ATOMIC_SEQ_CST))
+        root->WakeAll();
+}
+
+
+ByteBudget* ByteBudget::GetRoot()
+{
+    ByteBudget* root = this;
+    while(root->parent)
+        root = root->parent;
+    return root;
+}
+
+/*
+------------------------------------------------------------------------------
+This software is available under 2 licenses -- choose whichever you prefer.
+------------------------------------------------------------------------------
+ALTERNATIVE A - MIT License
+Copyright (c) 2003-2019 Bobby G. Burrough
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to 
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+of the Software, and to permit persons to whom the Software is furnished to do 
+so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+SOFTWARE.
+------------------------------------------------------------------------------
+ALTERNATIVE B - Public Domain (www.unlicense.org)
+This is free and unencumbered software released into the public domain.
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this 
+software, either in source code form or as a compiled binary, for any purpose, 
+commercial or non-commercial, and by any means.
+In jurisdictions that recognize copyright laws, the author or authors of this 
+software dedicate any and all copyright interest in the software to the public 
+domain. We make this dedication for the benefit of the public at large and to 
+the detriment of our heirs and successors. We intend this dedication to be an 
+overt act of relinquishment in perpetuity of all present and future rights to 
+this software under copyright law.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN 
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION 
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+------------------------------------------------------------------------------
+*/
@@ -0,0 +1,172 @@
+#ifndef _BUDGET_H_
+#define _BUDGET_H_
+
+#include "threadutils.h"
+#include <cstdint>
+#include <cstddef>
+
+using namespace std;
+
+
+/*
+    BudgetPolicy
+
+    What happens when a queue would go over its byte budget.
+
+    BUDGET_BLOCK        the writer waits for room (for input, the connection
+                        stops reading from its socket until there is room,
+                        so it can run over by what one receive held)
+    BUDGET_DROP_OLDEST  the oldest queued entries are discarded to make room
+    BUDGET_DROP_NEWEST  the entry that does not fit is discarded
+    BUDGET_DISCONNECT   the connection is dropped as a slow consumer
+*/
+enum BudgetPolicy
+{
+    BUDGET_BLOCK,
+    BUDGET_DROP_OLDEST,
+    BUDGET_DROP_NEWEST,
+    BUDGET_DISCONNECT
+};
+
+
+struct QueueStats
+{
+    size_t queued;              // entries currently charged to the budget
+    size_t queued_bytes;
+    size_t peak_bytes;          // highest queued_bytes seen
+    uint64_t dropped;           // entries discarded by BUDGET_DROP_OLDEST / BUDGET_DROP_NEWEST
+    uint64_t dropped_bytes;
+    uint64_t blocked;           // times a writer or reader had to wait for room
+    uint64_t disconnects;       // connections dropped by BUDGET_DISCONNECT
+};
+
+
+/*
+    ByteBudget
+
+    Counts the bytes (and entries) held by a queue against a limit.  A
+    budget may have a parent, such as a server-wide budget shared by every
+    connection's own budget: charges and credits apply to both, and an
+    entry only fits if it fits in both.  A limit of 0 means unlimited.
+
+    An entry always fits in an empty budget, so one larger than the limit
+    can't wedge a queue.  All members are thread safe.
+*/
+class ByteBudget
+{
+public:
+    ByteBudget(size_t limit = 0, ByteBudget* parent = NULL);
+    ~ByteBudget();
+
+    void SetLimit(size_t limit);
+    size_t GetLimit() const;
+    void SetParent(ByteBudget* parent);
+
+    /*
+        TryCharge
+
+        Charges one entry of bytes if it fits in this budget and its parent,
+        otherwise charges nothing and returns false.
+    */
+    bool TryCharge(size_t bytes);
+
+    /*
+        Charge / Credit
+
+        Charge counts an entry whether or not it fits.  Credit returns one
+        entry's bytes once it leaves the queue, waking anyone in WaitForRoom.
+    */
+    void Charge(size_t bytes);
+    void Credit(size_t bytes);
+
+    /*
+        IsOver
+
+        True while this budget, or with_parent its parent, holds more than
+        its limit.
+    */
+    bool IsOver(bool with_parent = true) const;
+
+    /*
+        WaitForRoom
+
+        Blocks until an entry of bytes would fit, or until *abort is set and
+        WakeAll is called.  Returns false if it gave up because of abort.
+        Does not charge anything; follow with TryCharge.
+    */
+    bool WaitForRoom(size_t bytes, const bool* abort);
+    void WakeAll();
+
+    void CountDrop(size_t bytes);
+    void CountBlocked();
+    void CountDisconnect();
+
+    void GetStats(QueueStats& stats) const;
+
+private:
+    bool Reserve(size_t bytes);
+    bool Fits(size_t bytes) const;
+    void Add(size_t bytes);
+    void Subtract(size_t bytes);
+    void WakeWaiters();
+    ByteBudget* GetRoot();
+
+    ByteBudget* parent;
+    size_t limit;
+    size_t used;
+    size_t entries;
+    size_t peak;
+    uint64_t dropped;
+    uint64_t dropped_bytes;
+    uint64_t blocked;
+    uint64_t disconnects;
+
+    // used on the root budget by WaitForRoom
+    uint32_t waiters;
+    pthread_mutex_t mutex;
+    pthread_cond_t room;
+};
+
+#endif // _BUDGET_H_
+
+/*
+------------------------------------------------------------------------------
+This software is available under 2 licenses -- choose whichever you prefer.
+------------------------------------------------------------------------------
+ALTERNATIVE A - MIT License
+Copyright (c) 2003-2019 Bobby G. Burrough
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to 
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+of the Software, and to permit persons to whom the Software is furnished to do 
+so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+SOFTWARE.
+------------------------------------------------------------------------------
+ALTERNATIVE B - Public Domain (www.unlicense.org)
+This is free and unencumbered software released into the public domain.
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this 
+software, either in source code form or as a compiled binary, for any purpose, 
+commercial or non-commercial, and by any means.
+In jurisdictions that recognize copyright laws, the author or authors of this 
+software dedicate any and all copyright interest in the software to the public 
+domain. We make this dedication for the benefit of the public at large and to 
+the detriment of our heirs and successors. We intend this dedication to be an 
+overt act of relinquishment in perpetuity of all present and future rights to 
+this software under copyright law.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN 
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION 
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+------------------------------------------------------------------------------
+*/
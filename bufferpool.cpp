@@ -0,0 +1,377 @@
+#include "bufferpool.h"
+#include "threadutils.h"
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+using namespace std;
+
+/*
+    Every block is preceded by a header recording its size class, so Free
+    needs nothing but the pointer.  The header is 16 bytes to keep the block
+    itself 16-byte aligned.
+*/
+static const size_t header_size = 16;
+static const unsigned min_class_shift = 5;     // 32 bytes
+static const unsigned max_class_shift = 16;    // 64 KB
+static const unsigned class_count = max_class_shift - min_class_shift + 1;
+static const unsigned oversize_class = 0xFF;
+
+// a thread keeps up to this many bytes of free blocks per class (at least 4 blocks)
+static const size_t max_cached_bytes = 256 * 1024;
+// the depot holds at most this much per class before releasing memory to the system
+static const size_t max_depot_bytes = 4 * 1024 * 1024;
+
+struct BlockHeader
+{
+    unsigned size_class;
+};
+
+struct FreeBlock
+{
+    FreeBlock* next;
+};
+
+
+static size_t ClassSize(unsigned size_class)
+{
+    return (size_t)1 << (size_class + min_class_shift);
+}
+
+
+static size_t ClassLimit(unsigned size_class)
+{
+    size_t limit = max_cached_bytes / ClassSize(size_class);
+    return limit < 4 ? 4 : limit;
+}
+
+
+static unsigned SizeClass(size_t size)
+{
+    unsigned size_class = 0;
+    while (size_class < class_count && ClassSize(size_class) < size)
+        size_class++;
+    return size_class < class_count ? size_class : oversize_class;
+}
+
+
+struct Batch
+{
+    FreeBlock* head;
+    size_t count;
+};
+
+
+struct ThreadCache
+{
+    FreeBlock* lists[class_count];
+    size_t counts[class_count];
+
+    // written only by the owning thread, read by GetStats
+    uint64_t allocations;
+    uint64_t hits;
+    uint64_t refills;
+    uint64_t misses;
+    uint64_t oversize;
+    uint64_t bytes_held;
+};
+
+
+/*
+    Shared by all threads.  It is allocated once and never destroyed, so
+    threads that exit during static destruction can still return blocks.
+*/
+struct DepotClass
+{
+    pthread_mutex_t mutex;
+    vector<Batch> batches;
+    size_t bytes_held;
+};
+
+struct Depot
+{
+    DepotClass classes[class_count];
+    pthread_mutex_t mutex;          // guards the rest
+    vector<ThreadCache*> caches;
+    BufferPoolStats retired;        // counters of threads that have exited
+};
+
+
+static pthread_once_t depot_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+static Depot* depot = NULL;
+static __thread ThreadCache* thread_cache = NULL;
+
+
+static void Count(uint64_t& counter, uint64_t amount)
+{
+    __atomic_store_n(&counter, counter + amount, __ATOMIC_RELAXED);
+}
+
+
+static void ReleaseThreadCache(void* arg);
+
+static void InitDepot()
+{
+    depot = new Depot();
+    pthread_mutex_init(&depot->mutex, NULL);
+    for (unsigned size_class = 0; size_class < class_count; size_class++)
+    {
+        pthread_mutex_init(&depot->classes[size_class].mutex, NULL);
+        depot->classes[size_class].bytes_held = 0;
+    }
+    depot->retired = BufferPoolStats();
+    pthread_key_create(&cache_key, ReleaseThreadCache);
+}
+
+
+static ThreadCache* GetThreadCache()
+{
+    if (thread_cache)
+        return thread_cache;
+
+    pthread_once(&depot_once, InitDepot);
+    ThreadCache* cache = (ThreadCache*)calloc(1, sizeof(ThreadCache));
+    if (cache == NULL)
+        return NULL;
+    pthread_mutex_lock(&depot->mutex);
+    depot->caches.push_back(cache);
+    pthread_mutex_unlock(&depot->mutex);
+    pthread_setspecific(cache_key, cache);
+    thread_cache = cache;
+    return cache;
+}
+
+
+/*
+    Moves up to count blocks from the cache into a batch.  Must be called
+    by the thread that owns the cache.
+*/
+static Batch TakeBatch(ThreadCache* cache, unsigned size_class, size_t count)
+{
+    Batch batch;
+    batch.head = cache->lists[size_class];
+    batch.count = 0;
+    FreeBlock* last = NULL;
+    FreeBlock* block = batch.head;
+    while (block && batch.count < count)
+    {
+        last = block;
+        block = block->next;
+        batch.count++;
+    }
+    if (last)
+        last->next = NULL;
+    cache->lists[size_class] = block;
+    cache->counts[size_class] -= batch.count;
+    Count(cache->bytes_held, -(uint64_t)(batch.count * ClassSize(size_class)));
+    return batch;
+}
+
+
+static void FreeBatch(Batch batch)
+{
+    while (batch.head)
+    {
+        FreeBlock* next = batch.head->next;
+        free((char*)batch.head - header_size);
+        batch.head = next;
+    }
+}
+
+
+// Hands a batch to the depot, or back to the system if the depot is full.
+static void ReturnBatch(unsigned size_class, Batch batch)
+{
+    DepotClass& depot_class = depot->classes[size_class];
+    size_t bytes = batch.count * ClassSize(size_class);
+    pthread_mutex_lock(&depot_class.mutex);
+    if (depot_class.bytes_held + bytes <= max_depot_bytes)
+    {
+        depot_class.batches.push_back(batch);
+        depot_class.bytes_held += bytes;
+        batch.head = NULL;
+    }
+    pthread_mutex_unlock(&depot_class.mutex);
+    FreeBatch(batch);
+}
+
+
+static void ReleaseThreadCache(void* arg)
+{
+    ThreadCache* cache = (ThreadCache*)arg;
+    thread_cache = NULL;
+
+    for (unsigned size_class = 0; size_class < class_count; size_class++)
+    {
+        while (cache->counts[size_class] > 0)
+            ReturnBatch(size_class, TakeBatch(cache, size_class, ClassLimit(size_class) / 2));
+    }
+
+    pthread_mutex_lock(&depot->mutex);
+    for (size_t i = 0; i < depot->caches.size(); i++)
+    {
+        if (depot->caches[i] == cache)
+        {
+            depot->caches.erase(depot->caches.begin() + i);
+            break;
+        }
+    }
+    depot->retired.allocations += cache->allocations;
+    depot->retired.hits += cache->hits;
+    depot->retired.refills += cache->refills;
+    depot->retired.misses += cache->misses;
+    depot->retired.oversize += cache->oversize;
+    pthread_mutex_unlock(&depot->mutex);
+    free(cache);
+}
+
+
+void* BufferPool::Allocate(size_t size)
+{
+    unsigned size_class = SizeClass(size);
+    ThreadCache* cache = GetThreadCache();
+    if (cache)
+        Count(cache->allocations, 1);
+
+    char* memory = NULL;
+    if (size_class == oversize_class)
+    {
+        if (cache)
+            Count(cache->oversize, 1);
+        memory = (char*)malloc(header_size + size);
+    }
+    else if (cache)
+    {
+        if (cache->lists[size_class] == NULL)
+        {
+            Batch batch = { NULL, 0 };
+            DepotClass& depot_class = depot->classes[size_class];
+            pthread_mutex_lock(&depot_class.mutex);
+            if (!depot_class.batches.empty())
+            {
+                batch = depot_class.batches.back();
+                depot_class.batches.pop_back();
+                depot_class.bytes_held -= batch.count * ClassSize(size_class);
+            }
+            pthread_mutex_unlock(&depot_class.mutex);
+            if (batch.head)
+            {
+                cache->lists[size_class] = batch.head;
+                cache->counts[size_class] = batch.count;
+                Count(cache->bytes_held, batch.count * ClassSize(size_class));
+                Count(cache->refills, 1);
+            }
+        }
+
+        FreeBlock* block = cache->lists[size_class];
+        if (block)
+        {
+            cache->lists[size_class] = block->next;
+            cache->counts[size_class]--;
+            Count(cache->bytes_held, -(uint64_t)ClassSize(size_class));
+            Count(cache->hits, 1);
+            return block;
+        }
+        Count(cache->misses, 1);
+        memory = (char*)malloc(header_size + ClassSize(size_class));
+    }
+    else
+    {
+        memory = (char*)malloc(header_size + ClassSize(size_class));
+    }
+
+    if (memory == NULL)
+        throw bad_alloc();
+    ((BlockHeader*)memory)->size_class = size_class;
+    return memory + header_size;
+}
+
+
+void BufferPool::Free(void* block)
+{
+    if (block == NULL)
+        return;
+
+    char* memory = (char*)block - header_size;
+    unsigned size_class = ((BlockHeader*)memory)->size_class;
+    ThreadCache* cache = size_class == oversize_class ? NULL : GetThreadCache();
+    if (cache == NULL)
+    {
+        free(memory);
+        return;
+    }
+
+    FreeBlock* free_block = (FreeBlock*)block;
+    free_block->next = cache->lists[size_class];
+    cache->lists[size_class] = free_block;
+    cache->counts[size_class]++;
+    Count(cache->bytes_held, ClassSize(size_class));
+
+    // keep half, so a thread that alternates allocating and freeing doesn't bounce batches
+    size_t limit = ClassLimit(size_class);
+    if (cache->counts[size_class] > limit)
+        ReturnBatch(size_class, TakeBatch(cache, size_class, limit / 2));
+}
+
+
+void BufferPool::GetStats(BufferPoolStats& stats)
+{
+    pthread_once(&depot_once, InitDepot);
+    pthread_mutex_lock(&depot->mutex);
+    stats = depot->retired;
+    for (unsigned size_class = 0; size_class < class_count; size_class++)
+        stats.bytes_held += __atomic_load_n(&depot->classes[size_class].bytes_held, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < depot->caches.size(); i++)
+    {
+        ThreadCache* cache = depot->caches[i];
+        stats.allocations += __atomic_load_n(&cache->allocations, __ATOMIC_RELAXED);
+        stats.hits += __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+        stats.refills += __atomic_load_n(&cache->refills, __ATOMIC_RELAXED);
+        stats.misses += __atomic_load_n(&cache->misses, __ATOMIC_RELAXED);
+        stats.oversize += __atomic_load_n(&cache->oversize, __ATOMIC_RELAXED);
+        stats.bytes_held += __atomic_load_n(&cache->bytes_held, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&depot->mutex);
+}
+/*
+------------------------------------------------------------------------------
+This software is available under 2 licenses -- choose whichever you prefer.
+------------------------------------------------------------------------------
+ALTERNATIVE A - MIT License
+Copyright (c) 2003-2019 Bobby G. Burrough
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to 
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+of the Software, and to permit persons to whom the Software is furnished to do 
+so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+SOFTWARE.
+------------------------------------------------------------------------------
+ALTERNATIVE B - Public Domain (www.unlicense.org)
+This is free and unencumbered software released into the public domain.
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this 
+software, either in source code form or as a compiled binary, for any purpose, 
+commercial or non-commercial, and by any means.
+In jurisdictions that recognize copyright laws, the author or authors of this 
+software dedicate any and all copyright interest in the software to the public 
+domain. We make this dedication for the benefit of the public at large and to 
+the detriment of our heirs and successors. We intend this dedication to be an 
+overt act of relinquishment in perpetuity of all present and future rights to 
+this software under copyright law.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN 
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION 
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+------------------------------------------------------------------------------
+*/
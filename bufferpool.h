@@ -0,0 +1,98 @@
+#ifndef _BUFFER_POOL_H_
+#define _BUFFER_POOL_H_
+
+#include <cstddef>
+#include <cstdint>
+
+using namespace std;
+
+
+struct BufferPoolStats
+{
+    uint64_t allocations;       // blocks handed out, pooled or not
+    uint64_t hits;              // allocations served from pooled memory
+    uint64_t refills;           // batches a thread cache took from the shared depot to do so
+    uint64_t misses;            // allocations that had to go to the system allocator
+    uint64_t oversize;          // allocations too large for any size class
+    uint64_t bytes_held;        // memory kept in the pool, ready for reuse
+};
+
+
+/*
+    BufferPool
+
+    A size-class allocator for the blocks every received packet needs: the
+    Packet object and its payload, and the Frames that are sent.  Each
+    thread keeps a small cache of free blocks per size class, so the common
+    allocate/free pair takes no lock at all.  Blocks are usually allocated on
+    one thread (an EventLoop) and freed on another (the application), so
+    caches that grow too large hand a batch of blocks to a shared depot,
+    and caches that run dry take a batch back, one lock acquisition per
+    batch.  Requests larger than the biggest size class go straight to the
+    system allocator.
+*/
+class BufferPool
+{
+public:
+    /*
+        Allocate / Free
+
+        Allocate returns a block of at least size bytes, aligned for any
+        type.  It never returns NULL; like operator new it throws
+        std::bad_alloc.  Free accepts NULL, and blocks allocated on any
+        thread.
+    */
+    static void* Allocate(size_t size);
+    static void Free(void* block);
+
+    /*
+        GetStats
+
+        Totals across every thread, including threads that have exited.
+        Counters read from running threads may lag slightly.
+    */
+    static void GetStats(BufferPoolStats& stats);
+};
+
+#endif // _BUFFER_POOL_H_
+/*
+------------------------------------------------------------------------------
+This software is available under 2 licenses -- choose whichever you prefer.
+------------------------------------------------------------------------------
+ALTERNATIVE A - MIT License
+Copyright (c) 2003-2019 Bobby G. Burrough
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to 
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+of the Software, and to permit persons to whom the Software is furnished to do 
+so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+SOFTWARE.
+------------------------------------------------------------------------------
+ALTERNATIVE B - Public Domain (www.unlicense.org)
+This is free and unencumbered software released into the public domain.
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this 
+software, either in source code form or as a compiled binary, for any purpose, 
+commercial or non-commercial, and by any means.
+In jurisdictions that recognize copyright laws, the author or authors of this 
+software dedicate any and all copyright interest in the software to the public 
+domain. We make this dedication for the benefit of the public at large and to 
+the detriment of our heirs and successors. We intend this dedication to be an 
+overt act of relinquishment in perpetuity of all present and future rights to 
+this software under copyright law.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN 
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION 
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+------------------------------------------------------------------------------
+*/
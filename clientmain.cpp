@@ -1,5 +1,7 @@
 #include "clientsocket.h"
+#include "socketconnection_base.h"
 #include "threadutils.h"
+#include "fdutils.h"
 #include <iostream>
 #include <cstring>
 
@@ -44,12 +46,12 @@ int main()
                 break;
             }
         }
-        //block until all packets have been written out instead of sleep(1) above
-#if !(defined(WIN32) || defined(__WIN32) || defined(__WIN32__) || defined(FORCE_WIN32))
-        sleep(3);
-#else
-        Sleep(3000);
-#endif
+        //block until all packets have been written out
+        if (!my_sock.Flush(MonotonicNanoseconds() + 10 * 1000000000LL))
+        {
+            cerr << "Failed to flush the queued packets." << endl;
+            return 1;
+        }
     }
     catch (const char* arg)
     {
@@ -88,6 +90,12 @@ void Delete(Packet* pkt)
     delete pkt;
 }
 
+
+void Delete(SocketConnection_Base* sc_arg)
+{
+    delete sc_arg;
+}
+
 /*
 ------------------------------------------------------------------------------
 This software is available under 2 licenses -- choose whichever you prefer.
@@ -3,6 +3,7 @@
 #include "socketconnection_base.h"
 #include "tlssocketconnection.h"  // TODO: Remove this
 #include "fdutils.h"
+#include "eventloop.h"
 #if !(defined(WIN32) || defined(__WIN32) || defined(__WIN32__) || defined(FORCE_WIN32))
 #include <unistd.h>
 #include <netdb.h>
@@ -14,14 +15,33 @@
 #include <iostream>
 #include <sstream>
 #include <cstring>
+#include <cerrno>
 
 using namespace std;
 
+static uint64_t _client_handshakes = 0;
+static uint64_t _client_resumed = 0;
+static uint64_t _client_early_data = 0;
+
 ClientSocket::ClientSocket()
-    : input_buffer(), connection(NULL)
+    : ClientSocket(new EventLoop(), 10000)
+{
+    owns_event_loop = true;
+}
+
+
+ClientSocket::ClientSocket(EventLoop* event_loop_arg, size_t input_entries)
+    : input_buffer(input_entries), event_loop(event_loop_arg), owns_event_loop(false), connection(NULL),
+      connect_watcher(this), disconnected(false), connect_error(0),
+      read_waiter(NULL), read_slot(NULL), read_ready(false), connect_waiter(NULL)
 {
     DEBUG_REPORT_LOCATION;
-    connection = new TLSSocketConnection(NULL, &input_buffer); // TODO: Also, this assumes clients will never implement NewSocketConnection(), which might not be correct.
+    if (event_loop == NULL)
+        throw("A ClientSocket needs an EventLoop.");
+    pthread_mutex_init(&wait_mutex, NULL);
+    connection = new TLSSocketConnection(this, &input_buffer); // TODO: Also, this assumes clients will never implement NewSocketConnection(), which might not be correct.
+    connection->SetEventLoop(event_loop);
+    event_loop->Add(this, -1, 0); // only ever scheduled, to resume coroutines
 }
 
 
@@ -33,21 +53,27 @@ ClientSocket::~ClientSocket()
     WSACleanup(); // TODO: This needs to be static.
 #endif
 
-    connection->Deactivate(); // stop the threads
+    connection->Deactivate(); // leave the event loop
+    event_loop->Remove(&connect_watcher);
+    event_loop->Remove(this);
 
     //CloseDescriptor(connection->GetDescriptor());  // deactivate already does this
 
-    delete connection;
-
     DEBUG_REPORT_LOCATION;
 
-    //clean up anything left in the input buffer
+    //clean up anything left in the input buffer, which still refers to the connection
     Packet* temp;
     while((temp = input_buffer.pop_front()))
     {
+        SocketConnection_Base::PacketTaken(temp);
         delete temp;
     }
 
+    delete connection;
+    if (owns_event_loop)
+        delete event_loop;
+    pthread_mutex_destroy(&wait_mutex);
+
     DEBUG_REPORT_LOCATION;
 }
 
@@ -112,6 +138,7 @@ bool ClientSocket::Connect(const string& ip_address, int port)
         LOG_ERROR_OUT("Failed to allocate an addrinfo");
         return false;
     }
+    SetSessionKey(ip_address, port);
 
     int error_ret = connect(connection->GetDescriptor(), addr->ai_addr, addr->ai_addrlen);
     DeleteResolvedAddress(addr);
@@ -130,7 +157,9 @@ bool ClientSocket::Connect(const string& ip_address, int port)
 
 Packet* ClientSocket::NewPacket()
 {
-    return input_buffer.Consumer();
+    Packet* pkt = input_buffer.Consumer();
+    SocketConnection_Base::PacketTaken(pkt);
+    return pkt;
 }
 
 void ClientSocket::DeletePacket(Packet* pkt) const
@@ -178,11 +207,331 @@ bool ClientSocket::Write(const Packet& pkt)
     return ClientSocket::Write(pkt.GetType(), pkt.GetDataLength(), pkt.GetData());
 }
 
+
+bool ClientSocket::Write(Frame* frame)
+{
+    DEBUG_REPORT_LOCATION;
+    return connection->Write(frame);
+}
+
+
+bool ClientSocket::WriteEarly(const Packet& pkt)
+{
+    DEBUG_REPORT_LOCATION;
+    TLSSocketConnection* tls = dynamic_cast<TLSSocketConnection*>(connection);
+    if (tls == NULL)
+        return Write(pkt);
+
+    Frame* frame = Frame::Create(pkt.GetType(), pkt.GetDataLength(), pkt.GetData());
+    bool written = tls->WriteEarly(frame);
+    frame->Release();
+    return written;
+}
+
+
+WriteCompletion* ClientSocket::WriteWithCompletion(const Packet& pkt, WriteCallback callback, void* context)
+{
+    return connection->WriteWithCompletion(pkt, callback, context);
+}
+
+
+bool ClientSocket::Flush(int64_t deadline_ns)
+{
+    return connection->Flush(deadline_ns);
+}
+
+/*
+    Called on the loop thread when the connection fails.  A coroutine
+    waiting in Read is resumed with NULL.
+*/
 void ClientSocket::DeleteSocketConnection(SocketConnection_Base* sc)
 {
-    //TODO: implement proper cleanup
+    sc->Deactivate();
+    pthread_mutex_lock(&wait_mutex);
+    disconnected = true;
+    bool wake = read_waiter && !read_ready;
+    if (wake)
+    {
+        *read_slot = NULL;
+        read_ready = true;
+    }
+    pthread_mutex_unlock(&wait_mutex);
+    if (wake)
+        event_loop->Schedule(this);
+}
+
+
+/*
+    Every received packet passes through here on the loop thread.  It goes
+    straight to a coroutine waiting in Read if there is one, and is queued
+    otherwise.  Queueing under wait_mutex means a coroutine that finds the
+    queue empty in ReadAwaiter::await_suspend is sure to be seen here.
+*/
+bool ClientSocket::HandlePacket(Packet* pkt)
+{
+    pthread_mutex_lock(&wait_mutex);
+    if (read_waiter && !read_ready)
+    {
+        *read_slot = pkt;
+        read_ready = true;
+        pthread_mutex_unlock(&wait_mutex);
+        event_loop->Schedule(this);
+        return true;
+    }
+    input_buffer.Producer(pkt);
+    pthread_mutex_unlock(&wait_mutex);
+    return true;
+}
+
+
+/*
+    Coroutines are resumed from here rather than from HandlePacket, so they
+    never run in the middle of the connection's own event handling, and may
+    delete this ClientSocket.  Nothing here touches a member after resuming.
+*/
+void ClientSocket::HandleEvents(uint32_t /*events*/)
+{
+#if defined(__cpp_impl_coroutine)
+    void* waiter = NULL;
+    pthread_mutex_lock(&wait_mutex);
+    if (read_ready)
+    {
+        waiter = read_waiter;
+        read_waiter = NULL;
+        read_ready = false;
+    }
+    pthread_mutex_unlock(&wait_mutex);
+    if (waiter)
+        std::coroutine_handle<>::from_address(waiter).resume();
+#endif
+}
+
+
+/*
+    Starts a non-blocking connect.  Returns true if it is in progress, in
+    which case connect_watcher is told when it finishes; otherwise
+    connect_error holds the outcome.
+*/
+bool ClientSocket::StartConnect(const string& ip_address, int port)
+{
+    DEBUG_REPORT_LOCATION;
+    connect_error = -1;
+
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+    {
+        LOG_ERROR_OUT("socket() failed.  errno: " << errno);
+        return false;
+    }
+    connection->SetDescriptor(fd);
+    if (!SetNonBlockingMode(fd))
+    {
+        LOG_ERROR_OUT("Failed to set non-blocking IO mode.");
+        return false;
+    }
+
+    addrinfo* addr = NewResolvedAddress(ip_address, port);
+    if (addr == NULL)
+    {
+        LOG_ERROR_OUT("Failed to allocate an addrinfo");
+        return false;
+    }
+    SetSessionKey(ip_address, port);
+    int error_ret = connect(fd, addr->ai_addr, addr->ai_addrlen);
+    DeleteResolvedAddress(addr);
+
+    if (error_ret == 0)
+    {
+        connect_error = 0;
+        return false;
+    }
+    if (errno != EINPROGRESS)
+    {
+        connect_error = errno;
+        return false;
+    }
+    event_loop->Add(&connect_watcher, fd, EventLoop::EVENT_WRITABLE);
+    return true;
+}
+
+
+/*
+    Sessions are kept per address and port, so every ClientSocket
+    connecting to the same server can resume the last one.
+*/
+void ClientSocket::SetSessionKey(const string& ip_address, int port)
+{
+    TLSSocketConnection* tls = dynamic_cast<TLSSocketConnection*>(connection);
+    if (tls == NULL)
+        return;
+    ostringstream key;
+    key << ip_address << ":" << port;
+    tls->SetSessionKey(key.str());
+}
+
+
+void ClientSocket::HandshakeFinished(SocketConnection_Base* sc, bool succeeded, int64_t /*latency_ns*/)
+{
+    if (!succeeded)
+        return;
+    __atomic_add_fetch(&_client_handshakes, 1, __ATOMIC_RELAXED);
+    TLSSocketConnection* tls = dynamic_cast<TLSSocketConnection*>(sc);
+    if (tls && tls->IsSessionReused())
+        __atomic_add_fetch(&_client_resumed, 1, __ATOMIC_RELAXED);
+    if (tls && tls->IsEarlyDataAccepted())
+        __atomic_add_fetch(&_client_early_data, 1, __ATOMIC_RELAXED);
+}
+
+
+void ClientSocket::GetSessionStats(ClientSessionStats& stats)
+{
+    stats.handshakes = __atomic_load_n(&_client_handshakes, __ATOMIC_RELAXED);
+    stats.resumed = __atomic_load_n(&_client_resumed, __ATOMIC_RELAXED);
+    stats.early_data = __atomic_load_n(&_client_early_data, __ATOMIC_RELAXED);
+}
+
+
+/*
+    Finishes a connect begun by StartConnect, on the loop thread.
+*/
+bool ClientSocket::FinishConnect()
+{
+    if (connect_error)
+    {
+        LOG_ERROR_OUT("Connect failed.  errno: " << connect_error);
+        CloseDescriptor(connection->GetDescriptor());
+        return false;
+    }
+
+    try
+    {
+        connection->StartClientConnection();
+        connection->Activate();
+    }
+    catch (const char* str)
+    {
+        LOG_ERROR_OUT("Failed to set up the connection: " << str);
+        return false;
+    }
+    return true;
+}
+
+
+void ClientSocket::ConnectWatcher::HandleEvents(uint32_t /*events*/)
+{
+    ClientSocket* my_client = client;
+    int fd = my_client->connection->GetDescriptor();
+    my_client->event_loop->Remove(this);
+
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (char*)&error, &length) == -1)
+        error = errno;
+    my_client->connect_error = error;
+
+#if defined(__cpp_impl_coroutine)
+    void* waiter = my_client->connect_waiter;
+    my_client->connect_waiter = NULL;
+    if (waiter)
+        std::coroutine_handle<>::from_address(waiter).resume();
+#endif
 }
 
+
+#if defined(__cpp_impl_coroutine)
+void ClientTask::promise_type::unhandled_exception()
+{
+    try
+    {
+        throw;
+    }
+    catch (const char* str)
+    {
+        LOG_ERROR_OUT("Exception in ClientTask: " << str);
+    }
+    CATCHALL
+    {
+        LOG_ERROR_OUT("Unknown exception in ClientTask.");
+    }
+}
+
+
+ClientSocket::ConnectAwaiter ClientSocket::AsyncConnect(const string& ip_address, int port)
+{
+    ConnectAwaiter awaiter = { this, ip_address, port };
+    return awaiter;
+}
+
+
+/*
+    connect_waiter is set before the connect starts, since connect_watcher
+    may resume the coroutine on the loop thread before this returns.
+*/
+bool ClientSocket::ConnectAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+    client->connect_waiter = handle.address();
+    if (client->StartConnect(ip_address, port))
+        return true;
+    client->connect_waiter = NULL;
+    return false;
+}
+
+
+bool ClientSocket::ConnectAwaiter::await_resume()
+{
+    return client->FinishConnect();
+}
+
+
+ClientSocket::ReadAwaiter ClientSocket::Read()
+{
+    ReadAwaiter awaiter = { this, NULL };
+    return awaiter;
+}
+
+
+bool ClientSocket::ReadAwaiter::await_ready()
+{
+    pkt = client->input_buffer.TryConsumer();
+    return pkt != NULL || client->disconnected;
+}
+
+
+bool ClientSocket::ReadAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+    pthread_mutex_lock(&client->wait_mutex);
+    pkt = client->input_buffer.TryConsumer();
+    if (pkt || client->disconnected)
+    {
+        pthread_mutex_unlock(&client->wait_mutex);
+        return false;
+    }
+    if (client->read_waiter)
+    {
+        pthread_mutex_unlock(&client->wait_mutex);
+        throw("Only one coroutine may wait in ClientSocket::Read at a time.");
+    }
+    client->read_waiter = handle.address();
+    client->read_slot = &pkt;
+    pthread_mutex_unlock(&client->wait_mutex);
+    return true;
+}
+
+
+Packet* ClientSocket::ReadAwaiter::await_resume()
+{
+    SocketConnection_Base::PacketTaken(pkt);
+    return pkt;
+}
+
+
+ClientSocket::WriteAwaiter ClientSocket::AsyncWrite(const Packet& pkt)
+{
+    WriteAwaiter awaiter = { Write(pkt) };
+    return awaiter;
+}
+#endif
+
 /*
 ------------------------------------------------------------------------------
 This software is available under 2 licenses -- choose whichever you prefer.
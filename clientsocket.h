@@ -2,17 +2,66 @@
 #define _CLIENT_SOCKET_H_
 
 #include "packet.h"
-#include "pcqueue.h"
+#include "frame.h"
+#include "writecompletion.h"
+#include "pcring.h"
 #include "socketconnectionowner.h"
+#include "eventloop.h"
 #include <string>
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#endif
 
 using namespace std;
 
+class SocketConnection_Base;
 
-class ClientSocket : public SocketConnectionOwner
+
+struct ClientSessionStats
+{
+    uint64_t handshakes;    // TLS handshakes completed by ClientSockets in this process
+    uint64_t resumed;       // how many of them resumed an earlier session
+    uint64_t early_data;    // how many of those had their early (0-RTT) data accepted
+};
+
+
+#if defined(__cpp_impl_coroutine)
+/*
+    ClientTask
+
+    Return type for coroutines that drive a ClientSocket.  The coroutine
+    starts running right away on the calling thread, continues on the
+    client's EventLoop thread after its first co_await, and frees itself
+    when it finishes.  Nothing waits for it, so it must not outlive the
+    ClientSocket it uses.
+*/
+struct ClientTask
+{
+    struct promise_type
+    {
+        ClientTask get_return_object() { return ClientTask(); }
+        std::suspend_never initial_suspend() noexcept { return std::suspend_never(); }
+        std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+        void return_void() {}
+        void unhandled_exception();
+    };
+};
+#endif
+
+
+class ClientSocket : public SocketConnectionOwner, public EventHandler
 {
 public:
+    /*
+        ClientSocket
+
+        The first form runs the connection on its own EventLoop thread.  The
+        second runs it on event_loop, which may be shared by any number of
+        clients and must outlive them, and sizes the queue of received
+        packets to input_entries.
+    */
     ClientSocket();
+    ClientSocket(EventLoop* event_loop_arg, size_t input_entries = 1024);
     virtual ~ClientSocket();
 
     Packet* NewPacket();
@@ -21,14 +70,143 @@ public:
 
     bool Write(const PacketType& type_arg, const PacketDataLength& data_length_arg, const char* data_arg);
     bool Write(const Packet& pkt);
+    bool Write(Frame* frame);   // see SocketConnection_Base::Write(Frame*)
+
+    /*
+        WriteEarly
+
+        Writes pkt, and when the session from the last connection to the
+        server allows it, sends it along with the TLS ClientHello (0-RTT)
+        so it arrives a round trip sooner.  The server may refuse it, in
+        which case it is sent once the handshake completes, or may have to
+        handle it twice, so it must be one of the idempotent types the
+        server takes early.  Must be called before Connect and before any
+        other Write.
+    */
+    bool WriteEarly(const Packet& pkt);
+
+    /*
+        WriteWithCompletion / Flush
+
+        See SocketConnection_Base.  Flush returns once everything written
+        so far is in the kernel's hands, so a client that is about to exit
+        doesn't lose what it queued last.  It must not be called from a
+        coroutine running on the client's EventLoop.
+    */
+    WriteCompletion* WriteWithCompletion(const Packet& pkt, WriteCallback callback = NULL, void* context = NULL);
+    bool Flush(int64_t deadline_ns = 0);
 
     virtual void DeleteSocketConnection(SocketConnection_Base* sc);
+    virtual bool HandlePacket(Packet* pkt);
+    virtual void HandleEvents(uint32_t events);
+    virtual void HandshakeFinished(SocketConnection_Base* sc, bool succeeded, int64_t latency_ns);
+
+    /*
+        Connect
 
+        The TLS session from the last connection to the same address and
+        port, by any ClientSocket in the process, is offered to the server
+        again, so reconnecting usually costs an abbreviated handshake.
+    */
 	bool Connect(const string& ip_address, int port);
 
+    /*
+        GetSessionStats
+
+        How many handshakes ClientSockets have completed, and how many of
+        those resumed a session.
+    */
+    static void GetSessionStats(ClientSessionStats& stats);
+
+#if defined(__cpp_impl_coroutine)
+    /*
+        Awaitable Connect / Read / Write
+
+        For use from a ClientTask; nothing here blocks the thread.
+
+        co_await Connect(ip_address, port) yields true once the connection
+        is up.  The TLS handshake then finishes on the EventLoop; anything
+        written meanwhile is sent once it is done.
+
+        co_await Read() yields the next packet, to be passed to
+        DeletePacket(), or NULL once the connection has gone away.  Only
+        one coroutine may wait in Read at a time.
+
+        co_await Write(...) yields whether the packet was queued, as the
+        plain Write does.
+    */
+    struct ConnectAwaiter
+    {
+        ClientSocket* client;
+        string ip_address;
+        int port;
+
+        bool await_ready() { return false; }
+        bool await_suspend(std::coroutine_handle<> handle);
+        bool await_resume();
+    };
+
+    struct ReadAwaiter
+    {
+        ClientSocket* client;
+        Packet* pkt;
+
+        bool await_ready();
+        bool await_suspend(std::coroutine_handle<> handle);
+        Packet* await_resume();
+    };
+
+    struct WriteAwaiter
+    {
+        bool result;
+
+        bool await_ready() { return true; }
+        void await_suspend(std::coroutine_handle<> /*handle*/) {}
+        bool await_resume() { return result; }
+    };
+
+    ConnectAwaiter AsyncConnect(const string& ip_address, int port);
+    ReadAwaiter Read();
+    WriteAwaiter AsyncWrite(const Packet& pkt);
+#endif
+
 private:
-    PCQueue<Packet*> input_buffer;
+    /*
+        ConnectWatcher
+
+        Waits on the EventLoop for a non-blocking connect() to finish.
+    */
+    class ConnectWatcher : public EventHandler
+    {
+    public:
+        ConnectWatcher(ClientSocket* client_arg) : client(client_arg) {}
+        virtual void HandleEvents(uint32_t events);
+    private:
+        ClientSocket* client;
+    };
+
+    bool StartConnect(const string& ip_address, int port);
+    bool FinishConnect();
+    void SetSessionKey(const string& ip_address, int port);
+
+    PCRing<Packet*> input_buffer;
+    EventLoop* event_loop;
+    bool owns_event_loop;
     SocketConnection_Base* connection;
+    ConnectWatcher connect_watcher;
+    pthread_mutex_t wait_mutex;
+    volatile bool disconnected;
+    int connect_error;
+
+    /*
+        Suspended coroutines, kept as coroutine_handle addresses so this
+        class doesn't need C++20.  read_slot points at the waiting
+        ReadAwaiter's pkt, and read_ready is set once it has been filled.
+    */
+    void* read_waiter;
+    Packet** read_slot;
+    bool read_ready;
+    void* connect_waiter;
 
     // disable these
     bool Write(const char* cstring_arg);
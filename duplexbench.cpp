@@ -0,0 +1,250 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <pthread.h>
+#include <sys/time.h>
+#include "tlssocketconnection.h"
+#include "serversocket.h"
+#include "clientsocket.h"
+#include "packet.h"
+#include "logger.h"
+
+using namespace std;
+
+/*
+    duplexbench
+
+    Full-duplex throughput benchmark for TLS connections.  Starts a
+    ServerSocket with one EventLoop and a ClientSocket connected to it over
+    loopback, then sends frames of the given size from the client to the
+    server, from the server to the client, and finally both ways at once.
+    Reports the frames and megabytes per second that arrive in each case.
+    Each end of the connection makes its SSL calls for both directions on
+    its EventLoop thread, while the application threads only queue frames
+    and take packets.
+
+    Like the server, it loads ./server.crt and ./server.key.
+
+    usage: duplexbench [frames] [frame size] [port]
+*/
+
+struct Direction
+{
+    ServerSocket* server;
+    ClientSocket* client;
+    bool upstream;          // client to server
+    long count;
+    int size;
+    long received;
+    bool in_order;
+    double finished;
+};
+
+static double Now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void* SendFrames(void* void_arg)
+{
+    Direction* args = (Direction*)void_arg;
+    string payload(args->size, 'd');
+    for(long i = 0; i < args->count; i++)
+    {
+        memcpy(&payload[0], &i, sizeof(i));
+        Packet pkt(Packet::DATA_LOG_MESSAGE, payload.size(), payload.data());
+        bool written = args->upstream ? args->client->Write(pkt) : args->server->WriteAll(&pkt);
+        if(!written)
+        {
+            cerr << "Write failed." << endl;
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void* ReceiveFrames(void* void_arg)
+{
+    Direction* args = (Direction*)void_arg;
+    while(args->received < args->count)
+    {
+        Packet* pkt = args->upstream ? args->server->NewPacket() : args->client->NewPacket();
+        if(pkt == NULL)
+        {
+            if(args->upstream)
+                continue;   // the server's queue hands out empty entries too
+            cerr << "The connection went away." << endl;
+            break;
+        }
+        long sequence;
+        memcpy(&sequence, pkt->GetData(), sizeof(sequence));
+        if(sequence != args->received || pkt->GetDataLength() != (PacketDataLength)args->size)
+            args->in_order = false;
+        args->received++;
+        if(args->upstream)
+            args->server->DeletePacket(pkt);
+        else
+            args->client->DeletePacket(pkt);
+    }
+    args->finished = Now();
+    return NULL;
+}
+
+static void Report(const char* name, const Direction& direction, double start)
+{
+    double elapsed = direction.finished - start;
+    cout << name << ": " << direction.received << " frames in " << elapsed << "s, "
+         << (long long)(direction.received / elapsed) << " frames/s, "
+         << direction.received * (double)direction.size / elapsed / 1000000.0 << " MB/s"
+         << (direction.in_order ? "" : " (OUT OF ORDER)") << endl;
+}
+
+static void Run(ServerSocket* server, ClientSocket* client, long count, int size, bool up, bool down)
+{
+    Direction directions[2];
+    pthread_t senders[2];
+    pthread_t receivers[2];
+    bool used[2] = {up, down};
+
+    double start = Now();
+    for(int i = 0; i < 2; i++)
+    {
+        directions[i].server = server;
+        directions[i].client = client;
+        directions[i].upstream = i == 0;
+        directions[i].count = count;
+        directions[i].size = size;
+        directions[i].received = 0;
+        directions[i].in_order = true;
+        directions[i].finished = start;
+        if(!used[i])
+            continue;
+        pthread_create(&receivers[i], NULL, ReceiveFrames, &directions[i]);
+        pthread_create(&senders[i], NULL, SendFrames, &directions[i]);
+    }
+    for(int i = 0; i < 2; i++)
+    {
+        if(!used[i])
+            continue;
+        pthread_join(senders[i], NULL);
+        pthread_join(receivers[i], NULL);
+    }
+
+    if(up && down)
+    {
+        Report("both ways, up  ", directions[0], start);
+        Report("both ways, down", directions[1], start);
+        double elapsed = max(directions[0].finished, directions[1].finished) - start;
+        cout << "both ways, total: " << (long long)((directions[0].received + directions[1].received) / elapsed) << " frames/s, "
+             << (directions[0].received + directions[1].received) * (double)size / elapsed / 1000000.0 << " MB/s" << endl;
+    }
+    else if(up)
+        Report("client to server", directions[0], start);
+    else
+        Report("server to client", directions[1], start);
+}
+
+int main(int argc, char** argv)
+{
+    long count = argc > 1 ? atol(argv[1]) : 200000;
+    int size = argc > 2 ? atoi(argv[2]) : 1024;
+    int port = argc > 3 ? atoi(argv[3]) : 7258;
+
+    if(count < 1 || size < (int)sizeof(long))
+    {
+        cerr << "usage: " << argv[0] << " [frames] [frame size, at least " << sizeof(long) << "] [port]" << endl;
+        return -1;
+    }
+
+    try
+    {
+        ServerSocketOptions options;
+        options.event_loop_count = 1;
+        ServerSocket server("127.0.0.1", port, options);
+        ClientSocket client;
+        if(!client.Connect("127.0.0.1", port))
+        {
+            cerr << "Could not connect to the server." << endl;
+            return -1;
+        }
+
+        Run(&server, &client, count, size, true, false);
+        Run(&server, &client, count, size, false, true);
+        Run(&server, &client, count, size, true, true);
+    }
+    catch (const char* arg)
+    {
+        cout << "Exception: " << arg << endl;
+        return -1;
+    }
+    return 0;
+}
+
+
+Packet* NewPacket(SocketConnection_Base* sc_arg, const PacketType& type_arg, const PacketDataLength& data_length_arg, char* data_arg, bool copy)
+{
+    return new Packet(sc_arg, type_arg, data_length_arg, data_arg, copy);
+}
+
+
+void Delete(Packet* pkt)
+{
+    delete pkt;
+}
+
+
+SocketConnection_Base* NewSocketConnection(SocketConnectionOwner* owner, PacketPtrSet* ppsp_arg)
+{
+    return new TLSSocketConnection(owner, ppsp_arg);
+}
+
+
+void Delete(SocketConnection_Base* sc)
+{
+    delete sc;
+}
+
+/*
+------------------------------------------------------------------------------
+This software is available under 2 licenses -- choose whichever you prefer.
+------------------------------------------------------------------------------
+ALTERNATIVE A - MIT License
+Copyright (c) 2003-2019 Bobby G. Burrough
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to 
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+of the Software, and to permit persons to whom the Software is furnished to do 
+so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+SOFTWARE.
+------------------------------------------------------------------------------
+ALTERNATIVE B - Public Domain (www.unlicense.org)
+This is free and unencumbered software released into the public domain.
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this 
+software, either in source code form or as a compiled binary, for any purpose, 
+commercial or non-commercial, and by any means.
+In jurisdictions that recognize copyright laws, the author or authors of this 
+software dedicate any and all copyright interest in the software to the public 
+domain. We make this dedication for the benefit of the public at large and to 
+the detriment of our heirs and successors. We intend this dedication to be an 
+overt act of relinquishment in perpetuity of all present and future rights to 
+this software under copyright law.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN 
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION 
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+------------------------------------------------------------------------------
+*/
@@ -0,0 +1,555 @@
+
+#include "eventloop.h"
+#include "uringengine.h"
+#include "logger.h"
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#endif
+
+using namespace std;
+
+static const int max_events_per_wait = 256;
+static const size_t scratch_size = 64 * 1024;
+
+
+EventLoop::EventLoop(IOBackend backend)
+    : next_generation(1), dispatching(NULL), running(true), poll_descriptor(-1), uring(NULL), scratch(NULL)
+{
+    DEBUG_REPORT_LOCATION;
+
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&dispatch_done, NULL);
+
+#if defined(__linux__)
+    poll_descriptor = epoll_create1(EPOLL_CLOEXEC);
+    if (poll_descriptor == -1)
+        throw("epoll_create1() failed.");
+
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = 0; // generation 0 marks the wake descriptor
+    if (0 != epoll_ctl(poll_descriptor, EPOLL_CTL_ADD, wakeup.GetDescriptor(), &ev))
+    {
+        close(poll_descriptor);
+        throw("epoll_ctl() failed to add the wake descriptor.");
+    }
+#endif
+
+    // the engine must exist before the loop thread starts reading uring
+    if (backend == IO_BACKEND_IO_URING)
+    {
+        try
+        {
+            uring = new URingEngine(this);
+        }
+        catch (const char* e)
+        {
+            LOG_ERROR_OUT("io_uring is unavailable, using readiness events instead: " << e);
+        }
+    }
+
+    scratch = new char[scratch_size];
+    if (0 != pthread_create(&thread_id, NULL, EventLoop::Run, this))
+        throw("pthread_create() failed for EventLoop.");
+}
+
+
+EventLoop::~EventLoop()
+{
+    DEBUG_REPORT_LOCATION;
+
+    Stop();
+
+    delete uring;
+    delete [] scratch;
+
+    if (poll_descriptor != -1)
+        close(poll_descriptor);
+
+    pthread_cond_destroy(&dispatch_done);
+    pthread_mutex_destroy(&mutex);
+}
+
+
+void EventLoop::Stop()
+{
+    DEBUG_REPORT_LOCATION;
+    pthread_mutex_lock(&mutex);
+    bool was_running = running;
+    running = false;
+    pthread_mutex_unlock(&mutex);
+    if (!was_running)
+        return;
+    wakeup.Wake();
+    pthread_join(thread_id, NULL);
+}
+
+
+void EventLoop::ControlDescriptor(int op, uint64_t generation, int file_descriptor, uint32_t interest)
+{
+#if defined(__linux__)
+    epoll_event ev;
+    ev.events = 0;
+    if (interest & EVENT_READABLE)
+        ev.events |= EPOLLIN | EPOLLRDHUP;
+    if (interest & EVENT_WRITABLE)
+        ev.events |= EPOLLOUT;
+    ev.data.u64 = generation;
+    if (0 != epoll_ctl(poll_descriptor, op, file_descriptor, &ev) && op != EPOLL_CTL_DEL)
+    {
+        LOG_ERROR_OUT("epoll_ctl() failed.  errno: " << errno);
+        throw("epoll_ctl() failed.");
+    }
+#else
+    // the poll() backend rebuilds its descriptor set on every pass
+    wakeup.Wake();
+#endif
+}
+
+
+void EventLoop::Add(EventHandler* handler, int file_descriptor, uint32_t interest)
+{
+    DEBUG_REPORT_LOCATION;
+    pthread_mutex_lock(&mutex);
+    Registration& r = registrations[handler];
+    if (r.generation)
+        generations.erase(r.generation); // added again without a Remove
+    r.generation = next_generation++;
+    generations[r.generation] = handler;
+    r.file_descriptor = file_descriptor;
+    r.interest = interest;
+    r.scheduled = false;
+    r.deadline = 0;
+    try
+    {
+        if (file_descriptor >= 0)
+        {
+#if defined(__linux__)
+            ControlDescriptor(EPOLL_CTL_ADD, r.generation, file_descriptor, interest);
+#else
+            ControlDescriptor(0, r.generation, file_descriptor, interest);
+#endif
+        }
+    }
+    catch (const char*)
+    {
+        generations.erase(r.generation);
+        registrations.erase(handler);
+        pthread_mutex_unlock(&mutex);
+        throw;
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+
+void EventLoop::Modify(EventHandler* handler, uint32_t interest)
+{
+    pthread_mutex_lock(&mutex);
+    map<EventHandler*, Registration>::iterator it = registrations.find(handler);
+    if (it != registrations.end() && it->second.interest != interest && it->second.file_descriptor >= 0)
+    {
+        it->second.interest = interest;
+#if defined(__linux__)
+        ControlDescriptor(EPOLL_CTL_MOD, it->second.generation, it->second.file_descriptor, interest);
+#else
+        ControlDescriptor(0, it->second.generation, it->second.file_descriptor, interest);
+#endif
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+
+void EventLoop::Remove(EventHandler* handler)
+{
+    DEBUG_REPORT_LOCATION;
+    pthread_mutex_lock(&mutex);
+    map<EventHandler*, Registration>::iterator it = registrations.find(handler);
+    if (it != registrations.end())
+    {
+        if (it->second.file_descriptor >= 0)
+#if defined(__linux__)
+            ControlDescriptor(EPOLL_CTL_DEL, it->second.generation, it->second.file_descriptor, 0);
+#else
+            ControlDescriptor(0, it->second.generation, it->second.file_descriptor, 0);
+#endif
+        generations.erase(it->second.generation);
+        registrations.erase(it);
+    }
+
+    if (!IsLoopThread())
+    {
+        while (dispatching == handler)
+            pthread_cond_wait(&dispatch_done, &mutex);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+
+void EventLoop::Schedule(EventHandler* handler)
+{
+    bool wake = false;
+    pthread_mutex_lock(&mutex);
+    map<EventHandler*, Registration>::iterator it = registrations.find(handler);
+    if (it != registrations.end() && !it->second.scheduled)
+    {
+        it->second.scheduled = true;
+        wake = scheduled.empty();
+        scheduled.push_back(it->second.generation);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    if (wake && !IsLoopThread())
+        wakeup.Wake();
+}
+
+
+void EventLoop::ScheduleAfter(EventHandler* handler, int64_t delay_ns)
+{
+    bool wake = false;
+    int64_t deadline = MonotonicNanoseconds() + (delay_ns > 0 ? delay_ns : 0);
+    pthread_mutex_lock(&mutex);
+    map<EventHandler*, Registration>::iterator it = registrations.find(handler);
+    if (it != registrations.end() && (it->second.deadline == 0 || deadline < it->second.deadline))
+    {
+        it->second.deadline = deadline;
+        wake = timers.empty() || deadline < timers.begin()->first;
+        timers.insert(make_pair(deadline, handler));
+    }
+    pthread_mutex_unlock(&mutex);
+
+    if (wake && !IsLoopThread())
+        wakeup.Wake(); // the loop has to shorten its wait
+}
+
+
+bool EventLoop::IsLoopThread() const
+{
+    return pthread_equal(pthread_self(), thread_id);
+}
+
+
+URingEngine* EventLoop::GetURingEngine() const
+{
+    return uring;
+}
+
+
+char* EventLoop::GetScratchBuffer(size_t& size) const
+{
+    size = scratch_size;
+    return scratch;
+}
+
+
+size_t EventLoop::GetHandlerCount()
+{
+    pthread_mutex_lock(&mutex);
+    size_t count = registrations.size();
+    pthread_mutex_unlock(&mutex);
+    return count;
+}
+
+
+void EventLoop::Dispatch(uint64_t generation, uint32_t events)
+{
+    pthread_mutex_lock(&mutex);
+    map<uint64_t, EventHandler*>::iterator it = generations.find(generation);
+    if (it == generations.end())
+    {
+        // removed while this event was in flight
+        pthread_mutex_unlock(&mutex);
+        return;
+    }
+    EventHandler* handler = it->second;
+    dispatching = handler;
+    pthread_mutex_unlock(&mutex);
+
+    try
+    {
+        handler->HandleEvents(events);
+    }
+    catch (const char* e)
+    {
+        LOG_ERROR_OUT("Exception in HandleEvents: " << e);
+    }
+    CATCHALL
+    {
+        LOG_ERROR_OUT("Unknown exception in HandleEvents.");
+    }
+
+    pthread_mutex_lock(&mutex);
+    dispatching = NULL;
+    pthread_cond_broadcast(&dispatch_done);
+    pthread_mutex_unlock(&mutex);
+}
+
+
+void EventLoop::RunScheduled()
+{
+    vector<uint64_t> ready;
+    pthread_mutex_lock(&mutex);
+    ready.swap(scheduled);
+    for (size_t i = 0; i < ready.size(); i++)
+    {
+        map<uint64_t, EventHandler*>::iterator handler = generations.find(ready[i]);
+        if (handler != generations.end())
+            registrations[handler->second].scheduled = false;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    for (size_t i = 0; i < ready.size(); i++)
+        Dispatch(ready[i], EVENT_SCHEDULED);
+}
+
+
+/*
+    Moves every handler whose timer has expired onto the scheduled list.
+    Entries left behind by a removed handler, or superseded by an earlier
+    deadline, no longer match their registration and are simply dropped.
+*/
+void EventLoop::RunTimers()
+{
+    pthread_mutex_lock(&mutex);
+    if (!timers.empty())
+    {
+        int64_t now = MonotonicNanoseconds();
+        while (!timers.empty() && timers.begin()->first <= now)
+        {
+            multimap<int64_t, EventHandler*>::iterator timer = timers.begin();
+            map<EventHandler*, Registration>::iterator it = registrations.find(timer->second);
+            if (it != registrations.end() && it->second.deadline == timer->first)
+            {
+                it->second.deadline = 0;
+                if (!it->second.scheduled)
+                {
+                    it->second.scheduled = true;
+                    scheduled.push_back(it->second.generation);
+                }
+            }
+            timers.erase(timer);
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+
+/*
+    Nanoseconds until the earliest timer, or -1 if there are none.  Must be
+    called with the mutex held.
+*/
+int64_t EventLoop::GetTimerWait()
+{
+    if (timers.empty())
+        return -1;
+    int64_t wait = timers.begin()->first - MonotonicNanoseconds();
+    return wait > 0 ? wait : 0;
+}
+
+
+void* EventLoop::Run(void* void_arg)
+{
+    EventLoop* loop = (EventLoop*)void_arg;
+    DEBUG_REPORT_LOCATION;
+
+#if !(defined(WIN32) || defined(__WIN32) || defined(__WIN32__) || defined(FORCE_WIN32))
+    /*
+        Plaintext connections write with MSG_NOSIGNAL, but OpenSSL writes
+        TLS records with plain write(), which raises SIGPIPE once the peer
+        has gone.  A TLS 1.3 server sends its session tickets after the
+        handshake, often to a client that has already hung up.  With the
+        signal blocked here the write fails with EPIPE instead.
+    */
+    sigset_t pipe_signal;
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_signal, NULL);
+#endif
+
+#if defined(__linux__)
+    epoll_event events[max_events_per_wait];
+#else
+    vector<WaitDescriptor> descriptors;
+    vector<uint64_t> generations;
+#endif
+
+    while (1)
+    {
+        pthread_mutex_lock(&loop->mutex);
+        bool keep_running = loop->running;
+        int64_t wait_ns = loop->scheduled.empty() ? loop->GetTimerWait() : 0;
+#if !defined(__linux__)
+        descriptors.clear();
+        generations.clear();
+        for (map<EventHandler*, Registration>::iterator it = loop->registrations.begin(); it != loop->registrations.end(); ++it)
+        {
+            if (it->second.file_descriptor < 0)
+                continue;
+            WaitDescriptor d;
+            d.file_descriptor = it->second.file_descriptor;
+            d.events = 0;
+            if (it->second.interest & EVENT_READABLE)
+                d.events |= WAIT_READABLE;
+            if (it->second.interest & EVENT_WRITABLE)
+                d.events |= WAIT_WRITABLE;
+            descriptors.push_back(d);
+            generations.push_back(it->second.generation);
+        }
+#endif
+        pthread_mutex_unlock(&loop->mutex);
+
+        if (!keep_running)
+            break;
+
+#if defined(__linux__)
+        int timeout = wait_ns < 0 ? -1 : (int)((wait_ns + 999999) / 1000000);
+        int n = epoll_wait(loop->poll_descriptor, events, max_events_per_wait, timeout);
+        if (n == -1 && errno != EINTR)
+        {
+            LOG_ERROR_OUT("epoll_wait() failed.  errno: " << errno);
+            break;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            uint64_t generation = events[i].data.u64;
+            if (generation == 0)
+            {
+                loop->wakeup.Drain();
+                continue;
+            }
+            uint32_t mask = 0;
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP))
+                mask |= EVENT_READABLE;
+            if (events[i].events & EPOLLOUT)
+                mask |= EVENT_WRITABLE;
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+                mask |= EVENT_ERROR;
+            loop->Dispatch(generation, mask);
+        }
+#else
+        int n = WaitForDescriptors(descriptors.empty() ? NULL : &descriptors[0], descriptors.size(), wait_ns, &loop->wakeup);
+        if (n == -1)
+        {
+            LOG_ERROR_OUT("WaitForDescriptors() failed.  errno: " << errno);
+            break;
+        }
+        for (size_t i = 0; n > 0 && i < descriptors.size(); i++)
+        {
+            if (descriptors[i].ready == 0)
+                continue;
+            uint32_t mask = 0;
+            if (descriptors[i].ready & WAIT_READABLE)
+                mask |= EVENT_READABLE;
+            if (descriptors[i].ready & WAIT_WRITABLE)
+                mask |= EVENT_WRITABLE;
+            if (descriptors[i].ready & WAIT_ERROR)
+                mask |= EVENT_ERROR;
+            loop->Dispatch(generations[i], mask);
+        }
+#endif
+
+        loop->RunTimers();
+        loop->RunScheduled();
+    }
+
+    DEBUG_REPORT_LOCATION;
+    return NULL;
+}
+
+
+
+EventLoopPool::EventLoopPool(size_t count, IOBackend backend)
+    : next_index(0)
+{
+    pthread_mutex_init(&mutex, NULL);
+
+    if (count == 0)
+    {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        count = online > 0 ? (size_t)online : 1;
+    }
+
+    for (size_t i = 0; i < count; i++)
+        loops.push_back(new EventLoop(backend));
+}
+
+
+EventLoopPool::~EventLoopPool()
+{
+    for (size_t i = 0; i < loops.size(); i++)
+        delete loops[i];
+    pthread_mutex_destroy(&mutex);
+}
+
+
+void EventLoopPool::Stop()
+{
+    for (size_t i = 0; i < loops.size(); i++)
+        loops[i]->Stop();
+}
+
+
+EventLoop* EventLoopPool::Next()
+{
+    pthread_mutex_lock(&mutex);
+    EventLoop* loop = loops[next_index];
+    next_index = (next_index + 1) % loops.size();
+    pthread_mutex_unlock(&mutex);
+    return loop;
+}
+
+
+EventLoop* EventLoopPool::Get(size_t index) const
+{
+    return loops[index];
+}
+
+
+size_t EventLoopPool::GetCount() const
+{
+    return loops.size();
+}
+
+/*
+------------------------------------------------------------------------------
+This software is available under 2 licenses -- choose whichever you prefer.
+------------------------------------------------------------------------------
+ALTERNATIVE A - MIT License
+Copyright (c) 2003-2019 Bobby G. Burrough
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to 
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+of the Software, and to permit persons to whom the Software is furnished to do 
+so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+SOFTWARE.
+------------------------------------------------------------------------------
+ALTERNATIVE B - Public Domain (www.unlicense.org)
+This is free and unencumbered software released into the public domain.
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this 
+software, either in source code form or as a compiled binary, for any purpose, 
+commercial or non-commercial, and by any means.
+In jurisdictions that recognize copyright laws, the author or authors of this 
+software dedicate any and all copyright interest in the software to the public 
+domain. We make this dedication for the benefit of the public at large and to 
+the detriment of our heirs and successors. We intend this dedication to be an 
+overt act of relinquishment in perpetuity of all present and future rights to 
+this software under copyright law.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN 
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION 
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+------------------------------------------------------------------------------
+*/
@@ -0,0 +1,258 @@
+#ifndef _EVENT_LOOP_H_
+#define _EVENT_LOOP_H_
+
+#include "threadutils.h"
+#include "fdutils.h"
+#include <cstdint>
+#include <cstddef>
+#include <map>
+#include <vector>
+
+using namespace std;
+
+class URingEngine;
+
+
+/*
+    IOBackend
+
+    IO_BACKEND_EPOLL waits for readiness and moves bytes with read()/write()
+    (poll() on platforms without epoll).  IO_BACKEND_IO_URING additionally
+    gives every loop an io_uring instance that plaintext connections use to
+    receive with multishot reads into provided buffers and to send with
+    gathered writes, falling back to readiness events when the kernel lacks
+    support.
+*/
+enum IOBackend
+{
+    IO_BACKEND_EPOLL,
+    IO_BACKEND_IO_URING
+};
+
+
+class EventHandler
+{
+public:
+    virtual ~EventHandler() {}
+
+    /*
+        HandleEvents
+
+        Called on the thread of the EventLoop the handler is registered with
+        whenever its descriptor becomes ready, or after Schedule() was called
+        for it.  events is a mask of EventLoop::Events.
+
+        A handler is allowed to remove (and delete) itself from within
+        HandleEvents, provided it does not touch any of its members afterwards.
+    */
+    virtual void HandleEvents(uint32_t events) = 0;
+};
+
+
+class EventLoop
+{
+public:
+    enum Events
+    {
+        EVENT_READABLE = 0x01,
+        EVENT_WRITABLE = 0x02,
+        EVENT_ERROR = 0x04,
+        EVENT_SCHEDULED = 0x08
+    };
+
+    /*
+        EventLoop
+
+        Spawns a single thread that waits for readiness on every descriptor
+        registered with the loop (epoll on Linux, poll() elsewhere) and
+        dispatches to the owning EventHandler.
+    */
+    EventLoop(IOBackend backend = IO_BACKEND_EPOLL);
+    virtual ~EventLoop();
+
+    /*
+        Add / Modify / Remove
+
+        Register, change the interest mask of, or unregister a handler.  interest
+        is a mask of EVENT_READABLE and EVENT_WRITABLE.  file_descriptor may be
+        -1 for a handler that is only ever Schedule()d.
+
+        When Remove is called from a thread other than the loop thread, it will
+        block until the handler is no longer being dispatched.  After Remove
+        returns, the loop will never call into the handler again.
+    */
+    void Add(EventHandler* handler, int file_descriptor, uint32_t interest);
+    void Modify(EventHandler* handler, uint32_t interest);
+    void Remove(EventHandler* handler);
+
+    /*
+        Schedule
+
+        May be called from any thread.  Causes HandleEvents(EVENT_SCHEDULED)
+        to be called on the loop thread at the next opportunity.  Multiple
+        calls before the handler runs are coalesced into one.  Does nothing if
+        the handler is not registered.
+    */
+    void Schedule(EventHandler* handler);
+
+    /*
+        ScheduleAfter
+
+        Like Schedule, but the handler runs once delay_ns nanoseconds have
+        passed.  If the handler already has a timer pending, the earlier of
+        the two deadlines is kept.  Timers are dropped when the handler is
+        removed.  On epoll the wait is rounded up to whole milliseconds.
+    */
+    void ScheduleAfter(EventHandler* handler, int64_t delay_ns);
+
+    /*
+        Stop
+
+        Ends the loop thread and waits for it to exit.  No handler is
+        dispatched once Stop returns, though handlers may still be added,
+        removed and scheduled.  Must not be called from the loop thread.
+        Calling it again does nothing.
+    */
+    void Stop();
+
+    bool IsLoopThread() const;
+    size_t GetHandlerCount();
+
+    /*
+        GetURingEngine
+
+        Returns the loop's io_uring engine, or NULL if the loop was created
+        for readiness events only or io_uring is unavailable.
+    */
+    URingEngine* GetURingEngine() const;
+
+    /*
+        GetScratchBuffer
+
+        A buffer owned by the loop that handlers may use from within
+        HandleEvents, for data they are done with by the time they return.
+        Sets size to its length.  Only valid on the loop thread.
+    */
+    char* GetScratchBuffer(size_t& size) const;
+
+private:
+    /*
+        Every Add gets a new generation, and events name the registration
+        by generation rather than by handler.  An event still in flight for
+        a handler that was removed, and freed, can't reach a new handler
+        that happens to be allocated at the same address.
+    */
+    struct Registration
+    {
+        uint64_t generation;
+        int file_descriptor;
+        uint32_t interest;
+        bool scheduled;
+        int64_t deadline;       // pending ScheduleAfter timer, 0 if none
+    };
+
+    static void* Run(void* void_arg);
+
+    void Dispatch(uint64_t generation, uint32_t events);
+    void RunScheduled();
+    void RunTimers();
+    int64_t GetTimerWait();
+    void ControlDescriptor(int op, uint64_t generation, int file_descriptor, uint32_t interest);
+
+    map<EventHandler*, Registration> registrations;
+    map<uint64_t, EventHandler*> generations;  // the registered handlers, by generation
+    uint64_t next_generation;                   // 0 marks the wake descriptor
+    vector<uint64_t> scheduled;
+    multimap<int64_t, EventHandler*> timers;
+    EventHandler* dispatching;
+    pthread_mutex_t mutex;
+    pthread_cond_t dispatch_done;
+    pthread_t thread_id;
+    volatile bool running;
+
+    int poll_descriptor;        // epoll instance, unused by the poll() backend
+    WaitWakeup wakeup;
+    URingEngine* uring;
+    char* scratch;
+};
+
+
+class EventLoopPool
+{
+public:
+    /*
+        EventLoopPool
+
+        Creates count EventLoops using backend.  If count is 0, one loop is
+        created per online processor.
+    */
+    EventLoopPool(size_t count, IOBackend backend = IO_BACKEND_EPOLL);
+    ~EventLoopPool();
+
+    /*
+        Next
+
+        Returns the loops in round-robin order, used to spread new
+        connections evenly across the loop threads.
+    */
+    EventLoop* Next();
+
+    /*
+        Stop
+
+        Stops every loop in the pool.  See EventLoop::Stop.
+    */
+    void Stop();
+
+    EventLoop* Get(size_t index) const;
+    size_t GetCount() const;
+
+private:
+    vector<EventLoop*> loops;
+    size_t next_index;
+    pthread_mutex_t mutex;
+};
+
+#endif // _EVENT_LOOP_H_
+
+/*
+------------------------------------------------------------------------------
+This software is available under 2 licenses -- choose whichever you prefer.
+------------------------------------------------------------------------------
+ALTERNATIVE A - MIT License
+Copyright (c) 2003-2019 Bobby G. Burrough
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to 
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+of the Software, and to permit persons to whom the Software is furnished to do 
+so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+SOFTWARE.
+------------------------------------------------------------------------------
+ALTERNATIVE B - Public Domain (www.unlicense.org)
+This is free and unencumbered software released into the public domain.
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this 
+software, either in source code form or as a compiled binary, for any purpose, 
+commercial or non-commercial, and by any means.
+In jurisdictions that recognize copyright laws, the author or authors of this 
+software dedicate any and all copyright interest in the software to the public 
+domain. We make this dedication for the benefit of the public at large and to 
+the detriment of our heirs and successors. We intend this dedication to be an 
+overt act of relinquishment in perpetuity of all present and future rights to 
+this software under copyright law.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN 
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION 
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+------------------------------------------------------------------------------
+*/
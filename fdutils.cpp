@@ -1,9 +1,18 @@
 
 #include "fdutils.h"
+#include <errno.h>
 
 #if !(defined(WIN32) || defined(__WIN32) || defined(__WIN32__) || defined(FORCE_WIN32))
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
 #endif
 
 
@@ -17,13 +26,173 @@ bool operator==(const timeval& x, const timeval& y)
 }
 
 
-int WaitUntilReadableWithTimeval(int file_descriptor, timeval* t)
+int64_t MonotonicNanoseconds()
+{
+#if !(defined(WIN32) || defined(__WIN32) || defined(__WIN32__) || defined(FORCE_WIN32))
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+#else
+    return (int64_t)GetTickCount64() * 1000000LL;
+#endif
+}
+
+
+WaitWakeup::WaitWakeup()
+{
+#if defined(__linux__)
+    descriptors[0] = descriptors[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (descriptors[0] == -1)
+        throw("eventfd() failed.");
+#elif !(defined(WIN32) || defined(__WIN32) || defined(__WIN32__) || defined(FORCE_WIN32))
+    if (0 != pipe(descriptors))
+        throw("pipe() failed.");
+    for (int i = 0; i < 2; i++)
+    {
+        fcntl(descriptors[i], F_SETFL, fcntl(descriptors[i], F_GETFL, 0) | O_NONBLOCK);
+        fcntl(descriptors[i], F_SETFD, FD_CLOEXEC);
+    }
+#else
+    throw("WaitWakeup is not supported on this platform.");
+#endif
+}
+
+
+WaitWakeup::~WaitWakeup()
+{
+#if !(defined(WIN32) || defined(__WIN32) || defined(__WIN32__) || defined(FORCE_WIN32))
+    if (descriptors[0] != descriptors[1])
+        close(descriptors[1]);
+    close(descriptors[0]);
+#endif
+}
+
+
+void WaitWakeup::Wake()
+{
+#if !(defined(WIN32) || defined(__WIN32) || defined(__WIN32__) || defined(FORCE_WIN32))
+    uint64_t one = 1;
+    ssize_t rv = write(descriptors[1], &one, descriptors[0] == descriptors[1] ? sizeof(one) : 1);
+    (void)rv; // a full pipe or saturated eventfd already guarantees a wakeup
+#endif
+}
+
+
+void WaitWakeup::Drain()
+{
+#if !(defined(WIN32) || defined(__WIN32) || defined(__WIN32__) || defined(FORCE_WIN32))
+    char buf[64];
+    while (read(descriptors[0], buf, sizeof(buf)) > 0)
+        ;
+#endif
+}
+
+
+int WaitWakeup::GetDescriptor() const
+{
+    return descriptors[0];
+}
+
+
+int WaitForDescriptors(WaitDescriptor* descriptors, size_t count, int64_t timeout_ns, WaitWakeup* wakeup)
 {
-    fd_set sc_fd_set;
-    FD_ZERO(&sc_fd_set);
-    FD_SET(file_descriptor, &sc_fd_set);
+    const size_t stack_count = 8;
+    pollfd stack_fds[stack_count + 1];
+    pollfd* fds = stack_fds;
+    size_t total = count + (wakeup ? 1 : 0);
+    if (total > stack_count + 1)
+        fds = new pollfd[total];
+
+    for (size_t i = 0; i < count; i++)
+    {
+        fds[i].fd = descriptors[i].file_descriptor;
+        fds[i].events = 0;
+        fds[i].revents = 0;
+        if (descriptors[i].events & WAIT_READABLE)
+            fds[i].events |= POLLIN;
+        if (descriptors[i].events & WAIT_WRITABLE)
+            fds[i].events |= POLLOUT;
+        descriptors[i].ready = 0;
+    }
+    if (wakeup)
+    {
+        fds[count].fd = wakeup->GetDescriptor();
+        fds[count].events = POLLIN;
+        fds[count].revents = 0;
+    }
 
-    return select(FD_SETSIZE, &sc_fd_set, NULL, NULL, t);
+    int64_t deadline = timeout_ns > 0 ? MonotonicNanoseconds() + timeout_ns : 0;
+    int n = 0;
+    while (1)
+    {
+        int64_t remaining = timeout_ns;
+        if (timeout_ns > 0)
+        {
+            remaining = deadline - MonotonicNanoseconds();
+            if (remaining < 0)
+                remaining = 0;
+        }
+
+#if defined(__linux__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+        timespec ts;
+        ts.tv_sec = remaining / 1000000000LL;
+        ts.tv_nsec = remaining % 1000000000LL;
+        n = ppoll(fds, total, remaining < 0 ? NULL : &ts, NULL);
+#elif !(defined(WIN32) || defined(__WIN32) || defined(__WIN32__) || defined(FORCE_WIN32))
+        // no ppoll(); round up so a short timeout doesn't turn into a busy poll
+        n = poll(fds, total, remaining < 0 ? -1 : (int)((remaining + 999999) / 1000000));
+#else
+        n = WSAPoll(fds, (ULONG)total, remaining < 0 ? -1 : (INT)((remaining + 999999) / 1000000));
+#endif
+        if (n == -1 && errno == EINTR)
+            continue;
+        break;
+    }
+
+    if (n > 0)
+    {
+        n = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            if (fds[i].revents & POLLIN)
+                descriptors[i].ready |= WAIT_READABLE;
+            if (fds[i].revents & POLLOUT)
+                descriptors[i].ready |= WAIT_WRITABLE;
+            if (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+                descriptors[i].ready |= WAIT_ERROR;
+            if (descriptors[i].ready)
+                n++;
+        }
+        if (wakeup && fds[count].revents)
+            wakeup->Drain();
+    }
+
+    if (fds != stack_fds)
+        delete [] fds;
+    return n;
+}
+
+
+static int WaitUntil(int file_descriptor, uint32_t events, int64_t timeout_ns)
+{
+    WaitDescriptor d;
+    d.file_descriptor = file_descriptor;
+    d.events = events;
+    return WaitForDescriptors(&d, 1, timeout_ns);
+}
+
+
+static int64_t _timevalNanoseconds(const timeval* t)
+{
+    if (t == NULL)
+        return -1;
+    return (int64_t)t->tv_sec * 1000000000LL + (int64_t)t->tv_usec * 1000LL;
+}
+
+
+int WaitUntilReadableWithTimeval(int file_descriptor, timeval* t)
+{
+    return WaitUntil(file_descriptor, WAIT_READABLE, _timevalNanoseconds(t));
 }
 
 
@@ -35,11 +204,7 @@ int WaitUntilReadable(int file_descriptor)
 
 int WaitUntilWritableWithTimeval(int file_descriptor, timeval* t)
 {
-    fd_set sc_fd_set;
-    FD_ZERO(&sc_fd_set);
-    FD_SET(file_descriptor, &sc_fd_set);
-
-    return select(FD_SETSIZE, NULL, &sc_fd_set, NULL, t);
+    return WaitUntil(file_descriptor, WAIT_WRITABLE, _timevalNanoseconds(t));
 }
 
 
@@ -51,11 +216,7 @@ int WaitUntilWritable(int file_descriptor)
 
 int WaitUntilReadableOrWritableWithTimeval(int file_descriptor, timeval* t)
 {
-    fd_set sc_fd_set;
-    FD_ZERO(&sc_fd_set);
-    FD_SET(file_descriptor, &sc_fd_set);
-
-    return select(FD_SETSIZE, &sc_fd_set, &sc_fd_set, NULL, t);
+    return WaitUntil(file_descriptor, WAIT_READABLE | WAIT_WRITABLE, _timevalNanoseconds(t));
 }
 
 
@@ -65,34 +226,21 @@ int WaitUntilReadableOrWritable(int file_descriptor)
 }
 
 
-void _timevalMilliseconds(timeval* ts, uint32_t milliseconds)
-{
-    ts->tv_sec = milliseconds / 1000;
-    ts->tv_usec = (milliseconds % 1000) * 1000;
-}
-
-
 int WaitUntilWritableOrTimeout(int file_descriptor, uint32_t milliseconds)
 {
-    timeval t;
-    _timevalMilliseconds(&t, milliseconds);
-    return WaitUntilWritableWithTimeval(file_descriptor, &t);
+    return WaitUntil(file_descriptor, WAIT_WRITABLE, (int64_t)milliseconds * 1000000LL);
 }
 
 
 int WaitUntilReadableOrTimeout(int file_descriptor, uint32_t milliseconds)
 {
-    timeval t;
-    _timevalMilliseconds(&t, milliseconds);
-    return WaitUntilReadableWithTimeval(file_descriptor, &t);
+    return WaitUntil(file_descriptor, WAIT_READABLE, (int64_t)milliseconds * 1000000LL);
 }
 
 
 int WaitUntilReadableOrWritableOrTimeout(int file_descriptor, uint32_t milliseconds)
 {
-    timeval t;
-    _timevalMilliseconds(&t, milliseconds);
-    return WaitUntilReadableOrWritableWithTimeval(file_descriptor, &t);
+    return WaitUntil(file_descriptor, WAIT_READABLE | WAIT_WRITABLE, (int64_t)milliseconds * 1000000LL);
 }
 
 
@@ -124,6 +272,13 @@ bool SetNonBlockingMode(int file_descriptor)
     return true;
 }
 
+
+bool SetNoDelay(int file_descriptor)
+{
+    int yes = 1;
+    return 0 == setsockopt(file_descriptor, IPPROTO_TCP, TCP_NODELAY, (const char*)&yes, sizeof(yes));
+}
+
 /*
 ------------------------------------------------------------------------------
 This software is available under 2 licenses -- choose whichever you prefer.
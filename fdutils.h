@@ -2,6 +2,7 @@
 #define _FD_UTILS_H_
 
 #include <cstdint>
+#include <cstddef>
 
 #if !(defined(WIN32) || defined(__WIN32) || defined(__WIN32__) || defined(FORCE_WIN32))
 #include <sys/time.h>
@@ -11,6 +12,70 @@
 
 bool operator==(const timeval& x, const timeval& y);
 
+/*
+    WaitWakeup
+
+    A descriptor that other threads can signal to end a WaitForDescriptors()
+    (or an epoll_wait) early.  Signals are coalesced until drained.
+*/
+class WaitWakeup
+{
+public:
+    WaitWakeup();
+    ~WaitWakeup();
+
+    void Wake();
+    void Drain();
+    int GetDescriptor() const;
+
+private:
+    int descriptors[2];     // eventfd on Linux (both entries equal), otherwise a pipe
+
+    WaitWakeup(const WaitWakeup&);
+    WaitWakeup& operator=(const WaitWakeup&);
+};
+
+
+enum WaitEvents
+{
+    WAIT_READABLE = 0x01,
+    WAIT_WRITABLE = 0x02,
+    WAIT_ERROR = 0x04       // reported in ready, never needs to be requested
+};
+
+
+struct WaitDescriptor
+{
+    int file_descriptor;
+    uint32_t events;        // WAIT_READABLE and/or WAIT_WRITABLE
+    uint32_t ready;         // filled in by WaitForDescriptors
+};
+
+
+/*
+    WaitForDescriptors
+
+    Waits until at least one of the count descriptors is ready, or until
+    timeout_ns nanoseconds have passed.  A negative timeout waits forever and
+    0 just polls.  Unlike select(), neither the descriptor values nor their
+    number are limited.
+
+    If wakeup is not NULL, it is waited on as well.  A Wake() from another
+    thread ends the wait early, and the wakeup is drained before returning.
+
+    Returns the number of descriptors whose ready mask is non-zero.  Returns
+    0 on timeout or wakeup, or -1 on error with errno set.  A wait that is
+    interrupted by a signal is resumed for the remaining time.
+*/
+int WaitForDescriptors(WaitDescriptor* descriptors, size_t count, int64_t timeout_ns, WaitWakeup* wakeup = NULL);
+
+/*
+    MonotonicNanoseconds
+
+    A clock for computing deadlines, unaffected by changes to the wall clock.
+*/
+int64_t MonotonicNanoseconds();
+
 int WaitUntilReadable(int file_descriptor);
 int WaitUntilWritable(int file_descriptor);
 int WaitUntilReadableOrWritable(int file_descriptor);
@@ -23,6 +88,15 @@ int WaitUntilReadableOrWritableOrTimeout(int file_descriptor, uint32_t milliseco
 void CloseDescriptor(int file_descriptor);
 bool SetNonBlockingMode(int file_descriptor);
 
+/*
+    SetNoDelay
+
+    Disables Nagle's algorithm on a TCP socket.  Connections batch their
+    own writes, so having the kernel hold back a short segment until the
+    previous one is acknowledged only adds latency.
+*/
+bool SetNoDelay(int file_descriptor);
+
 #endif //_FD_UTILS_H_
 
 /*
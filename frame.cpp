@@ -0,0 +1,185 @@
+#include "frame.h"
+#include "bufferpool.h"
+#include "writecompletion.h"
+#include <cstring>
+#include <new>
+#if !(defined(WIN32) || defined(__WIN32) || defined(__WIN32__) || defined(FORCE_WIN32))
+#include <arpa/inet.h>
+#else
+#include <winsock2.h>
+#endif
+
+using namespace std;
+
+
+Frame::Frame(PacketDataLength data_length, char* data, bool adopted_arg)
+    : refcount(1), payload_length(data_length), payload(data), adopted(adopted_arg), completion(NULL), tracked(NULL)
+{
+}
+
+
+Frame::~Frame()
+{
+    if (adopted)
+        delete [] payload;
+    if (completion)
+        completion->Release();
+    if (tracked)
+        tracked->Release();
+}
+
+
+/*
+    Both forms place the object and its header in one block.  A created
+    frame's payload follows the header in that same block, so the whole
+    frame is contiguous; an adopted frame points at the caller's buffer.
+*/
+Frame* Frame::Create(const PacketType& type, const PacketDataLength& data_length, const char* data)
+{
+    void* memory = BufferPool::Allocate(sizeof(Frame) + header_size + data_length);
+    char* header = (char*)memory + sizeof(Frame);
+    Frame* frame = new (memory) Frame(data_length, header + header_size, false);
+
+    header[0] = (char)type;
+    PacketDataLength corrected_data_length = htonl(data_length);
+    memcpy(header + sizeof(PacketType), &corrected_data_length, sizeof(PacketDataLength));
+    if (data_length > 0)
+        memcpy(frame->payload, data, data_length);
+    return frame;
+}
+
+
+Frame* Frame::Adopt(const PacketType& type, const PacketDataLength& data_length, char* data)
+{
+    void* memory = BufferPool::Allocate(sizeof(Frame) + header_size);
+    char* header = (char*)memory + sizeof(Frame);
+    Frame* frame = new (memory) Frame(data_length, data, true);
+
+    header[0] = (char)type;
+    PacketDataLength corrected_data_length = htonl(data_length);
+    memcpy(header + sizeof(PacketType), &corrected_data_length, sizeof(PacketDataLength));
+    return frame;
+}
+
+
+Frame* Frame::CreateMarker(WriteCompletion* completion_arg, Frame* frame_arg)
+{
+    void* memory = BufferPool::Allocate(sizeof(Frame));
+    Frame* frame = new (memory) Frame(0, NULL, false);
+    completion_arg->AddRef();
+    frame->completion = completion_arg;
+    if (frame_arg)
+    {
+        frame_arg->AddRef();
+        frame->tracked = frame_arg;
+    }
+    return frame;
+}
+
+
+void Frame::AddRef()
+{
+    __atomic_add_fetch(&refcount, 1, __ATOMIC_RELAXED);
+}
+
+
+void Frame::Release()
+{
+    if (__atomic_sub_fetch(&refcount, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        this->~Frame();
+        BufferPool::Free((void*)this);
+    }
+}
+
+
+char* Frame::GetHeader() const
+{
+    return (char*)(this + 1);
+}
+
+
+size_t Frame::GetSize() const
+{
+    if (completion)
+        return tracked ? tracked->GetSize() : 0;
+    return header_size + payload_length;
+}
+
+
+int Frame::Gather(iovec* vector, size_t offset) const
+{
+    if (completion)
+        return tracked ? tracked->Gather(vector, offset) : 0;
+
+    char* header = GetHeader();
+    if (payload == header + header_size)
+    {
+        vector[0].iov_base = header + offset;
+        vector[0].iov_len = header_size + payload_length - offset;
+        return 1;
+    }
+
+    int count = 0;
+    if (offset < header_size)
+    {
+        vector[count].iov_base = header + offset;
+        vector[count].iov_len = header_size - offset;
+        count++;
+        offset = header_size;
+    }
+    if (payload_length > 0)
+    {
+        vector[count].iov_base = payload + (offset - header_size);
+        vector[count].iov_len = payload_length - (offset - header_size);
+        count++;
+    }
+    return count;
+}
+
+
+WriteCompletion* Frame::GetCompletion() const
+{
+    return completion;
+}
+/*
+------------------------------------------------------------------------------
+This software is available under 2 licenses -- choose whichever you prefer.
+------------------------------------------------------------------------------
+ALTERNATIVE A - MIT License
+Copyright (c) 2003-2019 Bobby G. Burrough
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to 
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+of the Software, and to permit persons to whom the Software is furnished to do 
+so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+SOFTWARE.
+------------------------------------------------------------------------------
+ALTERNATIVE B - Public Domain (www.unlicense.org)
+This is free and unencumbered software released into the public domain.
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this 
+software, either in source code form or as a compiled binary, for any purpose, 
+commercial or non-commercial, and by any means.
+In jurisdictions that recognize copyright laws, the author or authors of this 
+software dedicate any and all copyright interest in the software to the public 
+domain. We make this dedication for the benefit of the public at large and to 
+the detriment of our heirs and successors. We intend this dedication to be an 
+overt act of relinquishment in perpetuity of all present and future rights to 
+this software under copyright law.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN 
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION 
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+------------------------------------------------------------------------------
+*/
@@ -0,0 +1,155 @@
+#ifndef _FRAME_H_
+#define _FRAME_H_
+
+#include "packet.h"
+#include <cstddef>
+#include <cstdint>
+
+#if !(defined(WIN32) || defined(__WIN32) || defined(__WIN32__) || defined(FORCE_WIN32))
+#include <sys/uio.h>
+#else
+struct iovec
+{
+    void* iov_base;
+    size_t iov_len;
+};
+#endif
+
+class WriteCompletion;
+
+
+/*
+    Frame
+
+    A packet serialized for the wire: the type byte, the payload length in
+    network order, then the payload.  Frames are immutable once created and
+    reference counted, so one frame can sit in the output buffers of any
+    number of connections at once.  Each holder calls Release() when it is
+    done with it.
+*/
+class Frame
+{
+public:
+    static const size_t header_size = sizeof(PacketType) + sizeof(PacketDataLength);
+
+    /*
+        The most iovecs Gather() will ever fill in for one frame.
+    */
+    static const int max_segments = 2;
+
+    /*
+        Create
+
+        Builds a frame with a single allocation holding both the header and
+        a copy of data.  The frame starts with one reference.
+    */
+    static Frame* Create(const PacketType& type, const PacketDataLength& data_length, const char* data);
+
+    /*
+        Adopt
+
+        Builds a frame around data without copying it.  The frame takes
+        ownership of data, which must have been allocated with new[], and
+        deletes it when the last reference is released.  The frame starts
+        with one reference.
+    */
+    static Frame* Adopt(const PacketType& type, const PacketDataLength& data_length, char* data);
+
+    /*
+        CreateMarker
+
+        Builds a frame carrying completion, which a connection's send path
+        resolves once the frame has been sent.  Given a frame, the marker
+        stands in for it on the wire, sharing its bytes.  Without one, the
+        marker has no bytes at all and only tells when everything queued
+        ahead of it has been sent.  The marker takes a reference on both,
+        released along with its own last reference.
+    */
+    static Frame* CreateMarker(WriteCompletion* completion, Frame* frame = NULL);
+
+    void AddRef();
+    void Release();
+
+    /*
+        GetSize
+
+        Number of bytes the frame occupies on the wire, header included.
+    */
+    size_t GetSize() const;
+
+    /*
+        Gather
+
+        Describes the frame's bytes from offset onwards in at most
+        max_segments iovecs.  Returns how many were filled in.
+    */
+    int Gather(iovec* vector, size_t offset) const;
+
+    /*
+        GetCompletion
+
+        The completion a marker frame carries, or NULL for any other frame.
+    */
+    WriteCompletion* GetCompletion() const;
+
+private:
+    Frame(PacketDataLength data_length, char* data, bool adopted);
+    ~Frame();
+
+    // the header is stored immediately after the object
+    char* GetHeader() const;
+
+    uint32_t refcount;
+    PacketDataLength payload_length;
+    char* payload;
+    bool adopted;
+    WriteCompletion* completion;
+    Frame* tracked;         // the frame a marker stands in for
+
+    // Disallow copying, frames are only ever shared by reference
+    Frame(const Frame&);
+    Frame& operator=(const Frame&);
+};
+
+#endif // _FRAME_H_
+/*
+------------------------------------------------------------------------------
+This software is available under 2 licenses -- choose whichever you prefer.
+------------------------------------------------------------------------------
+ALTERNATIVE A - MIT License
+Copyright (c) 2003-2019 Bobby G. Burrough
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to 
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+of the Software, and to permit persons to whom the Software is furnished to do 
+so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+SOFTWARE.
+------------------------------------------------------------------------------
+ALTERNATIVE B - Public Domain (www.unlicense.org)
+This is free and unencumbered software released into the public domain.
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this 
+software, either in source code form or as a compiled binary, for any purpose, 
+commercial or non-commercial, and by any means.
+In jurisdictions that recognize copyright laws, the author or authors of this 
+software dedicate any and all copyright interest in the software to the public 
+domain. We make this dedication for the benefit of the public at large and to 
+the detriment of our heirs and successors. We intend this dedication to be an 
+overt act of relinquishment in perpetuity of all present and future rights to 
+this software under copyright law.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN 
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION 
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+------------------------------------------------------------------------------
+*/
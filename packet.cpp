@@ -1,6 +1,8 @@
 #include "packet.h"
 #include "logger.h"
 #include "socketconnection_base.h"
+#include "bufferpool.h"
+#include <cstring>
 #include <string>
 #include <sstream>
 
@@ -13,9 +15,8 @@ Packet::Packet(const PacketType& type_arg, const PacketDataLength& data_length_a
     DEBUG_REPORT_LOCATION;
     if(data_arg && data_length_arg)
     {
-        data = new char[data_length];
-        for(size_t i=0; i<data_length; i++)
-            data[i] = data_arg[i];
+        data = (char*)BufferPool::Allocate(data_length);
+        memcpy(data, data_arg, data_length);
     }
 //    if(origin)
 //        origin->IncrementPacketsOut();
@@ -28,9 +29,8 @@ Packet::Packet(SocketConnection_Base* sc_ptr, const PacketType& type_arg, const
     DEBUG_REPORT_LOCATION;
     if(copy && data_arg && data_length_arg)
     {
-        data = new char[data_length];
-        for(size_t i=0; i<data_length; i++)
-            data[i] = data_arg[i];
+        data = (char*)BufferPool::Allocate(data_length);
+        memcpy(data, data_arg, data_length);
     }
     else
     {
@@ -50,7 +50,19 @@ Packet::~Packet()
         //delete origin; // This is totally wrong.  The packet didn't create the socket connection, so it most certainly shouldn't be deleting it.
     }
 */
-    delete [] data;
+    BufferPool::Free(data);
+}
+
+
+void* Packet::operator new(size_t size)
+{
+    return BufferPool::Allocate(size);
+}
+
+
+void Packet::operator delete(void* block)
+{
+    BufferPool::Free(block);
 }
 
 
@@ -66,13 +78,11 @@ void Packet::SetData(const PacketDataLength& data_length_arg, const char* data_a
     if(data == data_arg)
         return;
 
-    if(data)
-        delete [] data;
+    BufferPool::Free(data);
 
     data_length = data_length_arg;
-    data = new char[data_length_arg];
-    for(size_t i=0; i<data_length_arg; i++)
-        data[i] = data_arg[i];
+    data = (char*)BufferPool::Allocate(data_length_arg);
+    memcpy(data, data_arg, data_length_arg);
 }
 
 void Packet::SetType(const PacketType& arg)
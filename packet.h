@@ -32,10 +32,23 @@ public:
     };
 
     //Packet(SocketConnection* sc_ptr, const char* data_arg); // prevent raw data from being transmitted
+
+    /*
+        When copy is false the packet takes ownership of data_arg, which
+        must have been allocated with BufferPool::Allocate().  Incoming
+        payloads are handed to NewPacket() that way.
+    */
     Packet(SocketConnection_Base* sc_ptr, const PacketType& type_arg, const PacketDataLength& data_length_arg, char* data_arg, bool copy = true);
     Packet(const PacketType& type_arg, const PacketDataLength& data_length_arg, const char* data_arg);
     virtual ~Packet();
 
+    /*
+        Packets, including those of derived classes, and their payloads are
+        allocated from the BufferPool.
+    */
+    static void* operator new(size_t size);
+    static void operator delete(void* block);
+
     /*
         Retrieve the data associated with this packet.
     */
@@ -2,6 +2,7 @@
 #define _PCQUEUE_H
 
 #include <errno.h>
+#include <vector>
 #include "cl_semaphore.h"
 #include "safelist.h"
 #include "logger.h"
@@ -20,6 +21,7 @@ public:
     bool Producer(const T& event_arg );
     T Consumer();
     T TryConsumer();
+    size_t ConsumeBatch(std::vector<T>& out, size_t max);
     T pop_front();
 
 private:
@@ -91,6 +93,29 @@ T PCQueue<T>::TryConsumer()
 }
 
 
+/*
+    Blocks until at least one object is in the buffer, then removes up to
+    max objects without blocking again and appends them to out.  Returns the
+    number of objects appended.
+*/
+template<class T>
+size_t PCQueue<T>::ConsumeBatch(std::vector<T>& out, size_t max)
+{
+    DEBUG_REPORT_LOCATION;
+    if(max == 0)
+        return 0;
+    sem_wait( &cons_sem );
+    size_t count = 0;
+    do
+    {
+        out.push_back(event_set.pop_front());
+        sem_post( &prod_sem );
+        count++;
+    } while(count < max && 0 == sem_trywait( &cons_sem ));
+    return count;
+}
+
+
 /*
     This will remove an object from the buffer and
     return it, without modifying the producer/consumer state.
@@ -0,0 +1,599 @@
+#ifndef _PCRING_H_
+#define _PCRING_H_
+
+#include "logger.h"
+#include <cstdint>
+#include <cstddef>
+#include <ctime>
+#include <climits>
+#include <vector>
+#include <pthread.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+using namespace std;
+
+
+/*
+    PCRing
+
+    A bounded producer/consumer queue with the same interface and blocking
+    behavior as PCQueue, built on a lock-free multi-producer/multi-consumer
+    ring (each slot carries a sequence number that says whether it is ready
+    to be written or read).  Producers and consumers only contend on a
+    single compare-and-swap of the index they advance, and only enter the
+    kernel when the ring is full or empty and someone actually has to sleep.
+    On Linux sleeping is done with a futex, elsewhere with a condition
+    variable.
+
+    The ring is allocated up front, so it suits queues shared by many
+    threads (the incoming packet queue) rather than one per connection.
+*/
+template<class T>
+class PCRing
+{
+public:
+    /*
+        PCRing
+
+        capacity is rounded up to a power of two.
+    */
+    PCRing(size_t capacity = 10000);
+    ~PCRing();
+
+    /*
+        Producer
+
+        Appends event_arg, blocking while the ring is full.  Always returns
+        true.
+    */
+    bool Producer(const T& event_arg);
+
+    /*
+        Consumer
+
+        Removes and returns the oldest entry, blocking while the ring is
+        empty.
+    */
+    T Consumer();
+
+    /*
+        TryConsumer
+
+        Like Consumer, but returns NULL instead of blocking when the ring is
+        empty.
+    */
+    T TryConsumer();
+
+    /*
+        ConsumeBatch
+
+        Waits until at least one entry is available, then removes up to max
+        entries in one step and appends them to out, oldest first.  Returns
+        the number of entries appended.  timeout_ms bounds the wait: -1 waits
+        forever, 0 does not wait at all, and 0 is returned if it runs out.
+        Entries that are NULL are passed through like any other.
+    */
+    size_t ConsumeBatch(vector<T>& out, size_t max, int timeout_ms = -1);
+
+    /*
+        TryConsumeIf
+
+        Removes the oldest entry into event_arg only if accept returns true
+        for it, and never blocks.  Returns false, leaving the entry where it
+        is, when the ring is empty, when accept turns the entry down, or when
+        another TryConsumeIf is looking at the head.  While accept runs no
+        consumer can take the entry, so it may look inside it; other
+        consumers see an empty ring for that moment.
+    */
+    bool TryConsumeIf(T& event_arg, bool (*accept)(const T&));
+
+    /*
+        pop_front
+
+        Kept for compatibility with PCQueue.  Removing an entry from the ring
+        always keeps the producer/consumer state consistent, so this is the
+        same as TryConsumer.
+    */
+    T pop_front();
+
+    size_t GetCapacity() const;
+
+    /*
+        GetSize
+
+        Number of entries waiting.  Only a snapshot while other threads are
+        pushing and popping, meant for monitoring.
+    */
+    size_t GetSize() const;
+
+private:
+    struct Slot
+    {
+        size_t sequence;
+        T event;
+    };
+
+    bool TryPush(const T& event_arg);
+    bool TryPop(T& event_arg);
+    size_t TryPopBatch(vector<T>& out, size_t max);
+    bool CanPush();
+    bool CanPop();
+    bool Spin(bool (PCRing<T>::*ready)());
+    void Wait(uint32_t* word, uint32_t expected, const struct timespec* timeout = NULL);
+    void Wake(uint32_t* word, uint32_t* waiters, size_t count = 1);
+
+    Slot* slots;
+    size_t mask;
+    int spin_count;             // 0 on a single processor, where spinning only delays the other side
+
+    // The two indices are written by different sides of the queue, keep
+    // them (and the wait words) on separate cache lines.
+    alignas(64) size_t enqueue_position;
+    alignas(64) size_t dequeue_position;
+    alignas(64) uint32_t not_empty;
+    uint32_t empty_waiters;
+    alignas(64) uint32_t not_full;
+    uint32_t full_waiters;
+
+#if !defined(__linux__)
+    pthread_mutex_t wait_mutex;
+    pthread_cond_t wait_cond;
+#endif
+};
+
+template<class T>
+PCRing<T>::PCRing(size_t capacity)
+{
+    DEBUG_REPORT_LOCATION;
+
+    size_t size = 2;
+    while(size < capacity)
+        size <<= 1;
+
+    slots = new Slot[size];
+    for(size_t i = 0; i < size; i++)
+        slots[i].sequence = i;
+    mask = size - 1;
+    spin_count = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? 200 : 0;
+
+    enqueue_position = 0;
+    dequeue_position = 0;
+    not_empty = 0;
+    empty_waiters = 0;
+    not_full = 0;
+    full_waiters = 0;
+
+#if !defined(__linux__)
+    pthread_mutex_init(&wait_mutex, NULL);
+    pthread_cond_init(&wait_cond, NULL);
+#endif
+}
+
+template<class T>
+PCRing<T>::~PCRing()
+{
+    DEBUG_REPORT_LOCATION;
+#if !defined(__linux__)
+    pthread_cond_destroy(&wait_cond);
+    pthread_mutex_destroy(&wait_mutex);
+#endif
+    delete [] slots;
+}
+
+template<class T>
+bool PCRing<T>::Producer(const T& event_arg)
+{
+    DEBUG_REPORT_LOCATION;
+    while(!TryPush(event_arg))
+    {
+        if(Spin(&PCRing<T>::CanPush))
+            continue;
+
+        // Read the wait word before announcing ourselves and trying again, so
+        // a consumer that frees a slot in between is guaranteed to either be
+        // seen by the retry or to change the word and fail the wait.
+        uint32_t observed = __atomic_load_n(&not_full, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&full_waiters, 1, __ATOMIC_SEQ_CST);
+        if(TryPush(event_arg))
+        {
+            __atomic_sub_fetch(&full_waiters, 1, __ATOMIC_SEQ_CST);
+            break;
+        }
+        Wait(&not_full, observed);
+        __atomic_sub_fetch(&full_waiters, 1, __ATOMIC_SEQ_CST);
+    }
+    Wake(&not_empty, &empty_waiters);
+    return true;
+}
+
+template<class T>
+T PCRing<T>::Consumer()
+{
+    DEBUG_REPORT_LOCATION;
+    T event;
+    while(!TryPop(event))
+    {
+        if(Spin(&PCRing<T>::CanPop))
+            continue;
+
+        uint32_t observed = __atomic_load_n(&not_empty, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&empty_waiters, 1, __ATOMIC_SEQ_CST);
+        if(TryPop(event))
+        {
+            __atomic_sub_fetch(&empty_waiters, 1, __ATOMIC_SEQ_CST);
+            break;
+        }
+        Wait(&not_empty, observed);
+        __atomic_sub_fetch(&empty_waiters, 1, __ATOMIC_SEQ_CST);
+    }
+    Wake(&not_full, &full_waiters);
+    return event;
+}
+
+template<class T>
+T PCRing<T>::TryConsumer()
+{
+    DEBUG_REPORT_LOCATION;
+    T event;
+    if(!TryPop(event))
+        return (T)NULL;
+    Wake(&not_full, &full_waiters);
+    return event;
+}
+
+template<class T>
+size_t PCRing<T>::ConsumeBatch(vector<T>& out, size_t max, int timeout_ms)
+{
+    DEBUG_REPORT_LOCATION;
+    if(max == 0)
+        return 0;
+
+    struct timespec deadline;
+    if(timeout_ms > 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+        if(deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    size_t count;
+    while((count = TryPopBatch(out, max)) == 0)
+    {
+        if(timeout_ms == 0)
+            return 0;
+        if(Spin(&PCRing<T>::CanPop))
+            continue;
+
+        struct timespec remaining;
+        const struct timespec* timeout = NULL;
+        if(timeout_ms > 0)
+        {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            remaining.tv_sec = deadline.tv_sec - now.tv_sec;
+            remaining.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+            if(remaining.tv_nsec < 0)
+            {
+                remaining.tv_sec--;
+                remaining.tv_nsec += 1000000000;
+            }
+            if(remaining.tv_sec < 0)
+                return 0;
+            timeout = &remaining;
+        }
+
+        uint32_t observed = __atomic_load_n(&not_empty, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&empty_waiters, 1, __ATOMIC_SEQ_CST);
+        count = TryPopBatch(out, max);
+        if(count)
+        {
+            __atomic_sub_fetch(&empty_waiters, 1, __ATOMIC_SEQ_CST);
+            break;
+        }
+        Wait(&not_empty, observed, timeout);
+        __atomic_sub_fetch(&empty_waiters, 1, __ATOMIC_SEQ_CST);
+    }
+    Wake(&not_full, &full_waiters, count);
+    return count;
+}
+
+template<class T>
+bool PCRing<T>::TryConsumeIf(T& event_arg, bool (*accept)(const T&))
+{
+    DEBUG_REPORT_LOCATION;
+    // Setting this bit in dequeue_position holds the head: every other
+    // consumer's compare-and-swap fails, and the position it reloads is
+    // ahead of anything written, so the ring reads as empty.
+    const size_t holding = (size_t)1 << (sizeof(size_t) * CHAR_BIT - 1);
+
+    size_t position = __atomic_load_n(&dequeue_position, __ATOMIC_RELAXED);
+    Slot* slot;
+    for(;;)
+    {
+        if(position & holding)
+            return false;
+        slot = &slots[position & mask];
+        size_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+        if(difference == 0)
+        {
+            if(__atomic_compare_exchange_n(&dequeue_position, &position, position | holding, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                break;
+        }
+        else if(difference < 0)
+            return false;
+        else
+            position = __atomic_load_n(&dequeue_position, __ATOMIC_RELAXED);
+    }
+
+    bool taken = accept(slot->event);
+    if(taken)
+    {
+        event_arg = slot->event;
+        __atomic_store_n(&slot->sequence, position + mask + 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&dequeue_position, position + 1, __ATOMIC_SEQ_CST);
+        Wake(&not_full, &full_waiters);
+    }
+    else
+    {
+        // the value is unchanged, the release orders our look at the entry
+        // before whichever consumer takes it next
+        __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&dequeue_position, position, __ATOMIC_SEQ_CST);
+    }
+
+    // consumers that found the ring empty while the head was held may have gone to sleep
+    Wake(&not_empty, &empty_waiters, SIZE_MAX);
+    return taken;
+}
+
+template<class T>
+T PCRing<T>::pop_front()
+{
+    DEBUG_REPORT_LOCATION;
+    return TryConsumer();
+}
+
+template<class T>
+size_t PCRing<T>::GetCapacity() const
+{
+    return mask + 1;
+}
+
+template<class T>
+size_t PCRing<T>::GetSize() const
+{
+    size_t dequeued = __atomic_load_n(&dequeue_position, __ATOMIC_RELAXED);
+    size_t enqueued = __atomic_load_n(&enqueue_position, __ATOMIC_RELAXED);
+    return enqueued > dequeued ? enqueued - dequeued : 0;
+}
+
+template<class T>
+bool PCRing<T>::TryPush(const T& event_arg)
+{
+    size_t position = __atomic_load_n(&enqueue_position, __ATOMIC_RELAXED);
+    Slot* slot;
+    for(;;)
+    {
+        slot = &slots[position & mask];
+        size_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+        if(difference == 0)
+        {
+            if(__atomic_compare_exchange_n(&enqueue_position, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if(difference < 0)
+            return false;   // full: the slot still holds an entry from the previous lap
+        else
+            position = __atomic_load_n(&enqueue_position, __ATOMIC_RELAXED);
+    }
+    slot->event = event_arg;
+    __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+template<class T>
+bool PCRing<T>::TryPop(T& event_arg)
+{
+    size_t position = __atomic_load_n(&dequeue_position, __ATOMIC_RELAXED);
+    Slot* slot;
+    for(;;)
+    {
+        slot = &slots[position & mask];
+        size_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+        if(difference == 0)
+        {
+            if(__atomic_compare_exchange_n(&dequeue_position, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if(difference < 0)
+            return false;   // empty, or the producer of this slot has not finished writing it
+        else
+            position = __atomic_load_n(&dequeue_position, __ATOMIC_RELAXED);
+    }
+    event_arg = slot->event;
+    __atomic_store_n(&slot->sequence, position + mask + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/*
+    TryPopBatch
+
+    Claims the run of consecutive ready slots at the head of the ring (up to
+    max) with a single compare-and-swap, so a batch costs the same
+    synchronization as one entry.
+*/
+template<class T>
+size_t PCRing<T>::TryPopBatch(vector<T>& out, size_t max)
+{
+    size_t position = __atomic_load_n(&dequeue_position, __ATOMIC_RELAXED);
+    size_t count;
+    for(;;)
+    {
+        count = 0;
+        while(count < max && __atomic_load_n(&slots[(position + count) & mask].sequence, __ATOMIC_ACQUIRE) == position + count + 1)
+            count++;
+
+        if(count == 0)
+        {
+            size_t sequence = __atomic_load_n(&slots[position & mask].sequence, __ATOMIC_ACQUIRE);
+            if((intptr_t)sequence - (intptr_t)(position + 1) < 0)
+                return 0;
+            position = __atomic_load_n(&dequeue_position, __ATOMIC_RELAXED);
+        }
+        else if(__atomic_compare_exchange_n(&dequeue_position, &position, position + count, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+    }
+    for(size_t i = 0; i < count; i++)
+    {
+        Slot* slot = &slots[(position + i) & mask];
+        out.push_back(slot->event);
+        __atomic_store_n(&slot->sequence, position + i + mask + 1, __ATOMIC_RELEASE);
+    }
+    return count;
+}
+
+template<class T>
+bool PCRing<T>::CanPush()
+{
+    size_t position = __atomic_load_n(&enqueue_position, __ATOMIC_RELAXED);
+    return __atomic_load_n(&slots[position & mask].sequence, __ATOMIC_ACQUIRE) == position;
+}
+
+template<class T>
+bool PCRing<T>::CanPop()
+{
+    size_t position = __atomic_load_n(&dequeue_position, __ATOMIC_RELAXED);
+    return __atomic_load_n(&slots[position & mask].sequence, __ATOMIC_ACQUIRE) == position + 1;
+}
+
+/*
+    Spin
+
+    Polls ready for a short while before a caller commits to sleeping.  The
+    other side of the queue is usually only a few hundred nanoseconds away
+    from making progress, and a futex round trip costs several microseconds
+    on both ends.
+*/
+template<class T>
+bool PCRing<T>::Spin(bool (PCRing<T>::*ready)())
+{
+    for(int i = 0; i < spin_count; i++)
+    {
+        if((this->*ready)())
+            return true;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+    return false;
+}
+
+/*
+    Wait / Wake
+
+    Wait sleeps until *word no longer equals expected, or until the relative
+    timeout (if any) passes.  Wake bumps *word and wakes up to count
+    sleepers, and is free when nobody is waiting.
+*/
+template<class T>
+void PCRing<T>::Wait(uint32_t* word, uint32_t expected, const struct timespec* timeout)
+{
+#if defined(__linux__)
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, timeout, NULL, 0);
+#else
+    struct timespec deadline;
+    if(timeout)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout->tv_sec;
+        deadline.tv_nsec += timeout->tv_nsec;
+        if(deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+    pthread_mutex_lock(&wait_mutex);
+    while(__atomic_load_n(word, __ATOMIC_SEQ_CST) == expected)
+    {
+        if(!timeout)
+            pthread_cond_wait(&wait_cond, &wait_mutex);
+        else if(pthread_cond_timedwait(&wait_cond, &wait_mutex, &deadline) != 0)
+            break;
+    }
+    pthread_mutex_unlock(&wait_mutex);
+#endif
+}
+
+template<class T>
+void PCRing<T>::Wake(uint32_t* word, uint32_t* waiters, size_t count)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(waiters, __ATOMIC_SEQ_CST) == 0)
+        return;
+    __atomic_add_fetch(word, 1, __ATOMIC_SEQ_CST);
+#if defined(__linux__)
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count < INT_MAX ? (int)count : INT_MAX, NULL, NULL, 0);
+#else
+    pthread_mutex_lock(&wait_mutex);
+    pthread_mutex_unlock(&wait_mutex);
+    pthread_cond_broadcast(&wait_cond);
+#endif
+}
+
+#endif // _PCRING_H_
+
+/*
+------------------------------------------------------------------------------
+This software is available under 2 licenses -- choose whichever you prefer.
+------------------------------------------------------------------------------
+ALTERNATIVE A - MIT License
+Copyright (c) 2003-2019 Bobby G. Burrough
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to 
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+of the Software, and to permit persons to whom the Software is furnished to do 
+so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+SOFTWARE.
+------------------------------------------------------------------------------
+ALTERNATIVE B - Public Domain (www.unlicense.org)
+This is free and unencumbered software released into the public domain.
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this 
+software, either in source code form or as a compiled binary, for any purpose, 
+commercial or non-commercial, and by any means.
+In jurisdictions that recognize copyright laws, the author or authors of this 
+software dedicate any and all copyright interest in the software to the public 
+domain. We make this dedication for the benefit of the public at large and to 
+the detriment of our heirs and successors. We intend this dedication to be an 
+overt act of relinquishment in perpetuity of all present and future rights to 
+this software under copyright law.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN 
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION 
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+------------------------------------------------------------------------------
+*/
@@ -0,0 +1,173 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstdint>
+#include <pthread.h>
+#include <sys/time.h>
+#include "pcqueue.h"
+#include "pcring.h"
+
+using namespace std;
+
+/*
+    queuebench
+
+    Contention benchmark for the producer/consumer queues.  Starts the given
+    number of producer and consumer threads on a PCQueue and then on a
+    PCRing, and reports how many entries per second make it through each.
+
+    usage: queuebench [producers] [consumers] [entries per producer]
+*/
+
+template<class Q>
+struct BenchArgs
+{
+    Q* queue;
+    long count;
+    long long sum;
+};
+
+template<class Q>
+void* ProduceEntries(void* void_arg)
+{
+    BenchArgs<Q>* args = (BenchArgs<Q>*)void_arg;
+    for(long i = 1; i <= args->count; i++)
+        args->queue->Producer((intptr_t)i);
+    return NULL;
+}
+
+template<class Q>
+void* ConsumeEntries(void* void_arg)
+{
+    BenchArgs<Q>* args = (BenchArgs<Q>*)void_arg;
+    for(;;)
+    {
+        intptr_t entry = args->queue->Consumer();
+        if(entry < 0)
+            break;
+        args->sum += entry;
+    }
+    return NULL;
+}
+
+static double Now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+template<class Q>
+static void Run(const char* name, int producers, int consumers, long count)
+{
+    Q queue;
+    BenchArgs<Q>* producer_args = new BenchArgs<Q>[producers];
+    BenchArgs<Q>* consumer_args = new BenchArgs<Q>[consumers];
+    pthread_t* producer_threads = new pthread_t[producers];
+    pthread_t* consumer_threads = new pthread_t[consumers];
+
+    double start = Now();
+    for(int i = 0; i < consumers; i++)
+    {
+        consumer_args[i].queue = &queue;
+        consumer_args[i].count = 0;
+        consumer_args[i].sum = 0;
+        pthread_create(&consumer_threads[i], NULL, ConsumeEntries<Q>, &consumer_args[i]);
+    }
+    for(int i = 0; i < producers; i++)
+    {
+        producer_args[i].queue = &queue;
+        producer_args[i].count = count;
+        producer_args[i].sum = 0;
+        pthread_create(&producer_threads[i], NULL, ProduceEntries<Q>, &producer_args[i]);
+    }
+    for(int i = 0; i < producers; i++)
+        pthread_join(producer_threads[i], NULL);
+    for(int i = 0; i < consumers; i++)
+        queue.Producer((intptr_t)-1);
+    long long sum = 0;
+    for(int i = 0; i < consumers; i++)
+    {
+        pthread_join(consumer_threads[i], NULL);
+        sum += consumer_args[i].sum;
+    }
+    double elapsed = Now() - start;
+
+    long long total = (long long)producers * count;
+    bool complete = sum == (long long)producers * count * (count + 1) / 2;
+    cout << name << ": " << producers << " producers, " << consumers << " consumers, "
+         << total << " entries in " << elapsed << "s, "
+         << (long long)(total / elapsed) << " entries/s"
+         << (complete ? "" : " (ENTRIES LOST)") << endl;
+
+    delete [] producer_args;
+    delete [] consumer_args;
+    delete [] producer_threads;
+    delete [] consumer_threads;
+}
+
+int main(int argc, char** argv)
+{
+    int producers = argc > 1 ? atoi(argv[1]) : 4;
+    int consumers = argc > 2 ? atoi(argv[2]) : 4;
+    long count = argc > 3 ? atol(argv[3]) : 1000000;
+
+    if(producers < 1 || consumers < 1 || count < 1)
+    {
+        cerr << "usage: " << argv[0] << " [producers] [consumers] [entries per producer]" << endl;
+        return -1;
+    }
+
+    try
+    {
+        Run<PCQueue<intptr_t> >("PCQueue", producers, consumers, count);
+        Run<PCRing<intptr_t> >("PCRing ", producers, consumers, count);
+    }
+    catch (const char* arg)
+    {
+        cout << "Exception: " << arg << endl;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+------------------------------------------------------------------------------
+This software is available under 2 licenses -- choose whichever you prefer.
+------------------------------------------------------------------------------
+ALTERNATIVE A - MIT License
+Copyright (c) 2003-2019 Bobby G. Burrough
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to 
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+of the Software, and to permit persons to whom the Software is furnished to do 
+so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+SOFTWARE.
+------------------------------------------------------------------------------
+ALTERNATIVE B - Public Domain (www.unlicense.org)
+This is free and unencumbered software released into the public domain.
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this 
+software, either in source code form or as a compiled binary, for any purpose, 
+commercial or non-commercial, and by any means.
+In jurisdictions that recognize copyright laws, the author or authors of this 
+software dedicate any and all copyright interest in the software to the public 
+domain. We make this dedication for the benefit of the public at large and to 
+the detriment of our heirs and successors. We intend this dedication to be an 
+overt act of relinquishment in perpetuity of all present and future rights to 
+this software under copyright law.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN 
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION 
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+------------------------------------------------------------------------------
+*/
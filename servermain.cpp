@@ -5,21 +5,38 @@
 
 using namespace std;
 
+
+static void PrintPacket(Packet* pkt, void* /*context*/)
+{
+    //pkt->DebugString();
+    cout << "Packet received: " << pkt->GetOrigin() << " " << pkt->GetDataLength() << " " << string(pkt->GetData(), pkt->GetDataLength()) << endl;
+}
+
+
+static void PrintConnect(SocketConnection_Base* connection, void* /*context*/)
+{
+    cout << "Connected: " << connection << endl;
+}
+
+
+static void PrintDisconnect(SocketConnection_Base* connection, void* /*context*/)
+{
+    cout << "Disconnected: " << connection << endl;
+}
+
+
 int main()
 {
     int err = 0;
     try
     {
-        ServerSocket serverSocket("127.0.0.1", 7257);
-
-        while(1)
-        {
-            Packet* pkt = serverSocket.NewPacket();
-            //pkt->DebugString();
-            cout << "Packet received: " << pkt->GetOrigin() << " " << pkt->GetDataLength() << " " << string(pkt->GetData(), pkt->GetDataLength()) << endl;
-            serverSocket.DeletePacket(pkt);
-        }
-
+        ServerSocketOptions options;
+        options.worker_count = 1; // one worker keeps the output from interleaving
+        options.packet_handler = PrintPacket;
+        ServerSocket serverSocket("127.0.0.1", 7257, options);
+        serverSocket.OnConnect(PrintConnect);
+        serverSocket.OnDisconnect(PrintDisconnect);
+        serverSocket.Run();
     }
     catch (const char* arg)
     {
@@ -4,6 +4,8 @@
 #include "socketconnection_base.h"
 #include "tlssocketconnection.h" // TODO: remove this
 #include "fdutils.h"
+#include "eventloop.h"
+#include "bufferpool.h"
 #if !(defined(WIN32) || defined(__WIN32) || defined(__WIN32__) || defined(FORCE_WIN32))
 #include <unistd.h>
 #include <arpa/inet.h>
@@ -19,37 +21,173 @@ typedef SSIZE_T ssize_t;
 //#include <sstream>
 //#include <cstring>
 #include <iostream>
+#include <cstring>
+#include <cerrno>
 
 using namespace std;
 
+
+/*
+    ConnectionEvent
+
+    Carries a connect or disconnect through a worker shard's packet queue,
+    so it is handled in order with the connection's packets.  It holds a
+    reference on the connection until the worker is done with it.
+*/
+class ConnectionEvent : public Packet
+{
+public:
+    ConnectionEvent(SocketConnection_Base* sc_ptr, bool connected)
+        : Packet(connected ? DATA_CONNECTION_ACCEPTED : ERR_DISCONNECTED, 0, NULL), connection(sc_ptr)
+    {
+        connection->AddReference();
+    }
+
+    virtual ~ConnectionEvent()
+    {
+        if (connection->RemoveReference())
+            Delete(connection);
+    }
+
+    SocketConnection_Base* GetConnection() const { return connection; }
+    bool IsConnect() const { return GetType() == DATA_CONNECTION_ACCEPTED; }
+
+private:
+    SocketConnection_Base* connection;
+};
+
+ServerSocketOptions::ServerSocketOptions()
+    : event_loop_count(0), io_backend(IO_BACKEND_EPOLL), tls_flush_latency_us(0), output_ring_entries(0),
+      output_budget_bytes(0), total_output_budget_bytes(0), output_budget_policy(BUDGET_BLOCK),
+      input_budget_bytes(0), total_input_budget_bytes(0), input_budget_policy(BUDGET_BLOCK),
+      worker_count(0), packet_handler(NULL), packet_handler_context(NULL), listener_count(1),
+      handshake_limit(0), handshake_timeout_ms(10000), certificate_file("./server.crt"), private_key_file("./server.key"),
+      session_cache_size(20480), session_timeout_s(300), session_tickets(true), ticket_key_rotation_s(3600),
+      early_data_bytes(0)
+{
+}
+
+
 ServerSocket::ServerSocket(const string& ip_address, int port)
-	: server_descriptor(0)
+    : ServerSocket(ip_address, port, ServerSocketOptions())
+{
+}
+
+
+ServerSocket::ServerSocket(const string& ip_address, int port, const ServerSocketOptions& options)
+	: _options(options), event_loops(NULL), workers(NULL),
+      output_total(options.total_output_budget_bytes), input_total(options.total_input_budget_bytes),
+      any_handler(NULL), connect_handler(NULL), disconnect_handler(NULL), handler_epoch(0), stopping(false), server_context(NULL),
+      ticket_keys(NULL)
 {
     DEBUG_REPORT_LOCATION;
 
-    //listen
-    sockaddr_in server_sock;
-    int i(0);
-    int err = 0;
+    memset(type_handlers, 0, sizeof(type_handlers));
+    memset(handler_users, 0, sizeof(handler_users));
+    memset(&handshakes, 0, sizeof(handshakes));
+    memset(early_data_types, 0, sizeof(early_data_types));
+    for (size_t i = 0; i < _options.early_data_types.size(); i++)
+        early_data_types[_options.early_data_types[i]] = true;
+    pthread_mutex_init(&handler_mutex, NULL);
+    pthread_mutex_init(&handshake_mutex, NULL);
+    pthread_cond_init(&handshake_room, NULL);
+    pthread_mutex_init(&context_mutex, NULL);
+    if (_options.packet_handler)
+        OnPacket(_options.packet_handler, _options.packet_handler_context);
 
 #if defined(WIN32) || defined(__WIN32) || defined(__WIN32__) || defined(FORCE_WIN32)
     WORD wVersionRequested;
     WSADATA wsaData;
     wVersionRequested = MAKEWORD(2, 2);
-    err = WSAStartup(wVersionRequested, &wsaData);
+    int err = WSAStartup(wVersionRequested, &wsaData);
     if (err != 0) {
         throw("WSAStartup failed.");
     }
 #endif
 
+    size_t listener_count = _options.listener_count;
+    if (listener_count == 0)
+    {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        listener_count = online > 0 ? (size_t)online : 1;
+    }
+#if !defined(SO_REUSEPORT)
+    listener_count = 1;
+#endif
+
+    if (_options.session_tickets)
+        ticket_keys = new TicketKeys(_options.ticket_key_rotation_s);
+
+    if (!_options.certificate_file.empty())
+    {
+        try
+        {
+            server_context = CreateContext(_options.certificate_file, _options.private_key_file);
+        }
+        catch (const char* str)
+        {
+            LOG_ERROR_OUT("No certificate loaded, TLS connections will be refused: " << str);
+        }
+    }
+
+    //listen
+    try
+    {
+        for (size_t i = 0; i < listener_count; i++)
+        {
+            Listener* listener = new Listener;
+            listener->server = this;
+            listener->descriptor = -1;
+            listener->accepted = 0;
+            listeners.push_back(listener);
+            listener->descriptor = OpenListener(ip_address, port, listener_count > 1);
+        }
+    }
+    catch (const char*)
+    {
+        for (size_t i = 0; i < listeners.size(); i++)
+        {
+            if (listeners[i]->descriptor != -1)
+                CloseDescriptor(listeners[i]->descriptor);
+            delete listeners[i];
+        }
+        if (server_context)
+            SSL_CTX_free(server_context);
+        delete ticket_keys;
+        pthread_mutex_destroy(&context_mutex);
+        pthread_cond_destroy(&handshake_room);
+        pthread_mutex_destroy(&handshake_mutex);
+        DeleteHandlers();
+        pthread_mutex_destroy(&handler_mutex);
+        throw;
+    }
+
+    event_loops = new EventLoopPool(_options.event_loop_count, _options.io_backend);
+    if (_options.worker_count)
+        workers = new WorkerPool(_options.worker_count, ServerSocket::DispatchPacket, this);
+
+    //Start AcceptThread threads.
+    for (size_t i = 0; i < listeners.size(); i++)
+        pthread_create(&listeners[i]->thread, NULL, ServerSocket::AcceptThread, listeners[i]);
+    pthread_create(&_health_monitor_thread_id,NULL,ServerSocket::HealthMonitor,this);
+}
+
+
+/*
+    Opens a non-blocking listening socket.  With reuse_port, several of them
+    can be bound to the same address, and the kernel balances incoming
+    connections across their accept queues.
+*/
+int ServerSocket::OpenListener(const string& ip_address, int port, bool reuse_port)
+{
+    sockaddr_in server_sock;
+    memset(&server_sock, 0, sizeof(server_sock));
     server_sock.sin_family = AF_INET;
     server_sock.sin_port = htons(port);
     server_sock.sin_addr.s_addr = inet_addr(ip_address.c_str());
 
-    for (i = 0; i < sizeof(server_sock.sin_zero); i++)
-        server_sock.sin_zero[i] = 0;
-    server_descriptor = socket(PF_INET, SOCK_STREAM,0);
-	if(-1 == server_descriptor)
+    int descriptor = socket(PF_INET, SOCK_STREAM,0);
+	if(-1 == descriptor)
 	{
 		throw("socket() failed.");
 	}
@@ -59,59 +197,104 @@ ServerSocket::ServerSocket(const string& ip_address, int port)
 #else
 	char yes = 1;
 #endif
-	err = setsockopt(server_descriptor, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+	int err = setsockopt(descriptor, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+#if defined(SO_REUSEPORT)
+    if (!err && reuse_port)
+        err = setsockopt(descriptor, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int));
+#endif
 	if(err)
 	{
+        CloseDescriptor(descriptor);
 		throw("setsockopt() failed.");
 	}
 
-    err = ::bind(server_descriptor, (const struct sockaddr*)&server_sock, sizeof(struct sockaddr_in));
+    err = ::bind(descriptor, (const struct sockaddr*)&server_sock, sizeof(struct sockaddr_in));
 	if(err)
 	{
+        CloseDescriptor(descriptor);
         throw("bind() failed.");
 	}
 
-    i = listen(server_descriptor, SOMAXCONN);
-    if (i != 0)
+    if (listen(descriptor, SOMAXCONN) != 0)
     {
+        CloseDescriptor(descriptor);
 		throw("listen() failed.");
     }
-    //Start AcceptThread thread.
-    pthread_create(&_accept_thread_id,NULL,ServerSocket::AcceptThread,this);
-    pthread_create(&_health_monitor_thread_id,NULL,ServerSocket::HealthMonitor,this);
+
+    // AcceptThread accepts until the queue is empty, then waits for more
+    if (!SetNonBlockingMode(descriptor))
+    {
+        CloseDescriptor(descriptor);
+        throw("SetNonBlockingMode() failed.");
+    }
+    return descriptor;
 }
 
 
+/*
+    The accept threads are stopped through their wakeups rather than
+    cancelled, so none of them is torn down in the middle of setting up a
+    connection.
+*/
 ServerSocket::~ServerSocket()
 {
     DEBUG_REPORT_LOCATION;
 
     //clean up buffers?!
 
-    CloseDescriptor(server_descriptor);
+    stopping = true;
+    pthread_mutex_lock(&handshake_mutex);
+    pthread_cond_broadcast(&handshake_room);
+    pthread_mutex_unlock(&handshake_mutex);
+    for (size_t i = 0; i < listeners.size(); i++)
+        listeners[i]->wakeup.Wake();
+    for (size_t i = 0; i < listeners.size(); i++)
+    {
+        pthread_join(listeners[i]->thread, NULL);
+        CloseDescriptor(listeners[i]->descriptor);
+        delete listeners[i];
+    }
 
 #if (defined(WIN32) || defined(__WIN32) || defined(__WIN32__) || defined(FORCE_WIN32))
     WSACleanup(); // TODO: This is actually wrong in the event that there are multiple ServerSocket's.  This should be in a static dealloc function.
 #endif
 
-    pthread_cancel(_accept_thread_id);
-    pthread_join(_accept_thread_id,NULL);
-
     pthread_cancel(_health_monitor_thread_id);
     pthread_join(_health_monitor_thread_id,NULL);
 
+    /*
+        Stop the loops before tearing the connections down, so a loop
+        thread can't be deleting one of them (DeleteSocketConnection) at
+        the same time.
+    */
+    event_loops->Stop();
+
     //destroy all SocketConnections
     SocketConnection_Base* sc = NULL;
     while((sc = connection_set.pop_front()))
     {
         sc->Deactivate();
-        Delete(sc);
+        ReleaseSocketConnection(sc);
     }
 
+    // every connection has left its loop, so the loops can go
+    delete event_loops;
+    delete workers;
+
+    DeleteHandlers();
+    pthread_mutex_destroy(&handler_mutex);
+    pthread_cond_destroy(&handshake_room);
+    pthread_mutex_destroy(&handshake_mutex);
+    if (server_context)
+        SSL_CTX_free(server_context); // connections still using it hold their own references
+    delete ticket_keys;
+    pthread_mutex_destroy(&context_mutex);
+
     //clean up anything that might be left over in the packet_set
     Packet* temp;
     while((temp = packet_set.pop_front()))
     {
+        SocketConnection_Base::PacketTaken(temp);
         delete temp;
     }
 }
@@ -124,7 +307,47 @@ void* ServerSocket::HealthMonitor(void* arg)
     {
         size_t size = ss->connection_set.size();
         //DEBUG_OUT("Number of socket connections: " << size);
-        cout << "Number of socket connections: " << size << endl;
+        cout << "Number of socket connections: " << size << " across " << ss->event_loops->GetCount() << " event loops" << endl;
+        BufferPoolStats pool;
+        BufferPool::GetStats(pool);
+        cout << "Buffer pool: " << pool.hits << " of " << pool.allocations << " allocations reused, " << pool.bytes_held / 1024 << " KB held" << endl;
+        QueueStats output, input;
+        ss->GetOutputStats(output);
+        ss->GetInputStats(input);
+        cout << "Output queues: " << output.queued_bytes / 1024 << " KB queued, " << output.peak_bytes / 1024 << " KB peak, "
+             << output.dropped << " dropped, " << output.blocked << " blocked, " << output.disconnects << " disconnected" << endl;
+        cout << "Input queue: " << input.queued_bytes / 1024 << " KB queued, " << input.peak_bytes / 1024 << " KB peak, "
+             << input.dropped << " dropped, " << input.blocked << " blocked, " << input.disconnects << " disconnected" << endl;
+        HandshakeStats handshakes;
+        ss->GetHandshakeStats(handshakes);
+        if(handshakes.completed || handshakes.failed || handshakes.in_progress)
+        {
+            const size_t buckets = sizeof(handshakes.latency) / sizeof(handshakes.latency[0]);
+            cout << "TLS handshakes: " << handshakes.in_progress << " in progress, " << handshakes.completed << " completed ("
+                 << handshakes.resumed << " resumed, " << handshakes.early_data << " with early data), "
+                 << handshakes.failed << " failed.  Latency:";
+            for(size_t i = 0; i < buckets; i++)
+            {
+                if(handshakes.latency[i] == 0)
+                    continue;
+                if(i + 1 < buckets)
+                    cout << " <" << (1 << i) << "ms " << handshakes.latency[i];
+                else
+                    cout << " >=" << (1 << (i - 1)) << "ms " << handshakes.latency[i];
+            }
+            cout << endl;
+        }
+        if(ss->listeners.size() > 1)
+        {
+            for(size_t i = 0; i < ss->listeners.size(); i++)
+                cout << "Listener " << i << ": " << __atomic_load_n(&ss->listeners[i]->accepted, __ATOMIC_RELAXED) << " accepted" << endl;
+        }
+        for(size_t i = 0; i < ss->GetWorkerCount(); i++)
+        {
+            WorkerStats worker;
+            ss->GetWorkerStats(i, worker);
+            cout << "Worker " << i << ": " << worker.queued << " queued, " << worker.peak_queued << " peak, " << worker.processed << " processed" << endl;
+        }
 #if !(defined(WIN32) || defined(__WIN32) || defined(__WIN32__) || defined(FORCE_WIN32))
 		sleep(5);
 #else
@@ -136,15 +359,19 @@ void* ServerSocket::HealthMonitor(void* arg)
 
 void ServerSocket::Run() const
 {
-    pthread_join(_accept_thread_id, NULL);
+    pthread_join(listeners[0]->thread, NULL);
 }
 
 
 void ServerSocket::DeleteSocketConnection(SocketConnection_Base* sc_ptr)
 {
     sc_ptr->Deactivate();
+    // a TLS connection is only announced once its handshake succeeds, or its early data is accepted
+    TLSSocketConnection* tls = dynamic_cast<TLSSocketConnection*>(sc_ptr);
+    if (tls == NULL || tls->IsConnectReported())
+        NotifyConnection(sc_ptr, false);
     RemoveSocketConnection(sc_ptr);
-    Delete(sc_ptr);
+    ReleaseSocketConnection(sc_ptr); // a broadcast may still hold a reference
 }
 
 
@@ -163,7 +390,20 @@ void ServerSocket::RemoveSocketConnection(SocketConnection_Base* sc_ptr)
 Packet* ServerSocket::NewPacket()
 {
     DEBUG_REPORT_LOCATION;
-    return packet_set.Consumer();   //Will block if there is nothing in the packet_set;
+    Packet* pkt = packet_set.Consumer();   //Will block if there is nothing in the packet_set;
+    SocketConnection_Base::PacketTaken(pkt);
+    return pkt;
+}
+
+
+size_t ServerSocket::NewPackets(vector<Packet*>& packets, size_t max, int timeout_ms)
+{
+    DEBUG_REPORT_LOCATION;
+    packets.clear();
+    size_t count = packet_set.ConsumeBatch(packets, max, timeout_ms);
+    for(size_t i = 0; i < count; i++)
+        SocketConnection_Base::PacketTaken(packets[i]);
+    return count;
 }
 
 
@@ -176,16 +416,7 @@ void ServerSocket::DeletePacket(Packet* pkt)
 bool ServerSocket::WriteAll(const Packet* pkt)
 {
     DEBUG_REPORT_LOCATION;
-
-    bool write_success = true;
-    auto visitor = [pkt, &write_success](SocketConnection_Base* connection_ptr) -> bool
-    {
-        write_success = connection_ptr->Write(*pkt); // Write returns a bool that is intended to indicate whether the write succeeded, but there are no circumstances where false is ever returned.        
-        return write_success;
-    };
-
-    connection_set.visit_all(visitor);
-    return write_success;
+    return Broadcast(pkt, NULL);
 }
 
 
@@ -198,59 +429,530 @@ bool ServerSocket::WriteAll(const Packet* pkt)
 bool ServerSocket::WriteAllExceptOrigin(const Packet* pkt)
 {
     DEBUG_REPORT_LOCATION;
+    return Broadcast(pkt, pkt->GetOrigin());
+}
 
-    bool write_success = true;
-    auto visitor = [pkt, &write_success](SocketConnection_Base* connection_ptr) -> bool
+
+/*
+    The packet is serialized once, and every connection queues a reference
+    to the same Frame, which is freed when the last of them has sent it.
+
+    The connection list is only locked long enough to take a reference on
+    each connection.  Write() may block on a full output buffer, and doing
+    that with the list locked would stall accepts and disconnects for
+    every other client.  A connection that disconnects during the fan-out
+    is deleted by whichever side drops the last reference.
+*/
+bool ServerSocket::Broadcast(const Packet* pkt, SocketConnection_Base* except)
+{
+    vector<SocketConnection_Base*> targets;
+    auto visitor = [except, &targets](SocketConnection_Base* connection_ptr) -> bool
     {
-        if (connection_ptr != pkt->GetOrigin())
+        if (connection_ptr != except)
         {
-            write_success = connection_ptr->Write(*pkt); // Write returns a bool that is intended to indicate whether the write succeeded, but there are no circumstances where false is ever returned.
+            connection_ptr->AddReference();
+            targets.push_back(connection_ptr);
         }
-        return write_success;
+        return true;
     };
-
     connection_set.visit_all(visitor);
+
+    Frame* frame = Frame::Create(pkt->GetType(), pkt->GetDataLength(), pkt->GetData());
+    bool write_success = true;
+    for (size_t i = 0; i < targets.size(); i++)
+    {
+        if (!targets[i]->Write(frame))
+            write_success = false;
+        ReleaseSocketConnection(targets[i]);
+    }
+    frame->Release();
     return write_success;
 }
 
 
+void ServerSocket::GetOutputStats(QueueStats& stats) const
+{
+    output_total.GetStats(stats);
+}
+
+
+void ServerSocket::GetInputStats(QueueStats& stats) const
+{
+    input_total.GetStats(stats);
+}
+
+
+void ServerSocket::OnPacket(PacketHandler handler, void* context)
+{
+    SetPacketHandler(&any_handler, handler, context);
+}
+
+
+void ServerSocket::OnPacket(PacketType type, PacketHandler handler, void* context)
+{
+    SetPacketHandler(&type_handlers[type], handler, context);
+}
+
+
+void ServerSocket::OnConnect(ConnectionHandler handler, void* context)
+{
+    SetConnectionHandler(&connect_handler, handler, context);
+}
+
+
+void ServerSocket::OnDisconnect(ConnectionHandler handler, void* context)
+{
+    SetConnectionHandler(&disconnect_handler, handler, context);
+}
+
+
+void ServerSocket::SetPacketHandler(PacketHandlerEntry** slot, PacketHandler handler, void* context)
+{
+    PacketHandlerEntry* entry = NULL;
+    if (handler)
+    {
+        entry = new PacketHandlerEntry;
+        entry->handler = handler;
+        entry->context = context;
+    }
+    pthread_mutex_lock(&handler_mutex);
+    PacketHandlerEntry* old_entry = __atomic_exchange_n(slot, entry, __ATOMIC_SEQ_CST);
+    if (old_entry)
+    {
+        RetiredPacketHandler retired = { old_entry, __atomic_load_n(&handler_epoch, __ATOMIC_SEQ_CST) };
+        retired_packet_handlers.push_back(retired);
+    }
+    ReclaimHandlers();
+    pthread_mutex_unlock(&handler_mutex);
+}
+
+
+void ServerSocket::SetConnectionHandler(ConnectionHandlerEntry** slot, ConnectionHandler handler, void* context)
+{
+    ConnectionHandlerEntry* entry = NULL;
+    if (handler)
+    {
+        entry = new ConnectionHandlerEntry;
+        entry->handler = handler;
+        entry->context = context;
+    }
+    pthread_mutex_lock(&handler_mutex);
+    ConnectionHandlerEntry* old_entry = __atomic_exchange_n(slot, entry, __ATOMIC_SEQ_CST);
+    if (old_entry)
+    {
+        RetiredConnectionHandler retired = { old_entry, __atomic_load_n(&handler_epoch, __ATOMIC_SEQ_CST) };
+        retired_connection_handlers.push_back(retired);
+    }
+    ReclaimHandlers();
+    pthread_mutex_unlock(&handler_mutex);
+}
+
+
+/*
+    EnterHandlers / LeaveHandlers
+
+    Bracket every use of a handler entry.  The caller counts itself in
+    handler_users under the epoch it entered in, checking that the epoch
+    didn't move while it did so.  Anything it then loads from a handler
+    slot was still in place during that epoch.
+*/
+uint64_t ServerSocket::EnterHandlers()
+{
+    for (;;)
+    {
+        uint64_t epoch = __atomic_load_n(&handler_epoch, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&handler_users[epoch & 1], 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&handler_epoch, __ATOMIC_SEQ_CST) == epoch)
+            return epoch;
+        __atomic_sub_fetch(&handler_users[epoch & 1], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+
+void ServerSocket::LeaveHandlers(uint64_t epoch)
+{
+    __atomic_sub_fetch(&handler_users[epoch & 1], 1, __ATOMIC_SEQ_CST);
+}
+
+
+/*
+    ReclaimHandlers
+
+    Called with handler_mutex held.  The epoch only moves on once nobody
+    who entered in the epoch before the current one is left, so by the time
+    it is two past the epoch an entry was retired in, every thread that
+    could have loaded the entry has left and it can be deleted.  Entries
+    whose users are still inside are picked up by a later registration, or
+    by the destructor.
+*/
+void ServerSocket::ReclaimHandlers()
+{
+    for (int i = 0; i < 2; i++)
+    {
+        uint64_t epoch = __atomic_load_n(&handler_epoch, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&handler_users[(epoch + 1) & 1], __ATOMIC_SEQ_CST) != 0)
+            break;
+        __atomic_store_n(&handler_epoch, epoch + 1, __ATOMIC_SEQ_CST);
+    }
+
+    uint64_t epoch = __atomic_load_n(&handler_epoch, __ATOMIC_SEQ_CST);
+    size_t kept = 0;
+    for (size_t i = 0; i < retired_packet_handlers.size(); i++)
+    {
+        if (retired_packet_handlers[i].epoch + 2 <= epoch)
+            delete retired_packet_handlers[i].entry;
+        else
+            retired_packet_handlers[kept++] = retired_packet_handlers[i];
+    }
+    retired_packet_handlers.resize(kept);
+
+    kept = 0;
+    for (size_t i = 0; i < retired_connection_handlers.size(); i++)
+    {
+        if (retired_connection_handlers[i].epoch + 2 <= epoch)
+            delete retired_connection_handlers[i].entry;
+        else
+            retired_connection_handlers[kept++] = retired_connection_handlers[i];
+    }
+    retired_connection_handlers.resize(kept);
+}
+
+
+/*
+    DeleteHandlers
+
+    Deletes every handler entry, installed or retired.  Only once no thread
+    can call a handler any more.
+*/
+void ServerSocket::DeleteHandlers()
+{
+    for (size_t i = 0; i < 256; i++)
+        delete type_handlers[i];
+    delete any_handler;
+    delete connect_handler;
+    delete disconnect_handler;
+    for (size_t i = 0; i < retired_packet_handlers.size(); i++)
+        delete retired_packet_handlers[i].entry;
+    for (size_t i = 0; i < retired_connection_handlers.size(); i++)
+        delete retired_connection_handlers[i].entry;
+    retired_packet_handlers.clear();
+    retired_connection_handlers.clear();
+}
+
+
+ServerSocket::PacketHandlerEntry* ServerSocket::FindPacketHandler(const Packet* pkt) const
+{
+    PacketHandlerEntry* entry = __atomic_load_n(&type_handlers[pkt->GetType()], __ATOMIC_ACQUIRE);
+    if (entry == NULL)
+        entry = __atomic_load_n(&any_handler, __ATOMIC_ACQUIRE);
+    return entry;
+}
+
+
+/*
+    Without workers, packets are handled right on the EventLoop thread that
+    received them, skipping packet_set altogether.  With workers the
+    connection queues the packet on its shard, and DispatchPacket takes it
+    from there.
+*/
+bool ServerSocket::HandlePacket(Packet* pkt)
+{
+    if (workers)
+        return false;
+    uint64_t epoch = EnterHandlers();
+    PacketHandlerEntry* entry = FindPacketHandler(pkt);
+    if (entry == NULL)
+    {
+        LeaveHandlers(epoch);
+        return false;
+    }
+
+    SocketConnection_Base::PacketTaken(pkt);
+    try
+    {
+        entry->handler(pkt, entry->context);
+    }
+    catch (const char* str)
+    {
+        LOG_ERROR_OUT("Exception in packet handler: " << str);
+    }
+    CATCHALL
+    {
+        LOG_ERROR_OUT("Unknown exception in packet handler.");
+    }
+    LeaveHandlers(epoch);
+    Delete(pkt);
+    return true;
+}
+
+
+void ServerSocket::DispatchPacket(Packet* pkt, void* context)
+{
+    ServerSocket* ss = (ServerSocket*)context;
+    ConnectionEvent* event = dynamic_cast<ConnectionEvent*>(pkt);
+    if (event)
+    {
+        ss->RunConnectionHandler(event->GetConnection(), event->IsConnect());
+        return;
+    }
+
+    uint64_t epoch = ss->EnterHandlers();
+    PacketHandlerEntry* entry = ss->FindPacketHandler(pkt);
+    try
+    {
+        if (entry)
+        {
+            entry->handler(pkt, entry->context);
+        }
+        else
+        {
+            LOG_DEBUG_OUT("No handler for packet type " << (int)pkt->GetType() << ", discarding it.");
+        }
+    }
+    CATCHALL
+    {
+        ss->LeaveHandlers(epoch);
+        throw;
+    }
+    ss->LeaveHandlers(epoch);
+}
+
+
+void ServerSocket::NotifyConnection(SocketConnection_Base* sc_ptr, bool connected)
+{
+    if (__atomic_load_n(connected ? &connect_handler : &disconnect_handler, __ATOMIC_ACQUIRE) == NULL)
+        return;
+    if (workers)
+        sc_ptr->GetInputBuffer()->Producer(new ConnectionEvent(sc_ptr, connected));
+    else
+        RunConnectionHandler(sc_ptr, connected);
+}
+
+
+void ServerSocket::RunConnectionHandler(SocketConnection_Base* sc_ptr, bool connected)
+{
+    uint64_t epoch = EnterHandlers();
+    ConnectionHandlerEntry* entry = __atomic_load_n(connected ? &connect_handler : &disconnect_handler, __ATOMIC_ACQUIRE);
+    if (entry == NULL)
+    {
+        LeaveHandlers(epoch);
+        return;
+    }
+    try
+    {
+        entry->handler(sc_ptr, entry->context);
+    }
+    catch (const char* str)
+    {
+        LOG_ERROR_OUT("Exception in connection handler: " << str);
+    }
+    CATCHALL
+    {
+        LOG_ERROR_OUT("Unknown exception in connection handler.");
+    }
+    LeaveHandlers(epoch);
+}
+
+
+size_t ServerSocket::GetWorkerCount() const
+{
+    return workers ? workers->GetCount() : 0;
+}
+
+
+void ServerSocket::GetWorkerStats(size_t shard, WorkerStats& stats) const
+{
+    if (workers == NULL)
+        throw("This ServerSocket has no workers.");
+    workers->GetStats(shard, stats);
+}
+
+
+void ServerSocket::GetHandshakeStats(HandshakeStats& stats) const
+{
+    const size_t buckets = sizeof(stats.latency) / sizeof(stats.latency[0]);
+    stats.in_progress = __atomic_load_n(&handshakes.in_progress, __ATOMIC_RELAXED);
+    stats.completed = __atomic_load_n(&handshakes.completed, __ATOMIC_RELAXED);
+    stats.resumed = __atomic_load_n(&handshakes.resumed, __ATOMIC_RELAXED);
+    stats.early_data = __atomic_load_n(&handshakes.early_data, __ATOMIC_RELAXED);
+    stats.failed = __atomic_load_n(&handshakes.failed, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < buckets; i++)
+        stats.latency[i] = __atomic_load_n(&handshakes.latency[i], __ATOMIC_RELAXED);
+}
+
+
+void ServerSocket::ReloadCertificates()
+{
+    pthread_mutex_lock(&context_mutex);
+    string certificate_file = _options.certificate_file;
+    string private_key_file = _options.private_key_file;
+    pthread_mutex_unlock(&context_mutex);
+    ReloadCertificates(certificate_file, private_key_file);
+}
+
+
+/*
+    The files are loaded before taking the lock, so accepts carry on with
+    the old context meanwhile.  Each connection holds a reference of its
+    own, so releasing ours only frees the old context once the last
+    connection using it is gone.
+*/
+void ServerSocket::ReloadCertificates(const string& certificate_file, const string& private_key_file)
+{
+    SSL_CTX* context = CreateContext(certificate_file, private_key_file);
+
+    pthread_mutex_lock(&context_mutex);
+    SSL_CTX* old_context = server_context;
+    server_context = context;
+    _options.certificate_file = certificate_file;
+    _options.private_key_file = private_key_file;
+    pthread_mutex_unlock(&context_mutex);
+
+    if (old_context)
+        SSL_CTX_free(old_context);
+}
+
+
+void ServerSocket::RotateTicketKeys()
+{
+    if (ticket_keys)
+        ticket_keys->Rotate();
+}
+
+
+/*
+    Every context shares the one set of ticket keys, so tickets handed out
+    before a certificate reload are still accepted after it.
+*/
+SSL_CTX* ServerSocket::CreateContext(const string& certificate_file, const string& private_key_file)
+{
+    SSL_CTX* context = TLSSocketConnection::CreateServerContext(certificate_file, private_key_file);
+
+    if (_options.session_cache_size > 0)
+    {
+        SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(context, (long)_options.session_cache_size);
+    }
+    else
+    {
+        SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_OFF);
+    }
+    SSL_CTX_set_timeout(context, (long)_options.session_timeout_s);
+
+    // replays of early data are only caught by the session cache
+    uint32_t early_data_bytes = _options.session_cache_size > 0 ? _options.early_data_bytes : 0;
+    SSL_CTX_set_max_early_data(context, early_data_bytes);
+    SSL_CTX_set_recv_max_early_data(context, early_data_bytes);
+
+    if (ticket_keys)
+        ticket_keys->Attach(context);
+    else
+        SSL_CTX_set_options(context, SSL_OP_NO_TICKET);
+    return context;
+}
+
+
+/*
+    Frees up the handshake's slot for the accept threads, and announces the
+    connection now that it can carry packets.
+*/
+void ServerSocket::HandshakeFinished(SocketConnection_Base* sc_ptr, bool succeeded, int64_t latency_ns)
+{
+    const size_t buckets = sizeof(handshakes.latency) / sizeof(handshakes.latency[0]);
+
+    pthread_mutex_lock(&handshake_mutex);
+    __atomic_sub_fetch(&handshakes.in_progress, 1, __ATOMIC_RELAXED);
+    if (succeeded)
+    {
+        size_t bucket = 0;
+        for (int64_t ms = latency_ns / 1000000; ms > 0 && bucket + 1 < buckets; ms >>= 1)
+            bucket++;
+        __atomic_add_fetch(&handshakes.latency[bucket], 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&handshakes.completed, 1, __ATOMIC_RELAXED);
+        TLSSocketConnection* tls = dynamic_cast<TLSSocketConnection*>(sc_ptr);
+        if (tls && tls->IsSessionReused())
+            __atomic_add_fetch(&handshakes.resumed, 1, __ATOMIC_RELAXED);
+        if (tls && tls->IsEarlyDataAccepted())
+            __atomic_add_fetch(&handshakes.early_data, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        __atomic_add_fetch(&handshakes.failed, 1, __ATOMIC_RELAXED);
+    }
+    pthread_cond_signal(&handshake_room);
+    pthread_mutex_unlock(&handshake_mutex);
+
+    if (succeeded)
+        NotifyConnection(sc_ptr, true);
+}
+
+
+/*
+    Returns false if the server is stopping.  Each accept thread checks
+    before it accepts, so with several listeners the limit may be passed
+    by one handshake per listener.
+*/
+bool ServerSocket::WaitForHandshakeRoom()
+{
+    if (_options.handshake_limit == 0)
+        return !stopping;
+    pthread_mutex_lock(&handshake_mutex);
+    while (!stopping && handshakes.in_progress >= _options.handshake_limit)
+        pthread_cond_wait(&handshake_room, &handshake_mutex);
+    pthread_mutex_unlock(&handshake_mutex);
+    return !stopping;
+}
+
+
+void ServerSocket::ReleaseSocketConnection(SocketConnection_Base* sc_ptr)
+{
+    if (sc_ptr->RemoveReference())
+        Delete(sc_ptr);
+}
+
+
 void* ServerSocket::AcceptThread(void* void_arg)
 {
     DEBUG_REPORT_LOCATION;
 
-    /*
-        PTHREAD_CANCEL_DEFERRED will ensure that the threads
-        are killed only when they're blocked.  This is much
-        safer than just killing the threads at random.
-    */
-    pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED,NULL);
+    Listener* listener = (Listener*)void_arg;
+    ServerSocket* my_socket = listener->server;
+    WaitDescriptor waiting = { listener->descriptor, WAIT_READABLE, 0 };
+    int64_t timeout_ns = -1;
 
     try
     {
-        ServerSocket* my_socket = (ServerSocket*)void_arg;
-        int client_descriptor;
-        // the following will block until an incoming connection exists on the socket.
-        while ((client_descriptor = accept(my_socket->server_descriptor, NULL, NULL))) //Currently ignoring the client socket addresses.
+        while (!my_socket->stopping)
         {
-            if (client_descriptor == -1)
+            // the following will block until an incoming connection exists on the socket, or we're stopped.
+            if (WaitForDescriptors(&waiting, 1, timeout_ns, &listener->wakeup) < 0)
             {
-                LOG_ERROR_OUT("accept() failed.");
+                LOG_ERROR_OUT("WaitForDescriptors() failed on a listener.  errno: " << errno);
                 break;
             }
+            timeout_ns = -1;
 
-            try
+            while (my_socket->WaitForHandshakeRoom())
             {
-                TLSSocketConnection* temp = (TLSSocketConnection*)NewSocketConnection(my_socket, &my_socket->packet_set);
-		if(temp == NULL)
-			throw("Failed to allocated new socket connection.");
-                temp->SetDescriptor(client_descriptor);
-                temp->PrepareServerConnection();
-                my_socket->connection_set.push_back(temp);
-                temp->Activate();
-            }
-            catch (const char* str)
-            {
-                cerr << "Failed to instantiate a TLSSocketConnection. Error: " << str << endl;
+#if defined(__linux__)
+                int client_descriptor = accept4(listener->descriptor, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC); //Currently ignoring the client socket addresses.
+#else
+                int client_descriptor = accept(listener->descriptor, NULL, NULL);
+#endif
+                if (client_descriptor == -1)
+                {
+                    if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO)
+                        continue;
+                    if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    {
+                        // such as running out of descriptors; back off instead of spinning on a readable listener
+                        LOG_ERROR_OUT("accept() failed.  errno: " << errno);
+                        timeout_ns = 10000000;
+                    }
+                    break;
+                }
+                __atomic_add_fetch(&listener->accepted, 1, __ATOMIC_RELAXED);
+                my_socket->AcceptConnection(client_descriptor);
             }
         }
     }
@@ -264,10 +966,89 @@ void* ServerSocket::AcceptThread(void* void_arg)
     }
 
     DEBUG_REPORT_LOCATION;
-    pthread_exit((void*)1);
     return NULL;
 }
 
+
+void ServerSocket::AcceptConnection(int client_descriptor)
+{
+    try
+    {
+        PacketPtrSet* queue = workers ? workers->Next() : &packet_set;
+        SocketConnection_Base* temp = NewSocketConnection(this, queue);
+		if(temp == NULL)
+		{
+			CloseDescriptor(client_descriptor);
+			throw("Failed to allocated new socket connection.");
+		}
+        temp->SetDescriptor(client_descriptor);
+        temp->SetEventLoop(event_loops->Next());
+        temp->SetOutputRing(_options.output_ring_entries);
+        temp->SetOutputBudget(_options.output_budget_bytes, _options.output_budget_policy, &output_total);
+        temp->SetInputBudget(_options.input_budget_bytes, _options.input_budget_policy, &input_total);
+        TLSSocketConnection* tls = dynamic_cast<TLSSocketConnection*>(temp);
+        if (tls)
+        {
+            tls->SetFlushLatency(_options.tls_flush_latency_us);
+            tls->SetHandshakeTimeout(_options.handshake_timeout_ms);
+            pthread_mutex_lock(&context_mutex);
+            tls->SetServerContext(server_context);
+            pthread_mutex_unlock(&context_mutex);
+            tls->SetEarlyDataTypes(early_data_types);
+        }
+        try
+        {
+            temp->StartServerConnection();
+        }
+        catch (const char*)
+        {
+            // not activated, so nothing else will close it
+            CloseDescriptor(client_descriptor);
+            ReleaseSocketConnection(temp);
+            throw;
+        }
+        if (tls)
+        {
+            // announced by HandshakeFinished instead, still ahead of any of its packets
+            pthread_mutex_lock(&handshake_mutex);
+            __atomic_add_fetch(&handshakes.in_progress, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&handshake_mutex);
+        }
+        else
+        {
+            NotifyConnection(temp, true); // ahead of any of its packets
+        }
+        connection_set.push_back(temp);
+        try
+        {
+            temp->Activate();
+        }
+        catch (const char*)
+        {
+            // it never reached its loop, so undo everything done for it above
+            RemoveSocketConnection(temp);
+            if (tls)
+            {
+                pthread_mutex_lock(&handshake_mutex);
+                __atomic_sub_fetch(&handshakes.in_progress, 1, __ATOMIC_RELAXED);
+                pthread_cond_signal(&handshake_room);
+                pthread_mutex_unlock(&handshake_mutex);
+            }
+            else
+            {
+                NotifyConnection(temp, false);
+            }
+            CloseDescriptor(client_descriptor);
+            ReleaseSocketConnection(temp);
+            throw;
+        }
+    }
+    catch (const char* str)
+    {
+        cerr << "Failed to accept a connection. Error: " << str << endl;
+    }
+}
+
 /*
 ------------------------------------------------------------------------------
 This software is available under 2 licenses -- choose whichever you prefer.
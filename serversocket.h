@@ -2,16 +2,171 @@
 #define _SERVER_SOCKET_H_
 
 #include "safelist.h"
-#include "pcqueue.h"
+#include "pcring.h"
 #include "socketconnectionowner.h"
 #include "threadutils.h"
+#include "eventloop.h"
+#include "budget.h"
+#include "workerpool.h"
+#include "fdutils.h"
+#include "ticketkeys.h"
+#include <openssl/ssl.h>
 #include <string>
+#include <vector>
 
 using namespace std;
 
 class SocketConnection_Base;
 class Packet;
 
+
+/*
+    ConnectionHandler
+
+    Called when a connection is accepted or goes away.  context is whatever
+    was given with the handler.
+*/
+typedef void (*ConnectionHandler)(SocketConnection_Base* connection, void* context);
+
+
+struct HandshakeStats
+{
+    size_t in_progress;     // handshakes begun and not yet finished
+    uint64_t completed;
+    uint64_t resumed;       // completed by resuming an earlier session
+    uint64_t early_data;    // resumed with early (0-RTT) data accepted
+    uint64_t failed;        // including those that timed out
+
+    /*
+        latency[0] counts the completed handshakes that took under 1 ms, and
+        latency[i] those that took from 2^(i-1) up to 2^i ms.  The last
+        bucket also counts anything slower.
+    */
+    uint64_t latency[16];
+};
+
+struct ServerSocketOptions
+{
+    ServerSocketOptions();
+
+    /*
+        Number of EventLoop threads that service the accepted connections.
+        Each loop owns many connections.  0 selects one loop per online processor.
+    */
+    size_t event_loop_count;
+
+    /*
+        How the event loops perform socket I/O.  IO_BACKEND_IO_URING is used by
+        plaintext SocketConnections; TLS connections stay on readiness events.
+        Loops fall back to IO_BACKEND_EPOLL when the kernel lacks io_uring
+        support.  Defaults to IO_BACKEND_EPOLL.
+    */
+    IOBackend io_backend;
+
+    /*
+        How long, in microseconds, a TLS connection may hold back a partly
+        filled record waiting for more frames to pack into it.  See
+        TLSSocketConnection::SetFlushLatency.  Defaults to 0.
+    */
+    uint32_t tls_flush_latency_us;
+
+    /*
+        Number of frames in each connection's single-writer output ring.  See
+        SocketConnection_Base::SetOutputRing.  Worth enabling when each
+        connection is written to by one application thread; broadcasts count
+        as writes from the thread calling WriteAll.  Defaults to 0 (no ring).
+    */
+    size_t output_ring_entries;
+
+    /*
+        Byte budgets for what each connection has waiting to be sent, and for
+        the received packets each has waiting for NewPacket(s), plus totals
+        across all connections.  When a budget runs out, the matching policy
+        applies; see BudgetPolicy and SocketConnection_Base::SetOutputBudget.
+        Limits of 0, the default, are unlimited, and the policies default to
+        BUDGET_BLOCK.
+    */
+    size_t output_budget_bytes;
+    size_t total_output_budget_bytes;
+    BudgetPolicy output_budget_policy;
+    size_t input_budget_bytes;
+    size_t total_input_budget_bytes;
+    BudgetPolicy input_budget_policy;
+
+    /*
+        Number of worker threads that run the handlers on received packets,
+        each fed by its own shard of connections; see WorkerPool and
+        ServerSocket::OnPacket.  packet_handler, if set, is registered as the
+        catch-all packet handler.  Defaults to 0 (no workers).
+    */
+    size_t worker_count;
+    PacketHandler packet_handler;
+    void* packet_handler_context;
+
+    /*
+        Number of listening sockets, each with its own accept thread.  They
+        are bound to the same address with SO_REUSEPORT, so the kernel
+        spreads incoming connections across them.
+        0 selects one listener per online processor.  Platforms without
+        SO_REUSEPORT always use one.  Defaults to 1.
+    */
+    size_t listener_count;
+
+    /*
+        TLS handshakes run on the event loops rather than the accept
+        threads, so one slow client can't hold up the others.  Once
+        handshake_limit of them are under way, the accept threads wait,
+        leaving new connections in the listen backlog.  A handshake that
+        takes longer than handshake_timeout_ms is dropped.  Defaults to no
+        limit (0) and 10000 ms; a timeout of 0 never times out.
+    */
+    size_t handshake_limit;
+    uint32_t handshake_timeout_ms;
+
+    /*
+        PEM files holding the server's certificate chain and private key.
+        They are loaded once, when the ServerSocket is constructed, and
+        again by ReloadCertificates.  If they can't be loaded then, the
+        error is logged and TLS connections are refused until
+        ReloadCertificates succeeds.  An empty certificate_file skips
+        loading, for servers whose connections are all plaintext.  Default
+        to ./server.crt and ./server.key.
+    */
+    string certificate_file;
+    string private_key_file;
+
+    /*
+        A returning client can resume its earlier session and skip most of
+        the handshake.  The server keeps up to session_cache_size sessions
+        for session_timeout_s seconds; a size of 0 keeps none.  With
+        session_tickets set, it also hands clients tickets, which carry the
+        session so the server needn't keep it.  They are sealed with keys
+        replaced every ticket_key_rotation_s seconds (0 never), and are
+        good for one to two rotations.  Cached sessions are lost when the
+        certificates are reloaded, tickets are not.  Default to 20480
+        sessions, 300 seconds, tickets on, and hourly rotation.
+    */
+    size_t session_cache_size;
+    uint32_t session_timeout_s;
+    bool session_tickets;
+    uint32_t ticket_key_rotation_s;
+
+    /*
+        A TLS 1.3 client resuming a session may send up to
+        early_data_bytes of packets with its ClientHello (0-RTT), which
+        reach the handlers a round trip sooner.  Early data can be replayed
+        by an attacker, so only the packet types listed in early_data_types
+        may arrive that way; they must be safe to handle twice.  A client
+        that sends any other type early is disconnected.  Each session
+        takes early data once, which needs the session cache, so a
+        session_cache_size of 0 refuses it, as do sessions from before
+        ReloadCertificates.  The defaults are 0 bytes (refused) and no
+        types.
+    */
+    uint32_t early_data_bytes;
+    vector<PacketType> early_data_types;
+};
+
 class ServerSocket : public SocketConnectionOwner
 {
 public:
@@ -22,8 +177,11 @@ public:
         for incoming connections.
 
         port is an integer representation of the port on which to listen for incoming connections.
+
+        options tunes how connections are serviced.  See ServerSocketOptions.
     */
     ServerSocket(const string& ip_address, int port);
+    ServerSocket(const string& ip_address, int port, const ServerSocketOptions& options);
     virtual ~ServerSocket();
 
     /*
@@ -32,41 +190,222 @@ public:
         NewPacket picks up the first packet in packet_set and returns it.
 
         If there are no packets in the packet_set, Read will block until one is
-        inserted into the packet_set.
+        inserted into the packet_set.  When ServerSocketOptions::worker_count
+        is set, packets go to the workers instead and packet_set stays empty.
 
         When finished with the packet, you must call DeletePacket().
     */
     Packet* NewPacket();
 
+    /*
+        NewPackets
+
+        Replaces the contents of packets with up to max packets from
+        packet_set, taken in one step, and returns how many there are.
+
+        Blocks only until at least one packet is available, or until
+        timeout_ms milliseconds have passed (-1 waits forever, 0 never
+        waits), in which case 0 is returned.  Like NewPacket, an entry may be
+        NULL when a connection went away.
+
+        Each packet must be passed to DeletePacket() when finished with.
+    */
+    size_t NewPackets(vector<Packet*>& packets, size_t max, int timeout_ms = -1);
+
     void DeletePacket(Packet* pkt);
 
+    /*
+        WriteAll / WriteAllExceptOrigin
+
+        Queue pkt to every connection (but the one it came from).  The packet
+        is serialized once and shared by all of them.  Returns false if any
+        connection refused it because it was disconnecting or its output
+        budget dropped it.
+    */
     bool WriteAll(const Packet* pkt);
     bool WriteAllExceptOrigin(const Packet* pkt);
 
+    /*
+        GetOutputStats / GetInputStats
+
+        Queue depth, peak and drop counters summed over every connection,
+        for sizing the budgets in ServerSocketOptions.
+    */
+    void GetOutputStats(QueueStats& stats) const;
+    void GetInputStats(QueueStats& stats) const;
+
+    /*
+        GetWorkerCount / GetWorkerStats
+
+        Number of worker shards, and the queue depth and throughput of one
+        of them.
+    */
+    size_t GetWorkerCount() const;
+    void GetWorkerStats(size_t shard, WorkerStats& stats) const;
+
+    /*
+        GetHandshakeStats
+
+        How many TLS handshakes are under way, how many have finished
+        either way, and how long the successful ones took.
+    */
+    void GetHandshakeStats(HandshakeStats& stats) const;
+
+    /*
+        ReloadCertificates
+
+        Loads the certificate chain and private key again, from the files
+        in ServerSocketOptions or from the ones given, and swaps them in
+        for the connections accepted from then on.  Connections already
+        accepted keep the certificate they started with.  Throws, leaving
+        the current certificate in use, if the new files can't be loaded.
+    */
+    void ReloadCertificates();
+    void ReloadCertificates(const string& certificate_file, const string& private_key_file);
+
+    /*
+        RotateTicketKeys
+
+        Starts sealing session tickets with a new key now, ahead of
+        ServerSocketOptions::ticket_key_rotation_s.  Tickets already handed
+        out are still accepted until the next rotation.
+    */
+    void RotateTicketKeys();
+
+    /*
+        OnPacket / OnConnect / OnDisconnect
+
+        Register handlers that the server calls itself, instead of the
+        application pulling packets with NewPacket(s).  OnPacket with a type
+        only gets packets of that type; without one it gets every packet no
+        type handler took.  Registering again replaces the handler, and a
+        NULL handler removes it.  Handlers can be replaced any number of
+        times, and may be replaced from inside a handler.
+
+        With ServerSocketOptions::worker_count set, handlers run on the
+        workers, and a connection's OnConnect, packets and OnDisconnect are
+        handled in order on its shard.  Packets no handler takes are
+        discarded.  Without workers, handlers run straight on the accepting
+        and EventLoop threads, so they must not block, and packets no handler
+        takes are left for NewPacket(s).
+
+        OnConnect is called for a TLS connection once its handshake has
+        succeeded, and OnDisconnect only for connections that had OnConnect.
+        OnDisconnect is not called for the connections still open when the
+        ServerSocket is destroyed.
+    */
+    void OnPacket(PacketHandler handler, void* context = NULL);
+    void OnPacket(PacketType type, PacketHandler handler, void* context = NULL);
+    void OnConnect(ConnectionHandler handler, void* context = NULL);
+    void OnDisconnect(ConnectionHandler handler, void* context = NULL);
+
     void Run() const;
 
     void DeleteSocketConnection(SocketConnection_Base* sc_ptr);
+    bool HandlePacket(Packet* pkt);
+    void HandshakeFinished(SocketConnection_Base* sc_ptr, bool succeeded, int64_t latency_ns);
 
 private:
+    /*
+        Listener
+
+        One listening socket and the thread accepting on it.  wakeup tells
+        the thread to stop once stopping is set.
+    */
+    struct Listener
+    {
+        ServerSocket* server;
+        int descriptor;
+        pthread_t thread;
+        WaitWakeup wakeup;
+        uint64_t accepted;
+    };
+
     /*
         AcceptThread
 
-        AcceptThread will be spawned as a thread upon construction of a ServerSocket.
+        One AcceptThread is spawned per Listener upon construction of a ServerSocket.
 
         AcceptThread is responsible for listening for incoming connections, then inserting
         the connection into the connection_set upon connection.
     */
     static void* AcceptThread(void* void_arg);
+    int OpenListener(const string& ip_address, int port, bool reuse_port);
+    void AcceptConnection(int client_descriptor);
+    bool WaitForHandshakeRoom();
+    SSL_CTX* CreateContext(const string& certificate_file, const string& private_key_file);
 
     static void* HealthMonitor(void* arg);
 
     void RemoveSocketConnection(SocketConnection_Base* sc_ptr);
+    void ReleaseSocketConnection(SocketConnection_Base* sc_ptr);
+    bool Broadcast(const Packet* pkt, SocketConnection_Base* except);
+
+    /*
+        Handlers are swapped in whole, so the threads calling them never see
+        a handler paired with another handler's context.  A replaced entry
+        is retired with the handler_epoch it was replaced in, and deleted
+        once every thread that could still be using it has left (see
+        EnterHandlers).
+    */
+    struct PacketHandlerEntry
+    {
+        PacketHandler handler;
+        void* context;
+    };
+    struct ConnectionHandlerEntry
+    {
+        ConnectionHandler handler;
+        void* context;
+    };
+    struct RetiredPacketHandler
+    {
+        PacketHandlerEntry* entry;
+        uint64_t epoch;
+    };
+    struct RetiredConnectionHandler
+    {
+        ConnectionHandlerEntry* entry;
+        uint64_t epoch;
+    };
+
+    static void DispatchPacket(Packet* pkt, void* context);
+    PacketHandlerEntry* FindPacketHandler(const Packet* pkt) const;
+    void NotifyConnection(SocketConnection_Base* sc_ptr, bool connected);
+    void RunConnectionHandler(SocketConnection_Base* sc_ptr, bool connected);
+    void SetPacketHandler(PacketHandlerEntry** slot, PacketHandler handler, void* context);
+    void SetConnectionHandler(ConnectionHandlerEntry** slot, ConnectionHandler handler, void* context);
+    uint64_t EnterHandlers();
+    void LeaveHandlers(uint64_t epoch);
+    void ReclaimHandlers();
+    void DeleteHandlers();
 
     //data
+    ServerSocketOptions _options;
+    EventLoopPool* event_loops;
+    WorkerPool* workers;
     SafeList<SocketConnection_Base*> connection_set;
-    PCQueue<Packet*> packet_set;
-    int server_descriptor;
-    pthread_t _accept_thread_id;
+    PCRing<Packet*> packet_set;
+    ByteBudget output_total;
+    ByteBudget input_total;
+    PacketHandlerEntry* type_handlers[256];
+    PacketHandlerEntry* any_handler;
+    ConnectionHandlerEntry* connect_handler;
+    ConnectionHandlerEntry* disconnect_handler;
+    vector<RetiredPacketHandler> retired_packet_handlers;
+    vector<RetiredConnectionHandler> retired_connection_handlers;
+    pthread_mutex_t handler_mutex;     // serializes registration and reclaiming
+    uint64_t handler_epoch;
+    alignas(64) size_t handler_users[2];   // threads using handler entries, by epoch parity
+    vector<Listener*> listeners;
+    volatile bool stopping;
+    pthread_mutex_t handshake_mutex;
+    pthread_cond_t handshake_room;
+    HandshakeStats handshakes;
+    SSL_CTX* server_context;
+    pthread_mutex_t context_mutex;
+    TicketKeys* ticket_keys;            // NULL without session tickets
+    bool early_data_types[256];         // by packet type, see ServerSocketOptions
     pthread_t _health_monitor_thread_id;
 
     // disable this
@@ -2,6 +2,9 @@
 #include "socketconnection.h"
 #include "serversocket.h"
 #include "threadutils.h"
+#include "fdutils.h"
+#include <errno.h>
+#include <cstring>
 #if !(defined(WIN32) || defined(__WIN32) || defined(__WIN32__) || defined(FORCE_WIN32))
 #include <unistd.h>
 #include <arpa/inet.h>
@@ -12,8 +15,12 @@
 typedef SSIZE_T ssize_t;
 #endif
 
-SocketConnection::SocketConnection( SocketConnectionOwner* owner, PCQueue<Packet*>* input_buffer_ptr)
- : SocketConnection_Base(owner, input_buffer_ptr), active(false)
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // platforms without it rely on SO_NOSIGPIPE or an ignored SIGPIPE
+#endif
+
+SocketConnection::SocketConnection( SocketConnectionOwner* owner, PacketPtrSet* input_buffer_ptr)
+ : SocketConnection_Base(owner, input_buffer_ptr), active(false), uring(NULL), send_in_flight(false)
 {
     DEBUG_REPORT_LOCATION;
 }
@@ -31,10 +38,38 @@ void SocketConnection::Activate()
     DEBUG_REPORT_LOCATION;
     if(!active)
     {
-        //start the reader/writer threads.
-        pthread_create(&writer_id,NULL,SocketConnection::Writer,this);
-        pthread_create(&reader_id,NULL,SocketConnection::Reader,this);
-        active = true;
+        try
+        {
+            if(!SetNonBlockingMode(GetDescriptor()))
+                throw("SetNonBlockingMode() failed.");
+            if(!SetNoDelay(GetDescriptor()))
+            {
+                LOG_DEBUG_OUT("Failed to set TCP_NODELAY.");
+            }
+            uring = GetEventLoop() ? GetEventLoop()->GetURingEngine() : NULL;
+            if(uring && InputBudgetBlocks())
+                uring = NULL;   // a multishot receive can't be paused, so stay on readiness events
+            if(uring)
+            {
+                // the loop only schedules us to flush Write()s; the engine does the I/O
+                send_in_flight = false;
+                GetEventLoop()->Add(this, -1, 0);
+                uring->Receive(this, GetDescriptor());
+                GetEventLoop()->Schedule(this);
+            }
+            else
+            {
+                StartEvents();
+            }
+            active = true;
+        }
+        catch(const char*)
+        {
+            if(GetEventLoop())
+                GetEventLoop()->Remove(this); // the io_uring path registers before it can fail
+            Unlock();
+            throw;
+        }
     }
     Unlock();
 }
@@ -53,7 +88,25 @@ void SocketConnection::Activate()
 */
 void SocketConnection::Deactivate()
 {
-    int rv = 0;
+    /*
+        Leave the EventLoop before taking the lock.  If the loop thread is
+        concurrently deactivating us (peer hung up), it needs the lock to
+        finish, and StopEvents() waits for it to finish.
+
+        With io_uring, leave the loop first so that HandleEvents can't submit
+        anything new, then cancel what is in flight.  The engine keeps any
+        frames still being sent until the kernel is done with them.
+    */
+    if(uring)
+    {
+        GetEventLoop()->Remove(this);
+        uring->Cancel(this);
+        for(size_t i = 0; i < send_markers.size(); i++)
+            ReleaseOutputFrame(send_markers[i]);
+        send_markers.clear();
+    }
+    StopEvents();
+
     Lock();
     DEBUG_REPORT_LOCATION;
     do
@@ -61,34 +114,6 @@ void SocketConnection::Deactivate()
         if(!active)
             break;
 
-        //close threads
-        if(!pthread_equal(pthread_self(), reader_id))
-        {
-            LOG_DEBUG_OUT("cancelling Reader thread.");
-            rv = pthread_cancel(reader_id);
-            //send(GetDescriptor(), "", 0, NULL);
-            pthread_join(reader_id, NULL);
-            LOG_DEBUG_OUT("cancelled Reader thread.");
-        }
-        else
-        {
-            LOG_DEBUG_OUT("Reader thread refused to cancel itself.");
-            pthread_detach(reader_id);
-        }
-
-        if(!pthread_equal(pthread_self(), writer_id))
-        {
-            LOG_DEBUG_OUT("cancelling Writer thread.");
-            rv = pthread_cancel(writer_id);
-            pthread_join(writer_id, NULL);
-            LOG_DEBUG_OUT("cancelled Writer thread.");
-        }
-        else
-        {
-            LOG_DEBUG_OUT("Writer thread refused to cancel itself.");
-            pthread_detach(writer_id);
-        }
-
 #if !(defined(WIN32) || defined(__WIN32) || defined(__WIN32__) || defined(FORCE_WIN32))
         close(GetDescriptor());
 #else
@@ -98,12 +123,14 @@ void SocketConnection::Deactivate()
         /*
             Clear the output buffer. This assumes we don't want
             to store data that was intended for a particular client,
-            then send it after it reconnects.
+            then send it after it reconnects.  Taking the frames frees
+            up the space, so a writer blocked on a full buffer gets to
+            finish.
         */
-        string* temp;
-        while((temp = output_buffer.pop_front()))
+        Frame* temp;
+        while((temp = NextOutputFrame()))
         {
-            delete temp;
+            ReleaseOutputFrame(temp);
             DEBUG_REPORT_LOCATION;
         }
 
@@ -131,207 +158,176 @@ void SocketConnection::Deactivate()
 }
 
 
-void* SocketConnection::Reader(void* void_arg)
+SocketConnection_Base::IOStatus SocketConnection::ReceiveBytes(char* buffer, size_t length, size_t& transferred)
 {
-    if(sizeof(PacketDataLength) != sizeof(uint32_t))
-        throw("major problem.  PacketDataLength does not equal sizeof(uint32_t), which breaks ntohl");
-
-    const unsigned int cbuf_size = sizeof(PacketType) + sizeof(PacketDataLength); //size of the type and length fields of a packet
-    char buf[cbuf_size];
-    SocketConnection* sc_arg = (SocketConnection*)void_arg;
-    int fd = sc_arg->GetDescriptor();
-    fd_set sc_fd_set;           //Declare the file descriptor set.
-    int select_ret = 0;
-    ssize_t read_length = 0;
-    int accum_count = 0;
-
-    DEBUG_REPORT_LOCATION;
-
-    /*
-        PTHREAD_CANCEL_DEFERRED will ensure that the threads
-        are killed only when they're blocked.  This is much
-        safer than just killing the threads at random.
-    */
-    pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
-
-    FD_ZERO(&sc_fd_set);            //initialize the file descriptor set.
-    FD_SET(fd, &sc_fd_set);
-
-    while((select_ret = select(FD_SETSIZE, &sc_fd_set, NULL, NULL, NULL)))
-    {
-        if(select_ret == -1)
-        {
-            break;
-        }
-        else
-        {
 #if !(defined(WIN32) || defined(__WIN32) || defined(__WIN32__) || defined(FORCE_WIN32))
-            read_length = read(fd, buf + accum_count, cbuf_size - accum_count);
+    ssize_t read_length = read(GetDescriptor(), buffer, length);
 #else
-            read_length = recv(fd, buf + accum_count, cbuf_size - accum_count, NULL);
+    ssize_t read_length = recv(GetDescriptor(), buffer, length, NULL);
 #endif
-            accum_count += read_length;
-            if(read_length < 1)
-            {
-                break;
-            }
-            else
-            {
-                if(accum_count < cbuf_size)
-                {
-                    continue;
-                }
-                else
-                {
-                    PacketType type = buf[0];
-                    PacketDataLength data_length = 0;
-                    char* bytePtr = (char*)&data_length;
-                    for(int i=0;i<sizeof(PacketDataLength);i++)
-                        bytePtr[i] = buf[i+1];
-
-                    data_length = ntohl(data_length);
-
-                    char* packetDataBuffer = NULL;
-                    char* seek_position = NULL;
-                    if(data_length > 0)
-                    {
-                        packetDataBuffer = new char[data_length];
-                        if(packetDataBuffer == NULL)
-                        {
-                            // colossal error
-                            break;
-                        }
-                        seek_position = packetDataBuffer;
-                        ssize_t data_read_length = 0;
-                        do
-                        {
+    if(read_length > 0)
+    {
+        transferred = read_length;
+        return IO_OK;
+    }
+    if(read_length == 0)
+        return IO_CLOSED;
+    if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        return IO_WANT_READ;
+    LOG_DEBUG_OUT("read() failed.  errno: " << errno);
+    return IO_ERROR;
+}
+
+
+SocketConnection_Base::IOStatus SocketConnection::SendBytes(const char* buffer, size_t length, size_t& transferred)
+{
 #if !(defined(WIN32) || defined(__WIN32) || defined(__WIN32__) || defined(FORCE_WIN32))
-                            data_read_length = read(fd, seek_position, data_length - (seek_position - packetDataBuffer));
+    ssize_t write_length = send(GetDescriptor(), buffer, length, MSG_NOSIGNAL);
 #else
-                            data_read_length = recv(fd, seek_position, data_length - (seek_position - packetDataBuffer), NULL);
+    ssize_t write_length = send(GetDescriptor(), buffer, length, NULL);
 #endif
-                            seek_position += data_read_length;
-                        }
-                        while((data_read_length > 0) && ((size_t)(seek_position - packetDataBuffer) < data_length));
-                    }
-
-                    if(type == Packet::ERR_DISCONNECTED)
-                        break;
-
-                    try
-                    {
-                        Packet* new_pkt = NewPacket( (SocketConnection_Base*)sc_arg, type, (PacketDataLength)(seek_position - packetDataBuffer), packetDataBuffer, false);
-                        if(new_pkt == NULL)
-                        {
-                            LOG_ERROR_OUT("Failed to instantiate an incoming packet (section 1). ");
-                        }
-                        else
-                        {
-                            sc_arg->input_buffer->Producer(new_pkt); // if so, create a packet and stick it in the input_buffer
-                        }
-                    }
-                    CATCHALL
-                    {
-                        LOG_ERROR_OUT("Failed to instantiate an incoming packet (section 2).");
-                    }
-                    accum_count = 0;
-                }
-            }
-        }
+    if(write_length > 0)
+    {
+        transferred = write_length;
+        return IO_OK;
     }
-
-    SocketConnectionOwner* owner = sc_arg->GetOwner();
-    if(owner)
-        owner->DeleteSocketConnection((SocketConnection_Base*)sc_arg);
-    else
-        sc_arg->Deactivate(); // TODO: This is a hack.  Client sockets need to clean up properly.
-    pthread_exit((void*)1);
-    return NULL;
+    if(write_length == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return IO_WANT_WRITE;
+    LOG_DEBUG_OUT("write() failed.  errno: " << errno);
+    return IO_ERROR;
 }
 
 
-void* SocketConnection::Writer(void* void_arg)
+SocketConnection_Base::IOStatus SocketConnection::SendVector(const iovec* vector, int count, size_t& transferred)
 {
-    DEBUG_REPORT_LOCATION;
-    int select_ret = 0;
-    fd_set sc_fd_set;
-    SocketConnection* sc_arg = (SocketConnection*)void_arg;
+#if !(defined(WIN32) || defined(__WIN32) || defined(__WIN32__) || defined(FORCE_WIN32))
+    // sendmsg() rather than writev() so a vanished peer is an error rather than SIGPIPE
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = (iovec*)vector;
+    message.msg_iovlen = count;
+    ssize_t write_length = sendmsg(GetDescriptor(), &message, MSG_NOSIGNAL);
+    if(write_length > 0)
+    {
+        transferred = write_length;
+        return IO_OK;
+    }
+    if(write_length == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return IO_WANT_WRITE;
+    LOG_DEBUG_OUT("sendmsg() failed.  errno: " << errno);
+    return IO_ERROR;
+#else
+    return SocketConnection_Base::SendVector(vector, count, transferred);
+#endif
+}
 
-    //Writer has no way of returning errors.  is that ok?
 
-    /*
-        PTHREAD_CANCEL_DEFERRED will ensure that the threads
-        are killed only when they're blocked.  This is much
-        safer than just killing the threads at random.
-    */
-    pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED,NULL);
+void SocketConnection::HandleEvents(uint32_t events)
+{
+    if(uring == NULL)
+    {
+        SocketConnection_Base::HandleEvents(events);
+        return;
+    }
 
-    FD_ZERO( &sc_fd_set );
-    FD_SET( sc_arg->GetDescriptor(), &sc_fd_set);
+    if(events & EventLoop::EVENT_SCHEDULED)
+        ClearWriteSchedule();
 
-    try
+    if(!EnforceOutputBudget())
     {
-        while((select_ret = select(FD_SETSIZE,NULL,&sc_fd_set,NULL,NULL)))
-        {
-            LOG_DEBUG_OUT("entered writer's select loop.");
-            if(select_ret == -1)
-            {
-                LOG_ERROR_OUT("select error.  interrupted?");
-                break;
-            }
-            string* temp = sc_arg->output_buffer.Consumer();
-            if(temp == NULL)
-            {
-                /*
-                    This should never happen, since interruption
-                    should only be triggered by pthread_cancel().
-                    If pthread_cancel were called, the thread would
-                    be terminated before we got here.
-                */
-                LOG_DEBUG_OUT("Consumer was interrupted.");
-                break;
-            }
+        Disconnect();
+        return;
+    }
 
-#if !(defined(WIN32) || defined(__WIN32) || defined(__WIN32__) || defined(FORCE_WIN32))
-            ssize_t write_length = write(sc_arg->GetDescriptor(), temp->c_str(), temp->length());
-#else
-            ssize_t write_length = send(sc_arg->GetDescriptor(), temp->c_str(), temp->length(), NULL);
-#endif
+    if(!send_in_flight)
+        SubmitFrames();
+}
 
 
-            LOG_DEBUG_OUT("Successfully wrote: " << dec << write_length << " bytes: ");
-#ifdef DEBUG
-            //logger.Hexdump(*temp);
-#endif
+/*
+    Hands everything waiting in the output buffer to the engine as a single
+    gathered send.  Each frame already carries its header, so the header and
+    payload go out together without needing linked submissions.  Marker
+    frames also wait in send_markers until that send completes, except an
+    empty marker with nothing ahead of it, which is done already.
+*/
+void SocketConnection::SubmitFrames()
+{
+    const size_t max_frames_per_send = 256;
 
-            // TODO: Write is not guaranteed to send the whole buffer out.  If write only sends part of our data, we need to loop around and send the rest.
+    vector<Frame*> frames;
+    Frame* frame;
+    while(frames.size() < max_frames_per_send && (frame = NextOutputFrame()))
+    {
+        if(frame->GetSize() == 0 && frames.empty())
+        {
+            ReleaseOutputFrame(frame, true);
+            continue;
+        }
+        if(frame->GetSize() > 0)
+            frames.push_back(frame);
+        if(frame->GetCompletion())
+            send_markers.push_back(frame);
+    }
+    if(frames.empty())
+        return;
 
-            delete temp;
-            if(write_length == -1) //write error.
-            {
-                break;
-            }
+    /*
+        The engine takes them over, so they no longer count against the
+        output budget.  Markers keep counting until the send completes.
+    */
+    for(size_t i = 0; i < frames.size(); i++)
+    {
+        frames[i]->AddRef();
+        if(frames[i]->GetCompletion() == NULL)
+            ReleaseOutputFrame(frames[i]);
+    }
 
-            LOG_DEBUG_OUT("end writer's loop");
-        }
-        LOG_DEBUG_OUT("Exiting writer thread.");
+    try
+    {
+        uring->Send(this, GetDescriptor(), frames);
+        send_in_flight = true;
     }
     catch(const char* e)
     {
-        LOG_ERROR_OUT("Exception at " << __FILE__ << ":" << __LINE__ << " - " << e);
+        LOG_ERROR_OUT("Failed to submit a send: " << e);
+        for(size_t i = 0; i < frames.size(); i++)
+            frames[i]->Release();
+        Disconnect();
     }
-    CATCHALL
+}
+
+
+void SocketConnection::ReceiveCompleted(const char* data, int result)
+{
+    if(result <= 0)
     {
-        LOG_ERROR_OUT("Unknown exception at " << __FILE__ << ":" << __LINE__);
+        if(result < 0)
+        {
+            LOG_DEBUG_OUT("io_uring receive failed.  errno: " << -result);
+        }
+        Disconnect();
+        return;
     }
 
-    SocketConnectionOwner* owner = sc_arg->GetOwner();
-    if(owner)
-        owner->DeleteSocketConnection((SocketConnection_Base*)sc_arg);
-    else
-        sc_arg->Deactivate(); // TODO: This is a hack.  Client sockets need to clean up properly.
-    pthread_exit((void*)1);
-    return NULL;
+    if(IO_OK != ConsumeInput(data, result))
+        Disconnect();
+}
+
+
+void SocketConnection::SendCompleted(int result)
+{
+    send_in_flight = false;
+    if(result < 0)
+    {
+        LOG_DEBUG_OUT("io_uring send failed.  errno: " << -result);
+        Disconnect();
+        return;
+    }
+    for(size_t i = 0; i < send_markers.size(); i++)
+        ReleaseOutputFrame(send_markers[i], true);
+    send_markers.clear();
+    SubmitFrames();
 }
 
 
@@ -6,12 +6,13 @@
 #include "pcqueue.h"
 #include "socketconnectionowner.h"
 #include "socketconnection_base.h"
+#include "uringengine.h"
 #include <string>
 
 using namespace std;
 
 
-class SocketConnection : public SocketConnection_Base
+class SocketConnection : public SocketConnection_Base, public URingHandler
 {
 public:
     /*
@@ -29,8 +30,9 @@ public:
     /*
         Activate
 
-        Used to initialize the threads used for reading to and
-        writing from the socket.
+        Used to register the socket with its EventLoop, which then
+        reads from and writes to it without blocking.  If the loop has an
+        io_uring engine, the socket's I/O is submitted through it instead.
     */
     void Activate();
 
@@ -45,22 +47,22 @@ public:
 
     bool GetActive() const;
 
-private:
-    /*
-        Reader
+    virtual void HandleEvents(uint32_t events);
+    virtual void ReceiveCompleted(const char* data, int result);
+    virtual void SendCompleted(int result);
 
-        Thread responsible for listening for incoming packets.
-        Blocks based on select of descriptor and if maximum input_buffer
-        size is met.
-    */
-    static void* Reader(void* void_arg);
+protected:
+    virtual IOStatus ReceiveBytes(char* buffer, size_t length, size_t& transferred);
+    virtual IOStatus SendBytes(const char* buffer, size_t length, size_t& transferred);
+    virtual IOStatus SendVector(const iovec* vector, int count, size_t& transferred);
 
-    /* Thread responsible for sending packets from output_buffer at next opportunity.  Blocks if nothing is in output_buffer and select of descriptor. */
-    static void* Writer(void* void_arg);
+private:
+    void SubmitFrames();
 
-    pthread_t reader_id;
-    pthread_t writer_id;
     bool active;
+    URingEngine* uring;     // NULL when driven by readiness events
+    bool send_in_flight;
+    vector<Frame*> send_markers;    // marker frames waiting on the send in flight
 };
 
 
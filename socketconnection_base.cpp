@@ -2,6 +2,10 @@
 #include "socketconnection_base.h"
 #include "threadutils.h"
 #include "fdutils.h"
+#include "bufferpool.h"
+#include <cstring>
+#include <climits>
+#include <algorithm>
 #if !(defined(WIN32) || defined(__WIN32) || defined(__WIN32__) || defined(FORCE_WIN32))
 #include <unistd.h>
 #include <arpa/inet.h>
@@ -12,8 +16,16 @@
 typedef SSIZE_T ssize_t;
 #endif
 
-SocketConnection_Base::SocketConnection_Base(SocketConnectionOwner* owner, PCQueue<Packet*>* input_buffer_ptr)
-    : _owner(owner), descriptor(0), input_buffer(input_buffer_ptr), packets_out(0)
+// how often a connection that stopped reading for its input budget looks again
+static const int64_t input_retry_ns = 1000000;
+
+SocketConnection_Base::SocketConnection_Base(SocketConnectionOwner* owner, PacketPtrSet* input_buffer_ptr)
+    : _owner(owner), descriptor(0), input_buffer(input_buffer_ptr), packets_out(0), event_loop(NULL),
+      references(1), stopped(false),
+      header_received(0), payload_buffer(NULL), payload_length(0), payload_received(0),
+      output_ring(NULL), output_ring_writer(0), output_ring_pushing(false), output_state(OUTPUT_RING), output_buffered(0), write_scheduled(false),
+      output_policy(BUDGET_BLOCK), output_overflowed(false), input_policy(BUDGET_BLOCK), input_total(NULL),
+      send_offset(0), receive_status(IO_WANT_READ), send_status(IO_OK), input_deferred(false), interest(0)
 {
     DEBUG_REPORT_LOCATION;
     sem_init(&mutex,0,1);
@@ -23,6 +35,13 @@ SocketConnection_Base::SocketConnection_Base(SocketConnectionOwner* owner, PCQue
 SocketConnection_Base::~SocketConnection_Base()
 {
     DEBUG_REPORT_LOCATION;
+    for(size_t i = 0; i < send_frames.size(); i++)
+        ReleaseOutputFrame(send_frames[i]);
+    Frame* frame;
+    while((frame = NextOutputFrame())) // written after the connection was deactivated
+        ReleaseOutputFrame(frame);
+    delete output_ring;
+    BufferPool::Free(payload_buffer);
     sem_destroy(&mutex);
 }
 
@@ -71,12 +90,31 @@ SocketConnectionOwner* SocketConnection_Base::GetOwner() const
 }
 
 
+PacketPtrSet* SocketConnection_Base::GetInputBuffer() const
+{
+    return input_buffer;
+}
+
+
+void SocketConnection_Base::AddReference()
+{
+    __atomic_add_fetch(&references, 1, __ATOMIC_RELAXED);
+}
+
+
+bool SocketConnection_Base::RemoveReference()
+{
+    return __atomic_sub_fetch(&references, 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+
 
 bool SocketConnection_Base::Write(const char* cstring_arg)
 {
+#if 1
     // not allowed
     return false;
-
+#else
     bool ret_val = false;
     string* temp;
     Lock();
@@ -86,6 +124,7 @@ bool SocketConnection_Base::Write(const char* cstring_arg)
     Unlock();
 
     return ret_val;
+#endif
 }
 
 
@@ -111,34 +150,223 @@ bool SocketConnection_Base::Write(const string& string_arg)
 bool SocketConnection_Base::Write(const PacketType& type_arg, const PacketDataLength& data_length_arg, const char* data_arg)
 {
     DEBUG_REPORT_LOCATION;
-    if(sizeof(PacketDataLength) != sizeof(uint32_t))
-        throw("major problem.  PacketDataLength does not equal sizeof(uint32_t), which breaks htonl");
+    Frame* frame = Frame::Create(type_arg, data_length_arg, data_arg);
+    bool ret_val = Write(frame);
+    frame->Release();
+    return ret_val;
+}
 
-    bool ret_val = false;
-    string* temp = NULL;
-    char* bytePtr = NULL;
-    Lock();
+
+bool SocketConnection_Base::Write(const Packet& pkt)
+{
+    return SocketConnection_Base::Write(pkt.GetType(), pkt.GetDataLength(), pkt.GetData());
+}
+
+
+bool SocketConnection_Base::Write(Frame* frame)
+{
     DEBUG_REPORT_LOCATION;
-    temp = new string();
-    temp->push_back((unsigned char)type_arg);
-    PacketDataLength corrected_data_length = htonl(data_length_arg);
-    bytePtr = (char*)&corrected_data_length;
-    for(int i=0;i<sizeof(PacketDataLength);i++)
+    bool ret_val = false;
+    if(__atomic_load_n(&stopped, __ATOMIC_ACQUIRE))
+        return false;
+
+    // an empty marker holds no bytes, so it is never charged to the budget
+    size_t size = frame->GetSize();
+    if(size > 0 && !output_budget.TryCharge(size))
     {
-        temp->push_back(bytePtr[i] & 0x000000FF);
+        switch(output_policy)
+        {
+        case BUDGET_BLOCK:
+            do
+            {
+                if(!output_budget.WaitForRoom(size, &stopped))
+                    return false;
+            } while(!output_budget.TryCharge(size));
+            break;
+        case BUDGET_DROP_OLDEST:
+            /*
+                The loop thread discards older frames to make room.  Until
+                it has caught up with the last overrun, a writer that gets
+                ahead of it loses its own frame instead, which keeps the
+                queue within one frame of the budget.
+            */
+            if(output_budget.IsOver())
+            {
+                output_budget.CountDrop(size);
+                if(event_loop)
+                    event_loop->Schedule(this);
+                return false;
+            }
+            output_budget.Charge(size);
+            break;
+        case BUDGET_DROP_NEWEST:
+            output_budget.CountDrop(size);
+            return false;
+        case BUDGET_DISCONNECT:
+            if(!__atomic_exchange_n(&output_overflowed, true, __ATOMIC_SEQ_CST))
+                output_budget.CountDisconnect();
+            if(event_loop)
+                event_loop->Schedule(this);
+            return false;
+        }
     }
-    for(PacketDataLength i=0;i<data_length_arg;i++)
-        temp->push_back(data_arg[i]);
-    ret_val = output_buffer.Producer( temp );
-    Unlock();
+
+    /*
+        The connection lock is deliberately not held here.  Producer() blocks
+        while the output buffer is full, and the EventLoop thread that drains
+        it may need the lock to deactivate this connection.
+    */
+    frame->AddRef();
+    if(output_ring && PushOutputRing(frame))
+        ret_val = true;
+    else
+    {
+        if(output_ring)
+            __atomic_add_fetch(&output_buffered, 1, __ATOMIC_SEQ_CST);
+        ret_val = output_buffer.Producer( frame );
+        if(!ret_val && output_ring)
+            __atomic_sub_fetch(&output_buffered, 1, __ATOMIC_SEQ_CST);
+    }
+    if(!ret_val)
+        ReleaseOutputFrame(frame);
+    else if(event_loop && !__atomic_exchange_n(&write_scheduled, true, __ATOMIC_SEQ_CST))
+        event_loop->Schedule(this);
 
     return ret_val;
 }
 
 
-bool SocketConnection_Base::Write(const Packet& pkt)
+WriteCompletion* SocketConnection_Base::WriteWithCompletion(const Packet& pkt, WriteCallback callback, void* context)
 {
-    return SocketConnection_Base::Write(pkt.GetType(), pkt.GetDataLength(), pkt.GetData());
+    Frame* frame = Frame::Create(pkt.GetType(), pkt.GetDataLength(), pkt.GetData());
+    WriteCompletion* completion = WriteWithCompletion(frame, callback, context);
+    frame->Release();
+    return completion;
+}
+
+
+/*
+    The frame is queued wrapped in a marker, so the send path can tell the
+    moment its last byte goes out while other connections share the frame.
+*/
+WriteCompletion* SocketConnection_Base::WriteWithCompletion(Frame* frame, WriteCallback callback, void* context)
+{
+    WriteCompletion* completion = new WriteCompletion(callback, context);
+    Frame* marker = Frame::CreateMarker(completion, frame);
+    bool queued = Write(marker);
+    marker->Release();
+    if(!queued)
+    {
+        completion->Release();
+        return NULL;
+    }
+    return completion;
+}
+
+
+/*
+    An empty marker follows everything the calling thread has already
+    queued, in the same ring or buffer, so by the time the send path reaches
+    it all of that has been sent.  Frames queued meanwhile by other threads
+    may come before it too, which only makes it resolve a little later.
+*/
+bool SocketConnection_Base::Flush(int64_t deadline_ns)
+{
+    if(event_loop && event_loop->IsLoopThread())
+        throw("Flush can't wait on the thread that does the sending.");
+
+    WriteCompletion* completion = new WriteCompletion();
+    Frame* marker = Frame::CreateMarker(completion);
+    bool sent = Write(marker);
+    marker->Release();
+    if(sent)
+        sent = completion->Wait(deadline_ns);
+    completion->Release();
+    return sent;
+}
+
+
+/*
+    A thread-local address, unique to each live thread, that identifies the
+    thread writing to a connection.
+*/
+static __thread char output_writer_token;
+
+
+/*
+    The ring only ever has one producer: the first thread to write claims
+    it.  Any other thread switches the connection to OUTPUT_SHARED and uses
+    output_buffer from then on.  When the ring is full the owner moves to
+    OUTPUT_OVERFLOW, and may only move back once NextOutputFrame has taken
+    every frame it spilled into output_buffer, so nothing it writes to the
+    ring can overtake them.  output_ring_pushing lets NextOutputFrame tell
+    when the owner may still be finishing a push to the ring.
+*/
+bool SocketConnection_Base::PushOutputRing(Frame* frame)
+{
+    uint32_t state = __atomic_load_n(&output_state, __ATOMIC_SEQ_CST);
+    if(state == OUTPUT_SHARED)
+        return false;
+
+    uintptr_t self = (uintptr_t)&output_writer_token;
+    uintptr_t writer = __atomic_load_n(&output_ring_writer, __ATOMIC_ACQUIRE);
+    if(writer != self)
+    {
+        if(writer != 0 || !__atomic_compare_exchange_n(&output_ring_writer, &writer, self, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            __atomic_store_n(&output_state, OUTPUT_SHARED, __ATOMIC_SEQ_CST);
+            return false;
+        }
+    }
+
+    if(state == OUTPUT_OVERFLOW)
+    {
+        if(__atomic_load_n(&output_buffered, __ATOMIC_SEQ_CST) != 0)
+            return false;
+        if(!__atomic_compare_exchange_n(&output_state, &state, OUTPUT_RING, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            return false;
+    }
+
+    bool pushed = false;
+    __atomic_store_n(&output_ring_pushing, true, __ATOMIC_SEQ_CST);
+    state = __atomic_load_n(&output_state, __ATOMIC_SEQ_CST);
+    if(state == OUTPUT_RING)
+    {
+        pushed = output_ring->TryPush(frame);
+        if(!pushed)
+            __atomic_compare_exchange_n(&output_state, &state, OUTPUT_OVERFLOW, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    }
+    __atomic_store_n(&output_ring_pushing, false, __ATOMIC_SEQ_CST);
+    return pushed;
+}
+
+
+Frame* SocketConnection_Base::NextOutputFrame()
+{
+    Frame* frame;
+    if(output_ring)
+    {
+        if(output_ring->TryPop(frame))
+            return frame;
+        if(__atomic_load_n(&output_state, __ATOMIC_SEQ_CST) == OUTPUT_RING)
+            return NULL;
+
+        /*
+            Frames in output_buffer were written after everything in the
+            ring, so they wait until the ring is known to be empty.  A writer
+            still inside PushOutputRing schedules the connection again once it
+            returns.
+        */
+        if(__atomic_load_n(&output_ring_pushing, __ATOMIC_SEQ_CST))
+            return NULL;
+        if(output_ring->TryPop(frame))
+            return frame;
+        frame = output_buffer.TryConsumer();
+        if(frame)
+            __atomic_sub_fetch(&output_buffered, 1, __ATOMIC_SEQ_CST);
+        return frame;
+    }
+    return output_buffer.TryConsumer();
 }
 
 
@@ -155,6 +383,573 @@ void SocketConnection_Base::SetDescriptor(int arg)
     descriptor = arg;
 }
 
+
+void SocketConnection_Base::SetEventLoop(EventLoop* loop)
+{
+    event_loop = loop;
+}
+
+
+EventLoop* SocketConnection_Base::GetEventLoop() const
+{
+    return event_loop;
+}
+
+
+void SocketConnection_Base::SetOutputRing(size_t entries)
+{
+    delete output_ring;
+    output_ring = entries ? new SPSCRing<Frame*>(entries) : NULL;
+}
+
+
+void SocketConnection_Base::SetOutputBudget(size_t limit_bytes, BudgetPolicy policy, ByteBudget* total)
+{
+    output_budget.SetLimit(limit_bytes);
+    output_budget.SetParent(total);
+    output_policy = policy;
+}
+
+
+void SocketConnection_Base::SetInputBudget(size_t limit_bytes, BudgetPolicy policy, ByteBudget* total)
+{
+    input_budget.SetLimit(limit_bytes);
+    input_budget.SetParent(total);
+    input_policy = policy;
+    input_total = total;
+}
+
+
+void SocketConnection_Base::GetOutputStats(QueueStats& stats) const
+{
+    output_budget.GetStats(stats);
+}
+
+
+void SocketConnection_Base::GetInputStats(QueueStats& stats) const
+{
+    input_budget.GetStats(stats);
+}
+
+
+void SocketConnection_Base::ReleaseOutputFrame(Frame* frame, bool sent)
+{
+    size_t size = frame->GetSize();
+    if(size > 0)
+        output_budget.Credit(size);
+    if(frame->GetCompletion())
+        frame->GetCompletion()->Complete(sent);
+    frame->Release();
+}
+
+
+bool SocketConnection_Base::EnforceOutputBudget()
+{
+    if(__atomic_load_n(&output_overflowed, __ATOMIC_ACQUIRE))
+        return false;
+
+    if(output_policy == BUDGET_DROP_OLDEST && output_budget.IsOver())
+    {
+        // frames that are partly on the wire, or that the transport holds bytes of, have to be finished
+        size_t committed = send_offset + GetCommittedBytes();
+        size_t oldest = 0;
+        while(committed > 0 && oldest < send_frames.size())
+        {
+            committed -= min(committed, send_frames[oldest]->GetSize());
+            oldest++;
+        }
+
+        while(output_budget.IsOver())
+        {
+            Frame* frame;
+            if(send_frames.size() > oldest)
+            {
+                frame = send_frames[oldest];
+                send_frames.erase(send_frames.begin() + oldest);
+            }
+            else if(committed > 0 || !(frame = NextOutputFrame()))
+                break;  // the frames next in the queue are committed too
+            if(frame->GetSize() > 0)
+                output_budget.CountDrop(frame->GetSize());
+            ReleaseOutputFrame(frame);
+        }
+    }
+    return true;
+}
+
+
+bool SocketConnection_Base::InputBudgetBlocks() const
+{
+    return input_policy == BUDGET_BLOCK && (input_budget.GetLimit() || (input_total && input_total->GetLimit()));
+}
+
+
+bool SocketConnection_Base::InputBlocked() const
+{
+    return input_policy == BUDGET_BLOCK && input_budget.IsOver();
+}
+
+
+void SocketConnection_Base::PacketTaken(const Packet* pkt)
+{
+    if(pkt == NULL)
+        return;
+    SocketConnection_Base* origin = pkt->GetOrigin();
+    if(origin == NULL)
+        return;
+
+    origin->input_budget.Credit(sizeof(origin->header_buffer) + pkt->GetDataLength());
+    if(origin->InputBlocked() == false && __atomic_load_n(&origin->input_deferred, __ATOMIC_ACQUIRE) && origin->event_loop)
+        origin->event_loop->Schedule(origin); // it stopped reading for lack of room
+    if(origin->RemoveReference())
+        Delete(origin);
+}
+
+
+void SocketConnection_Base::StartEvents()
+{
+    DEBUG_REPORT_LOCATION;
+    if(event_loop == NULL)
+        throw("No EventLoop was set before activating the connection.");
+
+    __atomic_store_n(&stopped, false, __ATOMIC_RELEASE);
+    receive_status = IO_WANT_READ;
+    __atomic_store_n(&input_deferred, false, __ATOMIC_RELEASE);
+    send_status = IO_OK;
+    interest = EventLoop::EVENT_READABLE;
+    event_loop->Add(this, GetDescriptor(), interest);
+    event_loop->Schedule(this); // pick up anything written before activation
+}
+
+
+void SocketConnection_Base::StopEvents()
+{
+    DEBUG_REPORT_LOCATION;
+    __atomic_store_n(&stopped, true, __ATOMIC_RELEASE);
+    output_budget.WakeAll(); // writers blocked on the budget give up
+    if(event_loop)
+        event_loop->Remove(this); // after this returns, the loop no longer touches our buffers
+
+    for(size_t i = 0; i < send_frames.size(); i++)
+        ReleaseOutputFrame(send_frames[i]);
+    send_frames.clear();
+    send_offset = 0;
+    BufferPool::Free(payload_buffer);
+    payload_buffer = NULL;
+    header_received = 0;
+    payload_received = 0;
+}
+
+
+void SocketConnection_Base::Disconnect()
+{
+    SocketConnectionOwner* owner = GetOwner();
+    if(owner)
+        owner->DeleteSocketConnection(this);
+    else
+        Deactivate(); // TODO: This is a hack.  Client sockets need to clean up properly.
+}
+
+
+void SocketConnection_Base::HandleEvents(uint32_t events)
+{
+    /*
+        Each direction is attempted only when the event could have unblocked it.
+        For TLS, a read may be waiting on writability (and a write on readability)
+        while the protocol exchanges records of its own.
+    */
+    bool receive = (events & (EventLoop::EVENT_READABLE | EventLoop::EVENT_ERROR))
+        || (receive_status == IO_WANT_WRITE && (events & EventLoop::EVENT_WRITABLE))
+        || ((receive_status == IO_OK || receive_status == IO_DEFERRED) && (events & EventLoop::EVENT_SCHEDULED));
+    bool send = (events & (EventLoop::EVENT_SCHEDULED | EventLoop::EVENT_WRITABLE))
+        || (send_status == IO_WANT_READ && (events & EventLoop::EVENT_READABLE));
+
+    if(events & EventLoop::EVENT_SCHEDULED)
+        ClearWriteSchedule();
+
+    if(!EnforceOutputBudget())
+    {
+        Disconnect();
+        return;
+    }
+
+    /*
+        A connection over its blocking input budget leaves its data in the
+        socket, and looks again shortly, or as soon as the application takes
+        one of its packets.  An error or hangup is still read through, so
+        the loop doesn't spin on it.
+    */
+    if(receive && InputBlocked() && !(events & EventLoop::EVENT_ERROR))
+    {
+        if(receive_status != IO_DEFERRED)
+            input_budget.CountBlocked();
+        receive = false;
+        receive_status = IO_DEFERRED;
+        event_loop->ScheduleAfter(this, input_retry_ns);
+    }
+
+    if(receive)
+    {
+        receive_status = ReceiveFrames();
+        if(receive_status == IO_CLOSED || receive_status == IO_ERROR)
+        {
+            Disconnect();
+            return;
+        }
+    }
+    __atomic_store_n(&input_deferred, receive_status == IO_DEFERRED, __ATOMIC_RELEASE);
+
+    if(send)
+    {
+        send_status = SendFrames();
+        if(send_status == IO_CLOSED || send_status == IO_ERROR)
+        {
+            Disconnect();
+            return;
+        }
+    }
+
+    uint32_t wanted = receive_status == IO_DEFERRED ? 0 : EventLoop::EVENT_READABLE;
+    if(receive_status == IO_WANT_WRITE || send_status == IO_WANT_WRITE)
+        wanted |= EventLoop::EVENT_WRITABLE;
+    if(wanted != interest)
+    {
+        interest = wanted;
+        event_loop->Modify(this, interest);
+    }
+}
+
+
+/*
+    Reads whatever the transport has into the loop's scratch buffer, a large
+    chunk at a time, and frames every packet each chunk completes, so a
+    stream of small packets costs one read per chunk rather than two per
+    packet.  A payload too large for the scratch buffer is read straight
+    into place once its header is in.
+
+    Reads at most max_bytes_per_event before yielding, so that one busy
+    connection can't starve the others that share its EventLoop.  Returns
+    IO_OK when it yielded with more data possibly available, and
+    IO_DEFERRED when it stopped because the input budget is full.
+*/
+SocketConnection_Base::IOStatus SocketConnection_Base::ReceiveFrames()
+{
+    const size_t header_size = sizeof(header_buffer);
+    const size_t max_bytes_per_event = 256 * 1024;
+
+    size_t buffer_size = 0;
+    char* buffer = event_loop->GetScratchBuffer(buffer_size);
+
+    size_t received = 0;
+    while(received < max_bytes_per_event)
+    {
+        if(received > 0 && InputBlocked())
+        {
+            input_budget.CountBlocked();
+            event_loop->ScheduleAfter(this, input_retry_ns);
+            return IO_DEFERRED;
+        }
+
+        size_t transferred = 0;
+        IOStatus status = IO_OK;
+
+        if(header_received == header_size && payload_length - payload_received >= buffer_size)
+        {
+            status = ReceiveBytes(payload_buffer + payload_received, payload_length - payload_received, transferred);
+            if(status != IO_OK)
+                return status;
+            payload_received += transferred;
+            if(payload_received == payload_length)
+                status = FinishFrame();
+        }
+        else
+        {
+            status = ReceiveBytes(buffer, buffer_size, transferred);
+            if(status != IO_OK)
+                return status;
+            status = ConsumeInput(buffer, transferred);
+        }
+        if(status != IO_OK)
+            return status;
+        received += transferred;
+    }
+
+    event_loop->Schedule(this);
+    return IO_OK;
+}
+
+
+SocketConnection_Base::IOStatus SocketConnection_Base::ConsumeInput(const char* data, size_t length)
+{
+    const size_t header_size = sizeof(header_buffer);
+
+    if(sizeof(PacketDataLength) != sizeof(uint32_t))
+        throw("major problem.  PacketDataLength does not equal sizeof(uint32_t), which breaks ntohl");
+
+    while(length > 0)
+    {
+        if(header_received < header_size)
+        {
+            size_t count = header_size - header_received;
+            if(count > length)
+                count = length;
+            memcpy(header_buffer + header_received, data, count);
+            header_received += count;
+            data += count;
+            length -= count;
+            if(header_received < header_size)
+                break;
+
+            memcpy(&payload_length, header_buffer + sizeof(PacketType), sizeof(PacketDataLength)); // the length is bytes 2, 3, 4, and 5.
+            payload_length = ntohl(payload_length);
+            payload_received = 0;
+            if(payload_length > 0)
+                payload_buffer = (char*)BufferPool::Allocate(payload_length);
+        }
+
+        if(payload_received < payload_length)
+        {
+            size_t count = payload_length - payload_received;
+            if(count > length)
+                count = length;
+            memcpy(payload_buffer + payload_received, data, count);
+            payload_received += count;
+            data += count;
+            length -= count;
+            if(payload_received < payload_length)
+                break;
+        }
+
+        IOStatus status = FinishFrame();
+        if(status != IO_OK)
+            return status;
+    }
+    return IO_OK;
+}
+
+
+/*
+    Delivers the frame whose header and payload have been received
+    completely, and resets for the next one.
+*/
+SocketConnection_Base::IOStatus SocketConnection_Base::FinishFrame()
+{
+    PacketType type = header_buffer[0]; // TODO: validate the packet type
+    char* payload = payload_buffer;
+    payload_buffer = NULL;
+    header_received = 0;
+
+    if(type == Packet::ERR_DISCONNECTED)
+    {
+        BufferPool::Free(payload);
+        return IO_CLOSED;
+    }
+
+    if(!AcceptFrame(type))
+    {
+        LOG_ERROR_OUT("Refused a packet of type " << (int)type << ".");
+        BufferPool::Free(payload);
+        return IO_ERROR;
+    }
+
+    if(!DeliverPacket(type, payload_length, payload))
+        return IO_ERROR;
+    return IO_OK;
+}
+
+
+bool SocketConnection_Base::InputFramePending() const
+{
+    return header_received > 0;
+}
+
+
+/*
+    The fence keeps the output queues from being read before the flag is
+    cleared.  It pairs with the sequentially consistent exchange in Write.
+*/
+void SocketConnection_Base::ClearWriteSchedule()
+{
+    __atomic_store_n(&write_scheduled, false, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+
+/*
+    Charges the packet to the input budget and queues it for the owner.
+    Returns false if the budget's policy drops the connection.  A queued
+    packet holds a reference on the connection until the owner takes it
+    (see PacketTaken).
+*/
+bool SocketConnection_Base::DeliverPacket(PacketType type, PacketDataLength data_length, char* data)
+{
+    size_t size = sizeof(header_buffer) + data_length;
+    if(!input_budget.TryCharge(size))
+    {
+        switch(input_policy)
+        {
+        case BUDGET_BLOCK:
+            input_budget.Charge(size); // already read; HandleEvents stops reading until there is room
+            break;
+        case BUDGET_DROP_OLDEST:
+            input_budget.Charge(size);
+            DropOldestInput();
+            if(input_budget.IsOver(false))
+            {
+                input_budget.Credit(size);
+                input_budget.CountDrop(size);
+                BufferPool::Free(data);
+                return true;
+            }
+            break;
+        case BUDGET_DROP_NEWEST:
+            input_budget.CountDrop(size);
+            BufferPool::Free(data);
+            return true;
+        case BUDGET_DISCONNECT:
+            input_budget.CountDisconnect();
+            BufferPool::Free(data);
+            return false;
+        }
+    }
+
+    Packet* new_pkt = NULL;
+    bool handed_off = false;
+    try
+    {
+        new_pkt = NewPacket(this, type, data_length, data, false);
+        if(new_pkt == NULL)
+        {
+            LOG_ERROR_OUT("Failed to instantiate an incoming packet (section 1). ");
+            input_budget.Credit(size);
+            BufferPool::Free(data);
+        }
+        else
+        {
+            AddReference();
+            if(_owner == NULL || !_owner->HandlePacket(new_pkt))
+                input_buffer->Producer(new_pkt);
+            handed_off = true;
+        }
+    }
+    CATCHALL
+    {
+        LOG_ERROR_OUT("Failed to instantiate an incoming packet (section 2).");
+        if(new_pkt && !handed_off)
+        {
+            PacketTaken(new_pkt); // gives back the budget and the reference taken above
+            Delete(new_pkt);
+        }
+    }
+    return true;
+}
+
+
+static bool HasOrigin(Packet* const& pkt)
+{
+    return pkt != NULL && pkt->GetOrigin() != NULL;
+}
+
+
+/*
+    Makes room in the total input budget by discarding the oldest packets
+    in the shared input queue.  Only packets that came from a connection
+    are discarded.  The pass ends at a disconnect notice, or at a worker
+    shard's connect or disconnect event (which have no origin), and leaves
+    it at the head of the queue so it is still handled in order.
+*/
+void SocketConnection_Base::DropOldestInput()
+{
+    Packet* pkt;
+    while(input_total && input_total->IsOver() && input_buffer->TryConsumeIf(pkt, HasOrigin))
+    {
+        pkt->GetOrigin()->input_budget.CountDrop(sizeof(header_buffer) + pkt->GetDataLength());
+        PacketTaken(pkt);
+        Delete(pkt);
+    }
+}
+
+
+/*
+    Writes frames until the output buffer is empty or the transport would
+    block.  Every frame that is waiting goes out in one gathered write, up
+    to IOV_MAX buffers at a time.  Frames stay in send_frames until
+    completely written, and send_offset records how far into the first one
+    a partial write got.  Marker frames resolve once they, and every frame
+    ahead of them, have been written.
+*/
+SocketConnection_Base::IOStatus SocketConnection_Base::SendFrames()
+{
+#if defined(IOV_MAX) && IOV_MAX < 1024
+    const size_t max_segments_per_write = IOV_MAX;
+#else
+    const size_t max_segments_per_write = 1024;
+#endif
+    const size_t max_frames_per_write = max_segments_per_write / Frame::max_segments;
+    iovec vector[max_segments_per_write];
+
+    while(1)
+    {
+        Frame* frame;
+        bool taken = false;
+        while(send_frames.size() < max_frames_per_write && (frame = NextOutputFrame()))
+        {
+            send_frames.push_back(frame);
+            taken = true;
+        }
+
+        // an empty marker with nothing left ahead of it is done, even if the transport is about to block
+        while(!send_frames.empty() && send_frames.front()->GetSize() == 0)
+        {
+            ReleaseOutputFrame(send_frames.front(), true);
+            send_frames.pop_front();
+        }
+        if(send_frames.empty())
+        {
+            if(taken)
+                continue;
+            return IO_OK;
+        }
+
+        int count = 0;
+        for(size_t i = 0; i < send_frames.size(); i++)
+            count += send_frames[i]->Gather(vector + count, i == 0 ? send_offset : 0);
+
+        size_t transferred = 0;
+        IOStatus status = SendVector(vector, count, transferred);
+        if(status != IO_OK)
+            return status;
+
+        LOG_DEBUG_OUT("Successfully wrote: " << dec << transferred << " bytes: ");
+
+        transferred += send_offset;
+        while(!send_frames.empty() && transferred >= send_frames.front()->GetSize())
+        {
+            transferred -= send_frames.front()->GetSize();
+            ReleaseOutputFrame(send_frames.front(), true);
+            send_frames.pop_front();
+        }
+        send_offset = transferred;
+    }
+}
+
+
+SocketConnection_Base::IOStatus SocketConnection_Base::SendVector(const iovec* vector, int count, size_t& transferred)
+{
+    transferred = 0;
+    for(int i = 0; i < count; i++)
+    {
+        size_t sent = 0;
+        IOStatus status = SendBytes((const char*)vector[i].iov_base, vector[i].iov_len, sent);
+        if(status != IO_OK)
+            return transferred > 0 ? IO_OK : status;
+        transferred += sent;
+        if(sent < vector[i].iov_len)
+            break;
+    }
+    return IO_OK;
+}
+
 /*
 ------------------------------------------------------------------------------
 This software is available under 2 licenses -- choose whichever you prefer.
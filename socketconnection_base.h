@@ -2,17 +2,24 @@
 #define _SOCKET_CONNECTION_BASE_H_
 
 #include "packet.h"
+#include "frame.h"
 #include "cl_semaphore.h"
 #include "pcqueue.h"
+#include "pcring.h"
+#include "spscring.h"
+#include "budget.h"
+#include "writecompletion.h"
 #include "socketconnectionowner.h"
+#include "eventloop.h"
 #include <string>
+#include <deque>
 
 using namespace std;
 
-typedef PCQueue<Packet*> PacketPtrSet;
-typedef PCQueue<string*> StringPtrSet;
+typedef PCRing<Packet*> PacketPtrSet;
+typedef PCQueue<Frame*> FramePtrSet;
 
-class SocketConnection_Base
+class SocketConnection_Base : public EventHandler
 {
 public:
     /*
@@ -32,11 +39,45 @@ public:
         outgoing buffer is full.
 
         Returns true if the packet was placed in the output buffer (but not whether it
-        was sent).  If the socket connection is no longer available, returns false.
+        was sent).  If the socket connection is no longer available, or the output
+        budget's policy refused the packet, returns false.  See SetOutputBudget.
     */
     bool Write(const PacketType& type_arg, const PacketDataLength& data_length_arg, const char* data_arg);
     bool Write(const Packet& pkt);
 
+    /*
+        Queues a frame that was built ahead of time, such as one frame shared
+        by many connections.  The connection takes a reference of its own, so
+        the caller still releases theirs.  Returns false, without taking a
+        reference, once the connection has left its EventLoop.
+    */
+    bool Write(Frame* frame);
+
+    /*
+        WriteWithCompletion
+
+        Writes like Write, and also returns a WriteCompletion that resolves
+        once the frame's last byte has been handed to the kernel, or once
+        the frame is discarded instead (the connection went away, or
+        BUDGET_DROP_OLDEST made room).  callback, if not NULL, is called at
+        that moment.  Returns NULL wherever Write would have returned false.
+        The caller releases the completion.
+    */
+    WriteCompletion* WriteWithCompletion(const Packet& pkt, WriteCallback callback = NULL, void* context = NULL);
+    WriteCompletion* WriteWithCompletion(Frame* frame, WriteCallback callback = NULL, void* context = NULL);
+
+    /*
+        Flush
+
+        Blocks until everything this thread has written so far has been
+        handed to the kernel, or until deadline_ns, a time on the
+        MonotonicNanoseconds() clock, passes.  A deadline of 0 waits for as
+        long as it takes.  Returns false on timeout or if the connection
+        went away first.  Must not be called on the connection's EventLoop
+        thread, which is the one that does the sending.
+    */
+    bool Flush(int64_t deadline_ns = 0);
+
     /*
         GetDescriptor
 
@@ -51,22 +92,231 @@ public:
     */
     void SetDescriptor(int arg);
 
+    /*
+        SetEventLoop
+
+        Selects the EventLoop whose thread will service this connection.
+        Must be called before Activate().
+    */
+    void SetEventLoop(EventLoop* loop);
+    EventLoop* GetEventLoop() const;
+
+    /*
+        SetOutputRing
+
+        Gives the connection a wait-free single-producer/single-consumer ring
+        of entries frames, used in front of the output buffer while only one
+        thread ever writes to the connection.  The first time a second thread
+        writes, the connection switches to the output buffer for good.  While
+        the ring is full, the writer spills into the output buffer and returns
+        to the ring once that has drained.  Frames are always sent in the
+        order they were written.  Must be called before Activate().  0, the
+        default, means no ring.
+    */
+    void SetOutputRing(size_t entries);
+
+    /*
+        SetOutputBudget / SetInputBudget
+
+        Limit the bytes this connection may have waiting to be sent, and the
+        bytes of received packets it may have waiting in the input queue
+        for the application to pick up.  total, if not NULL, is a budget
+        shared with other connections that must also have room.  policy says
+        what happens when there is no room; see BudgetPolicy.
+
+        The input queue is shared by every connection of an owner, so input
+        BUDGET_DROP_OLDEST discards the oldest queued packets whichever
+        connection they came from, and only to make room in total.  A
+        connection over its own input budget drops the newest packet
+        instead.  Input BUDGET_BLOCK stops reading from the socket until the
+        application catches up.
+
+        A limit of 0 means unlimited.  Must be called before Activate().
+    */
+    void SetOutputBudget(size_t limit_bytes, BudgetPolicy policy, ByteBudget* total = NULL);
+    void SetInputBudget(size_t limit_bytes, BudgetPolicy policy, ByteBudget* total = NULL);
+    void GetOutputStats(QueueStats& stats) const;
+    void GetInputStats(QueueStats& stats) const;
+
+    /*
+        PacketTaken
+
+        Must be called by the owner for every packet it takes out of the
+        input queue, before handing it to the application.  Returns the
+        packet's bytes to its connection's input budget and drops the
+        reference the queued packet held on the connection, deleting the
+        connection if that was the last one.
+    */
+    static void PacketTaken(const Packet* pkt);
+
     /*
         Activate
 
-        Used to initialize the threads used for reading to and
-        writing from the socket.
+        Used to register the socket with its EventLoop, which then
+        services both reading from and writing to the socket.
     */
     virtual void Activate() = 0;
     virtual void Deactivate() = 0;
     virtual void PrepareServerConnection() = 0;
     virtual void PrepareClientConnection() = 0;
+
+    /*
+        StartClientConnection
+
+        Like PrepareClientConnection, but doesn't wait for a handshake to
+        finish: the EventLoop completes it once the connection is activated.
+        Frames written meanwhile go out after it.
+    */
+    virtual void StartClientConnection() { PrepareClientConnection(); }
+
+    /*
+        StartServerConnection
+
+        Like PrepareServerConnection, but leaves the handshake for the
+        EventLoop to carry out once the connection is activated, so the
+        accepting thread can move on.  The owner's HandshakeFinished is
+        called when it is done.
+    */
+    virtual void StartServerConnection() { PrepareServerConnection(); }
     //void IncrementPacketsOut();
     //bool DecrementPacketsOut();
 
     SocketConnectionOwner* GetOwner() const;
 
+    /*
+        GetInputBuffer
+
+        The queue this connection delivers its received packets into.
+    */
+    PacketPtrSet* GetInputBuffer() const;
+
+    /*
+        AddReference / RemoveReference
+
+        Keep the connection object alive while a thread uses it without
+        holding its owner's connection list locked, such as during a
+        broadcast.  The owner holds the first reference.  RemoveReference
+        returns true when it dropped the last one, in which case the caller
+        must delete the connection with Delete().
+    */
+    void AddReference();
+    bool RemoveReference();
+
+    /*
+        HandleEvents
+
+        Called on the EventLoop thread.  Reads and frames whatever incoming
+        data is available, then writes out as much of the output buffer as
+        the socket will accept without blocking.
+    */
+    virtual void HandleEvents(uint32_t events);
+
 protected:
+    enum IOStatus
+    {
+        IO_OK,
+        IO_WANT_READ,
+        IO_WANT_WRITE,
+        IO_CLOSED,
+        IO_ERROR,
+        IO_DEFERRED
+    };
+
+    /*
+        ReceiveBytes / SendBytes
+
+        Transport hooks used by HandleEvents.  They must never block.  On
+        IO_OK, transferred is set to the number of bytes moved, which is
+        always at least one.  IO_WANT_READ and IO_WANT_WRITE report which
+        kind of readiness the transport is waiting for before the same call
+        can make progress.  A transport that holds data back on purpose
+        returns IO_DEFERRED from a send, and has arranged to be scheduled
+        again when it wants to write it.  (ReceiveFrames uses IO_DEFERRED
+        for a connection that stopped reading because of its input budget.)
+    */
+    virtual IOStatus ReceiveBytes(char* buffer, size_t length, size_t& transferred) = 0;
+    virtual IOStatus SendBytes(const char* buffer, size_t length, size_t& transferred) = 0;
+
+    /*
+        SendVector
+
+        Gathered form of SendBytes, used to write many queued frames at once.
+        transferred may end part way through any of the count buffers.  The
+        default implementation calls SendBytes for each buffer in turn;
+        transports that can gather in one call should override it.
+    */
+    virtual IOStatus SendVector(const iovec* vector, int count, size_t& transferred);
+
+    /*
+        GetCommittedBytes
+
+        Bytes at the start of the next SendVector that the transport has
+        already taken in, without reporting them as transferred (packed
+        into a record, or handed to a write that has to be retried with
+        the same bytes).  EnforceOutputBudget never drops the frames they
+        came from.  The default holds nothing back.
+    */
+    virtual size_t GetCommittedBytes() const { return 0; }
+
+    /*
+        AcceptFrame
+
+        Called with the type of every frame received, before its packet is
+        delivered.  Returning false drops the connection instead.  The
+        default accepts everything.
+    */
+    virtual bool AcceptFrame(PacketType /*type*/) { return true; }
+
+    /*
+        InputFramePending
+
+        True while a frame has been received in part.
+    */
+    bool InputFramePending() const;
+
+    /*
+        ClearWriteSchedule
+
+        Called on the loop thread whenever the EventLoop runs the
+        connection for a Schedule, before it looks at the output queues.
+        The caller always drains the queues after clearing, so a frame
+        written by a Write that still found the flag set is sent by this
+        run.  The next Write schedules the connection again; until then,
+        writers find it already scheduled and leave the EventLoop alone.
+    */
+    void ClearWriteSchedule();
+
+    /*
+        StartEvents / StopEvents
+
+        Register and unregister with the EventLoop.  StopEvents also discards
+        any partially received or partially sent frame, and must be called
+        before the descriptor is closed.
+    */
+    void StartEvents();
+    void StopEvents();
+
+    /*
+        Disconnect
+
+        Hands the connection to its owner for deletion (or deactivates it if
+        it has no owner).  The caller must not touch the connection afterwards.
+    */
+    void Disconnect();
+
+    /*
+        ConsumeInput
+
+        Frames a chunk of incoming bytes, delivering every packet it
+        completes and keeping any partial frame for the next chunk.  Used
+        for the chunks ReceiveFrames reads and for those an io_uring
+        completion delivers.  Returns IO_CLOSED if the peer sent
+        ERR_DISCONNECTED, IO_ERROR if the input budget dropped the
+        connection, otherwise IO_OK.  Must only be called from the
+        EventLoop thread.
+    */
+    IOStatus ConsumeInput(const char* data, size_t length);
+
     /*
     object locking must be private.  The reason for this
     is that external parties should only be manipulating
@@ -76,14 +326,104 @@ protected:
     */
     void Lock();
     void Unlock();
-    StringPtrSet output_buffer;
+    FramePtrSet output_buffer;
     PacketPtrSet* input_buffer;
 
 private:
+    IOStatus ReceiveFrames();
+    IOStatus FinishFrame();
+    IOStatus SendFrames();
+    bool DeliverPacket(PacketType type, PacketDataLength data_length, char* data);
+    void DropOldestInput();
+    bool InputBlocked() const;
+    bool PushOutputRing(Frame* frame);
+
+protected:
+    /*
+        NextOutputFrame
+
+        Takes the next frame to send from the output ring or the output
+        buffer, or returns NULL if there is none right now.  Only one thread
+        may take frames at a time: the EventLoop thread, or whichever thread
+        deactivates the connection once it has left its EventLoop.
+    */
+    Frame* NextOutputFrame();
+
+    /*
+        ReleaseOutputFrame
+
+        Returns a frame taken with NextOutputFrame to the output budget and
+        releases it, once it has been sent or discarded.  A marker frame
+        (see Frame::CreateMarker) resolves its completion with sent instead.
+    */
+    void ReleaseOutputFrame(Frame* frame, bool sent = false);
+
+    /*
+        EnforceOutputBudget
+
+        Applies the parts of the output policy that Write leaves to the
+        EventLoop thread: discards the oldest frames for BUDGET_DROP_OLDEST,
+        other than those already partly sent or committed to the transport.
+        Returns false if the connection has to be dropped as a slow
+        consumer.
+    */
+    bool EnforceOutputBudget();
+
+    /*
+        InputBudgetBlocks
+
+        True if the input budget may stop the connection from reading, which
+        multishot io_uring receives have no way to do.
+    */
+    bool InputBudgetBlocks() const;
+
+private:
+
     int descriptor;
     unsigned int packets_out;
     sem_t mutex;
     SocketConnectionOwner* _owner;
+    EventLoop* event_loop;
+    uint32_t references;
+    bool stopped;               // set by StopEvents, Write refuses new frames
+
+    // state of the frame currently being received
+    char header_buffer[sizeof(PacketType) + sizeof(PacketDataLength)];
+    size_t header_received;
+    char* payload_buffer;
+    PacketDataLength payload_length;
+    size_t payload_received;
+
+    // see SetOutputRing
+    enum OutputState
+    {
+        OUTPUT_RING,                // the writer uses output_ring
+        OUTPUT_OVERFLOW,            // output_ring filled up, the writer spills into output_buffer
+        OUTPUT_SHARED               // more than one thread writes, everything goes through output_buffer
+    };
+    SPSCRing<Frame*>* output_ring;
+    uintptr_t output_ring_writer;   // thread that owns the producer side of output_ring
+    bool output_ring_pushing;
+    uint32_t output_state;
+    size_t output_buffered;         // frames in output_buffer while there is a ring
+    bool write_scheduled;           // a Write scheduled the loop, which hasn't run since
+
+    // see SetOutputBudget / SetInputBudget
+    ByteBudget output_budget;
+    BudgetPolicy output_policy;
+    bool output_overflowed;             // BUDGET_DISCONNECT tripped by Write
+    ByteBudget input_budget;
+    BudgetPolicy input_policy;
+    ByteBudget* input_total;
+
+    // frames taken from the output ring or buffer but not yet completely sent
+    deque<Frame*> send_frames;
+    size_t send_offset;         // bytes of send_frames.front() already sent
+
+    IOStatus receive_status;
+    IOStatus send_status;
+    bool input_deferred;        // receive_status is IO_DEFERRED, for PacketTaken on other threads
+    uint32_t interest;
 
 
     // Disallow these because they represent corruptable communication
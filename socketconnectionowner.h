@@ -1,12 +1,35 @@
 #ifndef _SOCKET_CONNECTION_OWNER_H_
 #define _SOCKET_CONNECTION_OWNER_H_
 
+#include <cstdint>
+
 class SocketConnection_Base;
+class Packet;
 
 class SocketConnectionOwner
 {
 public:
     virtual void DeleteSocketConnection(SocketConnection_Base* sc) = 0;
+
+    /*
+        HandlePacket
+
+        Offered each packet a connection receives, on its EventLoop thread,
+        before it is queued.  Returns true if the owner took the packet, in
+        which case it is not queued.
+    */
+    virtual bool HandlePacket(Packet* /*pkt*/) { return false; }
+
+    /*
+        HandshakeFinished
+
+        Called once for each connection whose handshake was left to its
+        EventLoop by StartServerConnection, when the handshake succeeds or
+        fails (including timing out or the connection being deactivated
+        first).  latency_ns is how long it took.  Called on the EventLoop
+        thread, or on whichever thread deactivated the connection.
+    */
+    virtual void HandshakeFinished(SocketConnection_Base* /*sc*/, bool /*succeeded*/, int64_t /*latency_ns*/) {}
 };
 
 #endif
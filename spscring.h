@@ -0,0 +1,150 @@
+#ifndef _SPSCRING_H_
+#define _SPSCRING_H_
+
+#include <cstddef>
+
+using namespace std;
+
+
+/*
+    SPSCRing
+
+    A bounded, wait-free queue for exactly one producer thread and one
+    consumer thread.  Neither side ever blocks or retries: TryPush fails
+    when the ring is full and TryPop fails when it is empty, leaving the
+    caller to decide what to do.  Each index lives on its own cache line
+    next to the side's private copy of the other index, so the two threads
+    only touch each other's line when the copy runs out.
+*/
+template<class T>
+class SPSCRing
+{
+public:
+    /*
+        SPSCRing
+
+        capacity is rounded up to a power of two.
+    */
+    SPSCRing(size_t capacity);
+    ~SPSCRing();
+
+    /*
+        TryPush / TryPop
+
+        TryPush may only be called by the producer thread and TryPop by the
+        consumer thread.
+    */
+    bool TryPush(const T& entry);
+    bool TryPop(T& entry);
+
+    size_t GetCapacity() const;
+
+private:
+    T* entries;
+    size_t mask;
+
+    alignas(64) size_t head;        // next entry to pop, written by the consumer
+    size_t cached_tail;
+    alignas(64) size_t tail;        // next entry to push, written by the producer
+    size_t cached_head;
+};
+
+template<class T>
+SPSCRing<T>::SPSCRing(size_t capacity)
+{
+    size_t size = 2;
+    while(size < capacity)
+        size <<= 1;
+    entries = new T[size];
+    mask = size - 1;
+    head = 0;
+    cached_tail = 0;
+    tail = 0;
+    cached_head = 0;
+}
+
+template<class T>
+SPSCRing<T>::~SPSCRing()
+{
+    delete [] entries;
+}
+
+template<class T>
+bool SPSCRing<T>::TryPush(const T& entry)
+{
+    size_t position = tail;
+    if(position - cached_head > mask)
+    {
+        cached_head = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+        if(position - cached_head > mask)
+            return false;
+    }
+    entries[position & mask] = entry;
+    __atomic_store_n(&tail, position + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+template<class T>
+bool SPSCRing<T>::TryPop(T& entry)
+{
+    size_t position = head;
+    if(position == cached_tail)
+    {
+        cached_tail = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+        if(position == cached_tail)
+            return false;
+    }
+    entry = entries[position & mask];
+    __atomic_store_n(&head, position + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+template<class T>
+size_t SPSCRing<T>::GetCapacity() const
+{
+    return mask + 1;
+}
+
+#endif // _SPSCRING_H_
+
+/*
+------------------------------------------------------------------------------
+This software is available under 2 licenses -- choose whichever you prefer.
+------------------------------------------------------------------------------
+ALTERNATIVE A - MIT License
+Copyright (c) 2003-2019 Bobby G. Burrough
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to 
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+of the Software, and to permit persons to whom the Software is furnished to do 
+so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+SOFTWARE.
+------------------------------------------------------------------------------
+ALTERNATIVE B - Public Domain (www.unlicense.org)
+This is free and unencumbered software released into the public domain.
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this 
+software, either in source code form or as a compiled binary, for any purpose, 
+commercial or non-commercial, and by any means.
+In jurisdictions that recognize copyright laws, the author or authors of this 
+software dedicate any and all copyright interest in the software to the public 
+domain. We make this dedication for the benefit of the public at large and to 
+the detriment of our heirs and successors. We intend this dedication to be an 
+overt act of relinquishment in perpetuity of all present and future rights to 
+this software under copyright law.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN 
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION 
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+------------------------------------------------------------------------------
+*/
@@ -0,0 +1,212 @@
+#include "ticketkeys.h"
+#include "fdutils.h"
+#include "logger.h"
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+#include <cstring>
+
+using namespace std;
+
+
+TicketKeys::TicketKeys(uint32_t rotation_seconds)
+    : has_previous(false), rotated_at(MonotonicNanoseconds()), rotation_interval((int64_t)rotation_seconds * 1000000000LL)
+{
+    pthread_mutex_init(&mutex, NULL);
+    NewKey(current);
+    memset(&previous, 0, sizeof(previous));
+}
+
+
+TicketKeys::~TicketKeys()
+{
+    OPENSSL_cleanse(&current, sizeof(current));
+    OPENSSL_cleanse(&previous, sizeof(previous));
+    pthread_mutex_destroy(&mutex);
+}
+
+
+void TicketKeys::Attach(SSL_CTX* context)
+{
+    SSL_CTX_set_app_data(context, this);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(context, TicketKeyCallback);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(context, TicketKeyCallback);
+#endif
+}
+
+
+void TicketKeys::Rotate()
+{
+    pthread_mutex_lock(&mutex);
+    previous = current;
+    has_previous = true;
+    NewKey(current);
+    rotated_at = MonotonicNanoseconds();
+    pthread_mutex_unlock(&mutex);
+}
+
+
+void TicketKeys::NewKey(Key& key)
+{
+    if (RAND_bytes((unsigned char*)&key, sizeof(key)) != 1)
+        throw("RAND_bytes() failed to make a ticket key.");
+}
+
+
+/*
+    Rotation happens when a ticket is next sealed or opened, rather than on
+    a timer.  After two idle intervals the previous key is past its time
+    too, so it is dropped rather than kept.  Must be called with mutex held.
+*/
+void TicketKeys::RotateIfDue()
+{
+    if (rotation_interval == 0)
+        return;
+    int64_t now = MonotonicNanoseconds();
+    if (now - rotated_at < rotation_interval)
+        return;
+
+    previous = current;
+    has_previous = now - rotated_at < 2 * rotation_interval;
+    NewKey(current);
+    rotated_at = now;
+}
+
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static bool InitTicketMac(EVP_MAC_CTX* mac, const unsigned char* key, size_t length)
+{
+    OSSL_PARAM params[2];
+    params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char*)"SHA256", 0);
+    params[1] = OSSL_PARAM_construct_end();
+    return EVP_MAC_init(mac, key, length, params) == 1;
+}
+#else
+static bool InitTicketMac(HMAC_CTX* mac, const unsigned char* key, size_t length)
+{
+    return HMAC_Init_ex(mac, key, (int)length, EVP_sha256(), NULL) == 1;
+}
+#endif
+
+
+/*
+    Called by OpenSSL to seal (encrypt is 1) or open a ticket.  Sealing
+    fills in key_name and iv and returns 1.  Opening looks the key up by
+    key_name and returns 1 if it is the current key, 2 if it is the
+    previous one (the client is then sent a ticket under the current key),
+    or 0 if it is unknown, which falls back to a full handshake.  A TLS 1.3
+    client uses each ticket once, and OpenSSL only sends a resumed TLS 1.3
+    connection a new one when asked to renew, so those always get 2.
+*/
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+int TicketKeys::TicketKeyCallback(SSL* ssl, unsigned char* key_name, unsigned char* iv, EVP_CIPHER_CTX* cipher, EVP_MAC_CTX* mac, int encrypt)
+#else
+int TicketKeys::TicketKeyCallback(SSL* ssl, unsigned char* key_name, unsigned char* iv, EVP_CIPHER_CTX* cipher, HMAC_CTX* mac, int encrypt)
+#endif
+{
+    TicketKeys* keys = (TicketKeys*)SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+    if (keys == NULL)
+        return -1;
+
+    Key key;
+    int result;
+    pthread_mutex_lock(&keys->mutex);
+    try
+    {
+        keys->RotateIfDue();
+    }
+    catch (const char* str)
+    {
+        pthread_mutex_unlock(&keys->mutex);
+        LOG_ERROR_OUT(str);
+        return -1;
+    }
+    if (encrypt)
+    {
+        key = keys->current;
+        result = 1;
+    }
+    else if (memcmp(key_name, keys->current.name, sizeof(key.name)) == 0)
+    {
+        key = keys->current;
+        result = SSL_version(ssl) >= TLS1_3_VERSION ? 2 : 1;
+    }
+    else if (keys->has_previous && memcmp(key_name, keys->previous.name, sizeof(key.name)) == 0)
+    {
+        key = keys->previous;
+        result = 2;
+    }
+    else
+    {
+        result = 0;
+    }
+    pthread_mutex_unlock(&keys->mutex);
+    if (result == 0)
+        return 0;
+
+    if (encrypt)
+    {
+        memcpy(key_name, key.name, sizeof(key.name));
+        if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1)
+            result = -1;
+        else if (EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key.cipher_key, iv) != 1)
+            result = -1;
+    }
+    else if (EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key.cipher_key, iv) != 1)
+    {
+        result = -1;
+    }
+    if (result > 0 && !InitTicketMac(mac, key.mac_key, sizeof(key.mac_key)))
+        result = -1;
+
+    OPENSSL_cleanse(&key, sizeof(key));
+    return result;
+}
+
+/*
+------------------------------------------------------------------------------
+This software is available under 2 licenses -- choose whichever you prefer.
+------------------------------------------------------------------------------
+ALTERNATIVE A - MIT License
+Copyright (c) 2003-2019 Bobby G. Burrough
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to 
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+of the Software, and to permit persons to whom the Software is furnished to do 
+so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+SOFTWARE.
+------------------------------------------------------------------------------
+ALTERNATIVE B - Public Domain (www.unlicense.org)
+This is free and unencumbered software released into the public domain.
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this 
+software, either in source code form or as a compiled binary, for any purpose, 
+commercial or non-commercial, and by any means.
+In jurisdictions that recognize copyright laws, the author or authors of this 
+software dedicate any and all copyright interest in the software to the public 
+domain. We make this dedication for the benefit of the public at large and to 
+the detriment of our heirs and successors. We intend this dedication to be an 
+overt act of relinquishment in perpetuity of all present and future rights to 
+this software under copyright law.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN 
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION 
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+------------------------------------------------------------------------------
+*/
@@ -0,0 +1,123 @@
+#ifndef _TICKET_KEYS_H_
+#define _TICKET_KEYS_H_
+
+#include "threadutils.h"
+#include <openssl/ssl.h>
+#include <cstdint>
+
+using namespace std;
+
+
+/*
+    TicketKeys
+
+    The keys a server seals its session tickets with.  A ticket carries the
+    session to the client, so a returning client can resume it without the
+    server having kept anything.  Every rotation interval a new key takes
+    over.  Tickets sealed with the one before are still accepted, and
+    replaced, for one more interval, so a ticket is good for one to two
+    intervals.  Keys only live in memory, so tickets don't survive a
+    restart of the process.
+
+    All members are thread safe.
+*/
+class TicketKeys
+{
+public:
+    /*
+        TicketKeys
+
+        Starts with a fresh random key.  A rotation interval of 0 keeps
+        that key for good.
+    */
+    TicketKeys(uint32_t rotation_seconds);
+    ~TicketKeys();
+
+    /*
+        Attach
+
+        Makes context seal and open its tickets with these keys.  The keys
+        must outlive every connection made from context.
+    */
+    void Attach(SSL_CTX* context);
+
+    /*
+        Rotate
+
+        Starts sealing with a new key now, rather than at the end of the
+        interval.
+    */
+    void Rotate();
+
+private:
+    struct Key
+    {
+        unsigned char name[16];         // tells the key a ticket was sealed with
+        unsigned char cipher_key[32];   // AES-256-CBC
+        unsigned char mac_key[32];      // HMAC-SHA256
+    };
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    static int TicketKeyCallback(SSL* ssl, unsigned char* key_name, unsigned char* iv, EVP_CIPHER_CTX* cipher, EVP_MAC_CTX* mac, int encrypt);
+#else
+    static int TicketKeyCallback(SSL* ssl, unsigned char* key_name, unsigned char* iv, EVP_CIPHER_CTX* cipher, HMAC_CTX* mac, int encrypt);
+#endif
+
+    static void NewKey(Key& key);
+    void RotateIfDue();
+
+    pthread_mutex_t mutex;
+    Key current;
+    Key previous;
+    bool has_previous;
+    int64_t rotated_at;
+    int64_t rotation_interval;      // nanoseconds, 0 never rotates
+
+    // Disallow copying, contexts hold a pointer to these keys
+    TicketKeys(const TicketKeys&);
+    TicketKeys& operator=(const TicketKeys&);
+};
+
+#endif // _TICKET_KEYS_H_
+
+/*
+------------------------------------------------------------------------------
+This software is available under 2 licenses -- choose whichever you prefer.
+------------------------------------------------------------------------------
+ALTERNATIVE A - MIT License
+Copyright (c) 2003-2019 Bobby G. Burrough
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to 
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+of the Software, and to permit persons to whom the Software is furnished to do 
+so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+SOFTWARE.
+------------------------------------------------------------------------------
+ALTERNATIVE B - Public Domain (www.unlicense.org)
+This is free and unencumbered software released into the public domain.
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this 
+software, either in source code form or as a compiled binary, for any purpose, 
+commercial or non-commercial, and by any means.
+In jurisdictions that recognize copyright laws, the author or authors of this 
+software dedicate any and all copyright interest in the software to the public 
+domain. We make this dedication for the benefit of the public at large and to 
+the detriment of our heirs and successors. We intend this dedication to be an 
+overt act of relinquishment in perpetuity of all present and future rights to 
+this software under copyright law.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN 
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION 
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+------------------------------------------------------------------------------
+*/
@@ -9,6 +9,9 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#if defined(__linux__)
+#include <linux/tls.h>
+#endif
 #else
 #include <winsock2.h>
 typedef SSIZE_T ssize_t;
@@ -16,7 +19,10 @@ typedef SSIZE_T ssize_t;
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <cstring>
 #include <iostream>
+#include <map>
+#include <deque>
 
 
 
@@ -25,17 +31,75 @@ using namespace std;
 typedef int(*SSL_func)(SSL*);
 int SSL_op_timeout(SSL_func fun, SSL* sslHandle, int file_descriptor, int timeout_seconds);
 
+
+/*
+    The EventLoop retries an SSL_write that wanted to read or write once the
+    socket is ready, resuming from the unsent part of the frame.  Let
+    SSL_write report progress after each record it completes, and don't
+    insist that the retry passes the same buffer address.
+*/
+static void SetRetryModes(SSL* ssl)
+{
+    SSL_set_mode(ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+}
+
+
+/*
+    OpenSSL 3 treats a peer that closes the socket without close_notify as
+    a fatal error, which also invalidates the session, so the reconnect
+    that follows a dropped connection would need a full handshake.  Take
+    it as a plain close instead.  Packets carry their own length, so a
+    truncated stream is still caught when a packet is cut short.
+*/
+static void SetSessionFriendlyOptions(SSL_CTX* context)
+{
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    SSL_CTX_set_options(context, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+}
+
+/*
+    Negotiates the highest version both sides support, TLS 1.3 where it
+    can and never below TLS 1.2, which saves TLS 1.3 clients a round trip
+    on every handshake.  X25519 is offered for the key exchange first, so
+    a TLS 1.3 client's guess at the server's choice is usually right and
+    no second ClientHello is needed.
+
+    OpenSSL is also asked to hand the record layer to the kernel (kTLS)
+    once the handshake is done.  It only does so where the kernel has TLS
+    support loaded and can handle the negotiated cipher, and otherwise
+    quietly carries on in userspace; see UseKernelTLS.
+*/
+static void SetProtocolOptions(SSL_CTX* context)
+{
+    SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+    SSL_CTX_set1_groups_list(context, "X25519:P-256");
+#if defined(__linux__) && defined(SSL_OP_ENABLE_KTLS)
+    SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS);
+#endif
+}
+
 static pthread_mutex_t _tls_socket_connection_mutex = PTHREAD_MUTEX_INITIALIZER;
 static uint32_t _num_outstanding_tls_socket_connections = 0;
 
-static pthread_mutex_t _server_ssl_context_mutex = PTHREAD_MUTEX_INITIALIZER;
-static uint32_t _server_ssl_context_refcount = 0;
-SSL_CTX* TLSSocketConnection::_server_ssl_context = NULL;
-
 static pthread_mutex_t _client_ssl_context_mutex = PTHREAD_MUTEX_INITIALIZER;
 static uint32_t _client_ssl_context_refcount = 0;
 SSL_CTX* TLSSocketConnection::_client_ssl_context = NULL;
 
+/*
+    The latest sessions with each server, oldest first, by the key given
+    to SetSessionKey.  A TLS 1.2 session may be offered any number of
+    times, so it replaces whatever was kept.  A TLS 1.3 server hands out
+    several tickets, each meant to be offered once (and only good for
+    early data once), so up to max_client_sessions of them are kept and
+    each is taken when offered.  The map lives for the whole process, so
+    it is never destroyed: a static map could be torn down after OpenSSL
+    has cleaned up at exit.
+*/
+static const size_t max_client_sessions = 4;
+static pthread_mutex_t _client_session_mutex = PTHREAD_MUTEX_INITIALIZER;
+static map<string, deque<SSL_SESSION*> >* _client_sessions = NULL;
+
 void TLSSocketConnection::StaticInit()
 {
     pthread_mutex_lock(&_tls_socket_connection_mutex);
@@ -71,8 +135,12 @@ void TLSSocketConnection::StaticDeinit()
 
 
 
-TLSSocketConnection::TLSSocketConnection(SocketConnectionOwner* owner, PCQueue<Packet*>* input_buffer_ptr)
-    : SocketConnection_Base(owner, input_buffer_ptr), active(false), _sslHandle(NULL), _client_vs_server_protect(false), _sslContext(NULL), ssl_handle_mutex(PTHREAD_MUTEX_INITIALIZER)
+TLSSocketConnection::TLSSocketConnection(SocketConnectionOwner* owner, PacketPtrSet* input_buffer_ptr)
+    : SocketConnection_Base(owner, input_buffer_ptr), tls_state(TLS_NEW), active(false), _sslHandle(NULL), _client_vs_server_protect(false), _sslContext(NULL), server_context(NULL),
+      flush_latency(0), flush_pending_since(0), handshake_timeout(10 * 1000000000LL), handshake_started(0),
+      handshake_pending(false), handshake_reported(false), connect_reported(false), handshake_complete(false), session_reused(false),
+      early_state(EARLY_NONE), early_skip(0), early_tail(false), early_data_accepted(false), early_data_types(NULL),
+      kernel_send(false), kernel_receive(false), write_pending(false)
 {
     DEBUG_REPORT_LOCATION;
 
@@ -84,46 +152,33 @@ TLSSocketConnection::~TLSSocketConnection()
 {
     DEBUG_REPORT_LOCATION;
 
-    pthread_mutex_lock(&ssl_handle_mutex);
     if (_sslHandle)
     {
         SSL_free(_sslHandle);
         _sslHandle = NULL;
     }
-    pthread_mutex_unlock(&ssl_handle_mutex);
+
+    if (server_context)
+    {
+        SSL_CTX_free(server_context); // drops the reference SetServerContext took
+        server_context = NULL;
+        _sslContext = NULL;
+    }
 
     if (_sslContext)
     {
-        bool done_cleaning = false;
-        pthread_mutex_lock(&_server_ssl_context_mutex);
-        if (_sslContext == _server_ssl_context)
+        pthread_mutex_lock(&_client_ssl_context_mutex);
+        if (_sslContext == _client_ssl_context)
         {
-            _server_ssl_context_refcount--;
-            if (_server_ssl_context_refcount == 0)
+            _client_ssl_context_refcount--;
+            if (_client_ssl_context_refcount == 0)
             {
-                SSL_CTX_free(_server_ssl_context);
-                _server_ssl_context = NULL;
+                SSL_CTX_free(_client_ssl_context);
+                _client_ssl_context = NULL;
                 _sslContext = NULL;
-                done_cleaning = true;
             }
         }
-        pthread_mutex_unlock(&_server_ssl_context_mutex);
-
-        if (!done_cleaning)
-        {
-            pthread_mutex_lock(&_client_ssl_context_mutex);
-            if (_sslContext == _client_ssl_context)
-            {
-                _client_ssl_context_refcount--;
-                if (_client_ssl_context_refcount == 0)
-                {
-                    SSL_CTX_free(_client_ssl_context);
-                    _client_ssl_context = NULL;
-                    _sslContext = NULL;
-                }
-            }
-            pthread_mutex_unlock(&_client_ssl_context_mutex);
-        }
+        pthread_mutex_unlock(&_client_ssl_context_mutex);
     }
 
     StaticDeinit();
@@ -136,11 +191,16 @@ void TLSSocketConnection::Activate()
     DEBUG_REPORT_LOCATION;
     if(!GetActive())
     {
-        //start the reader/writer threads.
-        //pthread_create(&reader_writer_id, NULL, TLSSocketConnection::ReaderWriter, this);
-        pthread_create(&reader_id, NULL, TLSSocketConnection::Reader, this);
-        pthread_create(&writer_id, NULL, TLSSocketConnection::Writer, this);
-        active = true;
+        try
+        {
+            StartEvents(); // the descriptor was made non-blocking by Prepare*Connection()
+            active = true;
+        }
+        catch (const char*)
+        {
+            Unlock();
+            throw;
+        }
     }
     Unlock();
 }
@@ -159,7 +219,17 @@ void TLSSocketConnection::Activate()
 */
 void TLSSocketConnection::Deactivate()
 {
-    int rv = 0;
+    /*
+        Leave the EventLoop before taking the lock.  If the loop thread is
+        concurrently deactivating us (peer hung up), it needs the lock to
+        finish, and StopEvents() waits for it to finish.
+    */
+    StopEvents();
+    record_buffer.clear(); // its frames were just discarded
+    flush_pending_since = 0;
+    if (handshake_pending)
+        FinishHandshake(false);
+
     Lock();
     DEBUG_REPORT_LOCATION;
     do
@@ -167,40 +237,8 @@ void TLSSocketConnection::Deactivate()
         if(!active)
             break;
 
-        //close threads
-        if (!pthread_equal(pthread_self(), reader_id))
-        {
-            LOG_DEBUG_OUT("cancelling Reader thread.");
-            rv = pthread_cancel(reader_id);
-            pthread_join(reader_id, NULL);
-            LOG_DEBUG_OUT("cancelled Reader thread.");
-        }
-        else
-        {
-            LOG_DEBUG_OUT("Reader thread refused to cancel itself.");
-            pthread_detach(reader_id);
-        }
-
-
-        if (!pthread_equal(pthread_self(), writer_id))
-        {
-            LOG_DEBUG_OUT("cancelling Writer thread.");
-            rv = pthread_cancel(writer_id);
-            pthread_join(writer_id, NULL);
-            LOG_DEBUG_OUT("cancelled Writer thread.");
-        }
-        else
-        {
-            LOG_DEBUG_OUT("Writer thread refused to cancel itself.");
-            pthread_detach(writer_id);
-        }
+        SendCloseNotify();
 
-        /*if (SSL_op_timeout(SSL_shutdown, _sslHandle, GetDescriptor(), 10) <= 0)
-        {
-            DEBUG_OUT("Shutdown failed.");
-        }
-        */
-        
 #if !(defined(WIN32) || defined(__WIN32) || defined(__WIN32__) || defined(FORCE_WIN32))
         close(GetDescriptor());
 #else
@@ -210,12 +248,14 @@ void TLSSocketConnection::Deactivate()
         /*
             Clear the output buffer. This assumes we don't want
             to store data that was intended for a particular client,
-            then send it after it reconnects.
+            then send it after it reconnects.  Taking the frames frees
+            up the space, so a writer blocked on a full buffer gets to
+            finish.
         */
-        string* temp;
-        while((temp = output_buffer.pop_front()))
+        Frame* temp;
+        while((temp = NextOutputFrame()))
         {
-            delete temp;
+            ReleaseOutputFrame(temp);
             DEBUG_REPORT_LOCATION;
         }
 
@@ -248,815 +288,787 @@ SSL* TLSSocketConnection::GetSSLHandle() const
     return _sslHandle;
 }
 
-#if 0
+SocketConnection_Base::IOStatus TLSSocketConnection::TranslateError(int ret, const char* operation)
+{
+    int err = SSL_get_error(_sslHandle, ret);
+    switch (err)
+    {
+    case SSL_ERROR_WANT_READ:
+        return IO_WANT_READ;
+    case SSL_ERROR_WANT_WRITE:
+        return IO_WANT_WRITE;
+    case SSL_ERROR_ZERO_RETURN:
+        LOG_DEBUG_OUT("Disconnected.");   // the peer sent close_notify or, see SetSessionFriendlyOptions, just closed
+        return IO_CLOSED;
+    default:
+        tls_state = TLS_FAILED;
+        if (ret == 0)
+        {
+            LOG_DEBUG_OUT("Disconnected without close_notify.");
+            return IO_CLOSED;
+        }
+        LOG_ERROR_OUT(operation << " failed.  ssl_err: " << err << " " << ERR_error_string(ERR_get_error(), NULL));
+        return IO_ERROR;
+    }
+}
+
+
 /*
-    OpenSSL is a beast, ain't it?  I can't believe the human race has
-    deferred the securing of its data to this monstrosity.  Our implementation
-    of non-encrypted data transmission was clean.  There were no busy-waits
-    or polling going on.  However, because OpenSSL insists on us doing
-    non-blocking IO (no thread safety guarantees for SSL descriptor, AND
-    we're not allowed to call select on the underlying file descriptor),
-    we have to poll both the socket for incoming data, and our outgoing
-    data buffer.
-
-    For that reason, the ReaderWriter thread is implemented as a state
-    machine that ping-pongs between reading mode and writing mode.  This
-    is to give balanced service to both incoming and outgoing data -- to
-    prevent, for example, a large block of incoming data from preventing
-    us writing a block of outgoing data.
-
-    Within the read block, there are two read modes.  The two read modes
-    represent reading of the packet header and the packet payload.  This
-    is required because packet headers are constant size, whereas payloads
-    are not.  Therefore, we have to use different locally scoped data
-    to track the process of reading such data (i.e. constant size data can
-    be statically allocated, whereas variable size data must be dynamically
-    allocated).
-
-    TODO: This can be simplified by consolidating the bimodal reads into
-    the dynamic-allocation-based reads.  That is, if packet type and length
-    aren't set, then dynamically allocate a buffer the size of the packet
-    header, read that header, set the type and length, then read the entire
-    payload.  It's necessarily a two-step process, but not necessarilly
-    static vs dynamic.
-
-    For robustness, both partial reads and partial writes are supported.
+    Takes a handshake begun by Start*Connection as far as the socket
+    allows.  It is driven separately rather than left to SSL_read, so that
+    it counts as done the moment it is, even if the peer hangs up right
+    after.  The caller reports the handshake finished once it is done
+    with the SSL handle.
 */
-void* TLSSocketConnection::ReaderWriter(void* void_arg)
+SocketConnection_Base::IOStatus TLSSocketConnection::ContinueHandshake(bool& finished)
 {
-    if(sizeof(PacketDataLength) != sizeof(uint32_t))
-        throw("major problem.  PacketDataLength does not equal sizeof(uint32_t), which breaks ntohl");
-
-    enum
+    if (early_state == EARLY_WRITING)
     {
-        READ,
-        WRITE
-    };
+        int ret = WriteEarlyData(_sslHandle);
+        if (ret != 1)
+            return TranslateError(ret, "SSL_write_early_data()");
+    }
 
-    enum
-    {
-        READ_MODE_HEADER,
-        READ_MODE_PAYLOAD
-    };
-
-    const unsigned int cbuf_size = sizeof(PacketType) + sizeof(PacketDataLength); //size of the type and length fields of a packet (i.e. this is used to store the header of the incoming packet)
-    char buf[cbuf_size] = { 0 };
-    TLSSocketConnection* sc_arg = (TLSSocketConnection*)void_arg;
-    SSL* ssl = sc_arg->GetSSLHandle();
-    ssize_t read_length = 0;
-    int read_accum_count = 0;
-    int write_accum_count = 0;
-    uint8_t next_op = READ;
-    uint8_t read_mode = READ_MODE_HEADER;
-    bool stay_alive = true;
-    string* temp = NULL;
-    char* packetDataBuffer = NULL;
-    char* seek_position = NULL;
-    bool read_starved = false;
-    bool write_starved = false;
+    int ret = SSL_do_handshake(_sslHandle);
+    if (ret != 1)
+        return TranslateError(ret, "SSL_do_handshake()");
+    session_reused = SSL_session_reused(_sslHandle) != 0;
+    KeepResumedSession();
+    ResolveEarlyData();
+    UseKernelTLS();
+    finished = true;
+    return IO_OK;
+}
 
-    DEBUG_REPORT_LOCATION;
 
-    /*
-        PTHREAD_CANCEL_DEFERRED will ensure that the threads
-        are killed only when they're blocked.  This is much
-        safer than just killing the threads at random.
-    */
-    pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
+/*
+    Carries a pending handshake forward on its own, for a caller that
+    needs it done before it can tell what to write.
+*/
+SocketConnection_Base::IOStatus TLSSocketConnection::AdvanceHandshake()
+{
+    ERR_clear_error(); // SSL_get_error() requires an empty error queue
+    bool finished = false;
+    IOStatus status = ContinueHandshake(finished);
+    if (finished)
+        FinishHandshake(true);
+    return status;
+}
+
 
-    while (stay_alive)
+/*
+    Reads early data for as long as the client may still be sending it.
+    accepted is set when the first of it is, so the owner can hear of the
+    connection before any packet it carries.  The handshake stays pending,
+    and its timeout armed, until the client's Finished arrives.  Once the
+    client has ended its early data, or had none to send, this returns
+    IO_OK without reading anything, and the handshake carries on as usual.
+*/
+SocketConnection_Base::IOStatus TLSSocketConnection::ReadEarlyData(char* buffer, size_t length, size_t& transferred, bool& accepted)
+{
+    size_t n = 0;
+    switch (SSL_read_early_data(_sslHandle, buffer, length, &n))
     {
-        switch (next_op)
+    case SSL_READ_EARLY_DATA_SUCCESS:
+        if (!early_data_accepted)
         {
-            case READ:
-            {
-                if (read_mode == READ_MODE_HEADER)
-                {
-                    read_starved = false;
-                    int n = SSL_read(ssl, buf + read_accum_count, cbuf_size - read_accum_count);
-                    if (n < 0)
-                    {
-                        int err = SSL_get_error(ssl, n);
-                        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
-                        {
-                            read_starved = true;
-                        }
-                        else
-                        {
-                            LOG_ERROR_OUT("Error: " << ERR_error_string(err, NULL));
-                            stay_alive = false;
-                            break;
-                        }
-                    }
-                    else if (n == 0)
-                    {
-                        // disconnected
-                        LOG_DEBUG_OUT("Disconnected.");
-                        stay_alive = false;
-                        break;
-                    }
-                    else
-                    {
-                        read_accum_count += n;
-                        if (read_accum_count >= cbuf_size)
-                        {
-                            read_mode = READ_MODE_PAYLOAD;
-                        }
-                    }
-                }
-                if (read_mode == READ_MODE_PAYLOAD)
-                {
-                    PacketType type = buf[0]; // TODO: validate the packet type  // the type is the first byte of the header
-                    PacketDataLength data_length = 0;
-#if 1
-                    char* bytePtr = (char*)&data_length;                        
-                    for (int i = 0; i < sizeof(PacketDataLength); i++)
-                        bytePtr[i] = buf[i + 1];                                // the length is bytes 2, 3, 4, and 5.
-                    data_length = ntohl(data_length);
-#else
-                    memcpy(&data_length, buf + 1, sizeof(PacketDataLength));
-#endif
-                    if (data_length > 0)
-                    {
-                        if (packetDataBuffer == NULL) // if we're reading brand new data
-                        {
-                            packetDataBuffer = new char[data_length]; // then allocate a new buffer
-                            seek_position = packetDataBuffer;
-                        }
-                        if (packetDataBuffer == NULL) // if allocation failed
-                        {
-                            // colossal error
-                            LOG_ERROR_OUT("Failed to allocated packetDataBuffer.");
-                            stay_alive = false;
-                            break;
-                        }
-                        read_starved = false;
-                        ssize_t data_read_length = 0;
-                        data_read_length = SSL_read(ssl, seek_position, data_length - (seek_position - packetDataBuffer));
-                        if (data_read_length < 0)
-                        {
-                            int err = SSL_get_error(ssl, data_read_length);
-                            if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
-                            {
-                                read_starved = true;
-                            }
-                            else
-                            {
-                                LOG_ERROR_OUT("Error: " << ERR_error_string(err, NULL));
-                                delete[] packetDataBuffer;
-                                packetDataBuffer = NULL;
-                                seek_position = NULL;
-                                stay_alive = false;
-                                break;
-                            }
-                        }
-                        else if (data_read_length == 0)
-                        {
-                            // disconnected
-                            LOG_DEBUG_OUT("Disconnected.");
-                            delete[] packetDataBuffer;
-                            packetDataBuffer = NULL;
-                            seek_position = NULL;
-                            stay_alive = false;
-                            break;
-                        }
-                        else
-                        {
-                            seek_position += data_read_length;
-                        }
-                    }
-
-                    if (data_length == 0 || (size_t)(seek_position - packetDataBuffer) >= data_length)
-                    {
-                        if (type == Packet::ERR_DISCONNECTED)
-                        {
-                            // disconnected
-                            LOG_DEBUG_OUT("Disconnected.");
-                            delete[] packetDataBuffer;
-                            packetDataBuffer = NULL;
-                            seek_position = NULL;
-                            stay_alive = false;
-                            break;
-                        }
-
-                        try
-                        {
-                            Packet* new_pkt = NewPacket((SocketConnection_Base*)sc_arg, type, (PacketDataLength)(seek_position - packetDataBuffer), packetDataBuffer, false);
-                            if (new_pkt == NULL)
-                            {
-                                /*
-                                    The below deallocation is not necessary because if NewPacket fails, then ~Packet will be called which deallocs
-                                    packetDataBuffer.  See C++ spec 15.2.1.
-                                */
-                                //if (packetDataBuffer)
-                                //    delete[] packetDataBuffer;
-                                LOG_ERROR_OUT("Failed to instantiate an incoming packet (section 1). ");
-                            }
-                            else
-                            {
-                                sc_arg->input_buffer->Producer(new_pkt); // if so, create a packet and stick it in the input_buffer
-                            }
-                        }
-                        CATCHALL
-                        {
-                            LOG_ERROR_OUT("Failed to instantiate an incoming packet (section 2).");
-                        }
-                        // packetDataBuffer is now owned by the newly created packet, so don't delete it.
-                        packetDataBuffer = NULL;
-                        seek_position = NULL;
-                        read_accum_count = 0;
-                        read_mode = READ_MODE_HEADER;
-                    }
-                } // READ_MODE_PAYLOAD
-                next_op = WRITE;
-                break;
-            } // case READ
+            early_data_accepted = true;
+            session_reused = SSL_session_reused(_sslHandle) != 0;
+            accepted = true;
+        }
+        transferred = n;
+        return IO_OK;
+    case SSL_READ_EARLY_DATA_FINISH:
+        early_state = EARLY_NONE;
+        early_tail = InputFramePending(); // its remainder follows the early data
+        return IO_OK;
+    default:
+        return TranslateError(-1, "SSL_read_early_data()");
+    }
+}
 
 
-            case WRITE:
+/*
+    Makes a single non-blocking attempt to send close_notify, so the peer
+    can tell a clean close from a truncated stream.  It is not worth holding
+    up the caller until the socket becomes writable.  Must be called with
+    the connection out of its EventLoop.
+
+    Nothing is sent once the peer has closed its side or the connection has
+    failed, since writing to a socket the peer is done with can raise
+    SIGPIPE.  The shutdown is recorded as done instead: OpenSSL invalidates
+    the session of a connection freed without one, and the reconnect that
+    follows a dropped connection should be able to resume it.  A fatal
+    alert has already invalidated the session by then, so that case is
+    unaffected.
+*/
+void TLSSocketConnection::SendCloseNotify()
+{
+    if (_sslHandle && SSL_is_init_finished(_sslHandle))
+    {
+        if (tls_state == TLS_OPEN && !(SSL_get_shutdown(_sslHandle) & SSL_RECEIVED_SHUTDOWN))
+        {
+            ERR_clear_error();
+            if (SSL_shutdown(_sslHandle) < 0)
             {
-                // WRITE
-                write_starved = false;
-                if (temp == NULL)
-                    temp = sc_arg->output_buffer.TryConsumer();
-
-                if (temp == NULL)
-                {
-                    write_starved = true;
-                }
-                else
-                {
-                    int n = SSL_write(ssl, temp->c_str() + write_accum_count, temp->size() - write_accum_count);
-                    if (n < 0)
-                    {
-                        int err = SSL_get_error(ssl, n);
-                        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
-                        {
-                            write_starved = true;
-                        }
-                        else
-                        {
-                            LOG_ERROR_OUT("Error: " << ERR_error_string(err, NULL));
-                            stay_alive = false;
-                            break;
-                        }
-                    }
-                    else if (n == 0)
-                    {
-                        // disconnected
-                        LOG_DEBUG_OUT("Disconnected.");
-                        stay_alive = false;
-                        break;
-                    }
-                    else
-                    {
-                        write_accum_count += n;
-                        if (write_accum_count >= temp->size())
-                        {
-                            delete temp;
-                            temp = NULL;
-                            write_accum_count = 0;
-                        }
-                        /*
-                        else
-                        {
-                            // Continue writing because we're not done yet.  But, do it in a way that allows SSL_read to execute also.
-                        }
-                        */
-                    }
-                }
-                next_op = READ;
-                break;
-            } // case WRITE
-        } // end of switch
-
-        if(!stay_alive)
-            break;
+                LOG_DEBUG_OUT("close_notify could not be sent.");
+            }
+        }
+        else if (tls_state != TLS_CLOSED)
+        {
+            SSL_set_shutdown(_sslHandle, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+        }
+    }
+    tls_state = TLS_CLOSED;
+}
 
-        pthread_testcancel(); // TODO: Wait. Won't this leak memory if we were in the middle of reading a packet above?
-                                    // Yes, it will.  See pthread_cleanup_push().
 
-        if (read_starved && write_starved)
+SocketConnection_Base::IOStatus TLSSocketConnection::ReceiveBytes(char* buffer, size_t length, size_t& transferred)
+{
+    if (kernel_receive)
+        return ReceiveRecord(buffer, length, transferred);
+
+    ERR_clear_error(); // SSL_get_error() requires an empty error queue
+    bool accepted = false;
+    bool finished = false;
+    IOStatus status = IO_OK;
+    if (early_state == EARLY_READING)
+        status = ReadEarlyData(buffer, length, transferred, accepted);
+    if (accepted)
+        ReportHandshake(true);
+    if (status == IO_OK && early_state != EARLY_READING)
+    {
+        if (handshake_pending)
+            status = ContinueHandshake(finished);
+        if (status == IO_OK)
         {
-#if !(defined(WIN32) || defined(__WIN32) || defined(__WIN32__) || defined(FORCE_WIN32))
-            usleep(25000);
-#elif 1
-            Sleep(25);
-#else
-            WaitUntilReadableOrWritable(sc_arg->GetDescriptor()); /* This is wrong. Regarding writes, the question isn't whether
-                                                                     the underlying socket is writable. It's whether there's data
-                                                                     in the output_buffer that's available to be written. 
-                                                                     
-                                                                     What we really want is wait until data arrives for reading
-                                                                     in the socket, or until data arrives in the output_buffer
-                                                                     for writing. 
-                                                                     
-                                                                     In consideration of converting this all to blocking IO, the 
-                                                                     write side is ready for that. We can change TryConsumer() to
-                                                                     Consumer() and it will be blocking.  For the read side, we
-                                                                     have to not set the FD to non-blocking.
-                                                                     
-                                                                     Actually, I am not at all confident that it's okay to call
-                                                                     SSL_write and SSL_read on the same SSL context from multiple
-                                                                     threads. So, conversion to blocking isn't the only consideration.
-
-
-                                                                     ----
-
-                                                                     WaitUntil( readable || (temp == null && output_buffer->TryConsumer() || temp != null && writable );
-                                                                     
-                                                                     */
-#endif
+            int n = SSL_read(_sslHandle, buffer, (int)length);
+            if (n > 0)
+                transferred = n;
+            else
+                status = TranslateError(n, "SSL_read()");
         }
+    }
+    if (finished)
+        FinishHandshake(true);
+    return status;
+}
 
-    } // end of while
 
-    SocketConnectionOwner* owner = sc_arg->GetOwner();
-    if(owner)
-        owner->DeleteSocketConnection((SocketConnection_Base*)sc_arg);
+SocketConnection_Base::IOStatus TLSSocketConnection::SendBytes(const char* buffer, size_t length, size_t& transferred)
+{
+    ERR_clear_error(); // SSL_get_error() requires an empty error queue
+    bool finished = false;
+    IOStatus status = IO_OK;
+    if (early_state == EARLY_READING)
+    {
+        // answers to early data go out before the handshake completes, but only once there is some
+        if (!early_data_accepted)
+        {
+            status = IO_WANT_READ;
+        }
+        else
+        {
+            size_t n = 0;
+            int ret = SSL_write_early_data(_sslHandle, buffer, length, &n);
+            if (ret == 1)
+                transferred = n;
+            else
+                status = TranslateError(ret, "SSL_write_early_data()");
+        }
+    }
     else
-        sc_arg->Deactivate(); // TODO: This is a hack.  Client sockets need to clean up properly.
-    pthread_exit((void*)1);
-    return NULL;
+    {
+        if (handshake_pending)
+            status = ContinueHandshake(finished);
+        if (status == IO_OK)
+        {
+            int n = SSL_write(_sslHandle, buffer, (int)length);
+            if (n > 0)
+                transferred = n;
+            else
+                status = TranslateError(n, "SSL_write()");
+        }
+    }
+    write_pending = status == IO_WANT_READ || status == IO_WANT_WRITE;
+    if (finished)
+        FinishHandshake(true);
+    return status;
 }
-#endif
 
 
-void* TLSSocketConnection::Reader(void* void_arg)
-{
-    if (sizeof(PacketDataLength) != sizeof(uint32_t)) // TODO: Change to compile-time assert / static assert.
-        throw("major problem.  PacketDataLength does not equal sizeof(uint32_t), which breaks ntohl");
 
-    //enum
-    //{
-    //    READ,
-    //    WRITE
-    //};
+/*
+    Packs the queued frames into as few TLS records as possible, each of
+    which costs a MAC, padding and usually a syscall of its own.  Frames are
+    copied into record_buffer until it holds a full record's worth of
+    plaintext, then written with one SSL_write.  A frame that alone fills a
+    record is written in place instead, and SSL_write splits it.
+
+    record_buffer may still hold bytes when this returns (a short record
+    held back for the flush latency, or a write that wanted to retry).
+    Those bytes are always the first ones of the vector passed in next
+    time, since they have not been reported as transferred, so the retry
+    hands SSL_write the same plaintext again.
+
+    A client that offered early data finishes the handshake before
+    writing anything else, to learn whether the server took it.  If it
+    did, the frames it was made from are passed over rather than sent
+    twice.
+
+    Once the kernel seals the records (see UseKernelTLS) the frames are
+    written straight to the socket instead, and it packs them into
+    records itself.  Whatever was already handed to SSL_write is finished
+    through SSL_write first.
+*/
+SocketConnection_Base::IOStatus TLSSocketConnection::SendVector(const iovec* vector, int count, size_t& transferred)
+{
+    const size_t max_record_size = SSL3_RT_MAX_PLAIN_LENGTH;
+    transferred = 0;
 
-    enum
+    if (early_state == EARLY_WRITING || early_state == EARLY_SENT)
     {
-        READ_MODE_HEADER,
-        READ_MODE_PAYLOAD
-    };
-
-    const unsigned int cbuf_size = sizeof(PacketType) + sizeof(PacketDataLength); //size of the type and length fields of a packet (i.e. this is used to store the header of the incoming packet)
-    char buf[cbuf_size] = { 0 };
-    TLSSocketConnection* sc_arg = (TLSSocketConnection*)void_arg;
-    pthread_mutex_lock(&(sc_arg->ssl_handle_mutex));
-    SSL* ssl = sc_arg->GetSSLHandle();
-    pthread_mutex_unlock(&(sc_arg->ssl_handle_mutex));
-    ssize_t read_length = 0;
-    int read_accum_count = 0;
-    uint8_t read_mode = READ_MODE_HEADER;
-    bool stay_alive = true;
-    string* temp = NULL;
-    char* packetDataBuffer = NULL;
-    char* seek_position = NULL;
-    bool read_starved = false;
-
-    DEBUG_REPORT_LOCATION;
+        IOStatus status = AdvanceHandshake();
+        if (status != IO_OK)
+            return status;
+    }
+    if (early_skip > 0)
+    {
+        for (int i = 0; i < count && transferred < early_skip; i++)
+            transferred += vector[i].iov_len;
+        if (transferred > early_skip)
+            transferred = early_skip;
+        early_skip -= transferred;
+        return IO_OK;
+    }
+    if (kernel_send && record_buffer.empty() && !write_pending)
+        return SendRecords(vector, count, transferred);
 
-    /*
-        PTHREAD_CANCEL_DEFERRED will ensure that the threads
-        are killed only when they're blocked.  This is much
-        safer than just killing the threads at random.
-    */
-    pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
+    // skip past the bytes that are already packed
+    int index = 0;
+    size_t offset = record_buffer.size();
+    while (index < count && offset >= vector[index].iov_len)
+    {
+        offset -= vector[index].iov_len;
+        index++;
+    }
 
-    while (stay_alive)
+    while (1)
     {
-        int err;
-        if (read_mode == READ_MODE_HEADER)
+        const char* data;
+        size_t length;
+        bool packed = true;
+        if (record_buffer.empty() && index < count && vector[index].iov_len - offset >= max_record_size)
         {
-            read_starved = false;
-            pthread_mutex_lock(&(sc_arg->ssl_handle_mutex));
-            int n = SSL_read(ssl, buf + read_accum_count, cbuf_size - read_accum_count);
-            if (n < 0)
+            data = (const char*)vector[index].iov_base + offset;
+            length = vector[index].iov_len - offset;
+            packed = false;
+        }
+        else
+        {
+            while (index < count && record_buffer.size() < max_record_size)
             {
-                err = SSL_get_error(ssl, n);
-                pthread_mutex_unlock(&(sc_arg->ssl_handle_mutex));
-
-                if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+                size_t n = vector[index].iov_len - offset;
+                if (n > max_record_size - record_buffer.size())
+                    n = max_record_size - record_buffer.size();
+                record_buffer.append((const char*)vector[index].iov_base + offset, n);
+                offset += n;
+                if (offset == vector[index].iov_len)
                 {
-                    read_starved = true;
-                }
-                else
-                {
-                    LOG_ERROR_OUT("Error: " << ERR_error_string(err, NULL));
-                    stay_alive = false;
-                    break;
+                    index++;
+                    offset = 0;
                 }
             }
-            else if (n == 0)
-            {
-                pthread_mutex_unlock(&(sc_arg->ssl_handle_mutex));
+            if (record_buffer.empty())
+                return IO_OK;
 
-                // disconnected
-                LOG_DEBUG_OUT("Disconnected.");
-                stay_alive = false;
-                break;
-            }
-            else
+            if (record_buffer.size() < max_record_size && flush_latency > 0)
             {
-                pthread_mutex_unlock(&(sc_arg->ssl_handle_mutex));
-
-                read_accum_count += n;
-                if (read_accum_count >= cbuf_size)
+                int64_t now = MonotonicNanoseconds();
+                if (flush_pending_since == 0)
+                    flush_pending_since = now;
+                if (now - flush_pending_since < flush_latency)
                 {
-                    read_mode = READ_MODE_PAYLOAD;
+                    GetEventLoop()->ScheduleAfter(this, flush_pending_since + flush_latency - now);
+                    return transferred > 0 ? IO_OK : IO_DEFERRED;
                 }
             }
+            data = record_buffer.data();
+            length = record_buffer.size();
+        }
 
+        size_t sent = 0;
+        IOStatus status = SendBytes(data, length, sent);
+        if (status != IO_OK)
+            return transferred > 0 ? IO_OK : status;
+        transferred += sent;
+
+        if (packed)
+        {
+            record_buffer.erase(0, sent);
         }
-        if (read_mode == READ_MODE_PAYLOAD)
+        else
         {
-            PacketType type = buf[0]; // TODO: validate the packet type  // the type is the first byte of the header
-            PacketDataLength data_length = 0;
-#if 1
-            char* bytePtr = (char*)&data_length;
-            for (int i = 0; i < sizeof(PacketDataLength); i++)
-                bytePtr[i] = buf[i + 1];                                // the length is bytes 2, 3, 4, and 5.
-            data_length = ntohl(data_length);
-#else
-            memcpy(&data_length, buf + 1, sizeof(PacketDataLength));
-#endif
-            if (data_length > 0)
+            offset += sent;
+            if (offset == vector[index].iov_len)
             {
-                if (packetDataBuffer == NULL) // if we're reading brand new data
-                {
-                    packetDataBuffer = new char[data_length]; // then allocate a new buffer
-                    seek_position = packetDataBuffer;
-                }
-                if (packetDataBuffer == NULL) // if allocation failed
-                {
-                    // colossal error
-                    LOG_ERROR_OUT("Failed to allocated packetDataBuffer.");
-                    stay_alive = false;
-                    break;
-                }
-                read_starved = false;
-                pthread_mutex_lock(&(sc_arg->ssl_handle_mutex));
+                index++;
+                offset = 0;
+            }
+        }
 
-                ssize_t data_read_length = 0;
-                data_read_length = SSL_read(ssl, seek_position, data_length - (seek_position - packetDataBuffer));
-                if (data_read_length < 0)
-                {
-                    err = SSL_get_error(ssl, data_read_length);
-                    pthread_mutex_unlock(&(sc_arg->ssl_handle_mutex));
-                    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
-                    {
-                        read_starved = true;
-                    }
-                    else
-                    {
-                        LOG_ERROR_OUT("Error: " << ERR_error_string(err, NULL));
-                        delete[] packetDataBuffer;
-                        packetDataBuffer = NULL;
-                        seek_position = NULL;
-                        stay_alive = false;
-                        break;
-                    }
-                }
-                else if (data_read_length == 0)
-                {
-                    pthread_mutex_unlock(&(sc_arg->ssl_handle_mutex));
-
-                    // disconnected
-                    LOG_DEBUG_OUT("Disconnected.");
-                    delete[] packetDataBuffer;
-                    packetDataBuffer = NULL;
-                    seek_position = NULL;
-                    stay_alive = false;
-                    break;
-                }
-                else
-                {
-                    pthread_mutex_unlock(&(sc_arg->ssl_handle_mutex));
+        if (record_buffer.empty() && index == count)
+        {
+            flush_pending_since = 0;
+            return IO_OK;
+        }
+    }
+}
 
-                    seek_position += data_read_length;
-                }
 
-            }
+/*
+    The bytes packed in record_buffer, and the frames a client made its
+    early data from, are committed until SendVector reports them.  An
+    SSL_write of a frame in place that wants to be retried only ever
+    covers the first frame of the next vector.
+*/
+size_t TLSSocketConnection::GetCommittedBytes() const
+{
+    size_t committed = record_buffer.size() + early_skip;
+    if (early_state == EARLY_WRITING || early_state == EARLY_SENT)
+        committed = record_buffer.size() + early_data.size();
+    if (committed == 0 && write_pending)
+        committed = 1;
+    return committed;
+}
 
-            if (data_length == 0 || (size_t)(seek_position - packetDataBuffer) >= data_length)
-            {
-                if (type == Packet::ERR_DISCONNECTED)
-                {
-                    // disconnected
-                    LOG_DEBUG_OUT("Disconnected.");
-                    delete[] packetDataBuffer;
-                    packetDataBuffer = NULL;
-                    seek_position = NULL;
-                    stay_alive = false;
-                    break;
-                }
 
-                try
-                {
-                    Packet* new_pkt = NewPacket((SocketConnection_Base*)sc_arg, type, (PacketDataLength)(seek_position - packetDataBuffer), packetDataBuffer, false);
-                    if (new_pkt == NULL)
-                    {
-                        /*
-                            The below deallocation is not necessary because if NewPacket fails, then ~Packet will be called which deallocs
-                            packetDataBuffer.  See C++ spec 15.2.1.
-                        */
-                        //if (packetDataBuffer)
-                        //    delete[] packetDataBuffer;
-                        LOG_ERROR_OUT("Failed to instantiate an incoming packet (section 1). ");
-                    }
-                    else
-                    {
-                        sc_arg->input_buffer->Producer(new_pkt); // if so, create a packet and stick it in the input_buffer
-                    }
-                }
-                CATCHALL
-                {
-                    LOG_ERROR_OUT("Failed to instantiate an incoming packet (section 2).");
-                }
-                    // packetDataBuffer is now owned by the newly created packet, so don't delete it.
-                packetDataBuffer = NULL;
-                seek_position = NULL;
-                read_accum_count = 0;
-                read_mode = READ_MODE_HEADER;
-            }
-        } // READ_MODE_PAYLOAD
+void TLSSocketConnection::SetFlushLatency(uint32_t microseconds)
+{
+    flush_latency = (int64_t)microseconds * 1000;
+}
 
 
-        if (!stay_alive)
-            break;
+void TLSSocketConnection::SetHandshakeTimeout(uint32_t milliseconds)
+{
+    handshake_timeout = (int64_t)milliseconds * 1000000;
+}
+
 
-        //pthread_testcancel(); // TODO: Wait. Won't this leak memory if we were in the middle of reading a packet above?
-                            // Yes, it will.  See pthread_cleanup_push().
+bool TLSSocketConnection::IsHandshakeComplete() const
+{
+    return handshake_complete;
+}
+
+
+bool TLSSocketConnection::IsConnectReported() const
+{
+    return connect_reported;
+}
+
+
+void TLSSocketConnection::SetSessionKey(const string& key)
+{
+    session_key = key;
+}
+
+
+bool TLSSocketConnection::IsSessionReused() const
+{
+    return session_reused;
+}
+
+
+void TLSSocketConnection::SetEarlyDataTypes(const bool* types)
+{
+    early_data_types = types;
+}
+
+
+bool TLSSocketConnection::WriteEarly(Frame* frame)
+{
+    if (_sslHandle)
+        throw("WriteEarly() must be called before the handshake starts.");
+
+    iovec vector[Frame::max_segments];
+    int count = frame->Gather(vector, 0);
+    if (!Write(frame))
+        return false;
+    for (int i = 0; i < count; i++)
+        early_data.append((const char*)vector[i].iov_base, vector[i].iov_len);
+    return true;
+}
+
+
+bool TLSSocketConnection::IsEarlyDataAccepted() const
+{
+    return early_data_accepted;
+}
+
+
+bool TLSSocketConnection::IsKernelSend() const
+{
+    return kernel_send;
+}
+
+
+bool TLSSocketConnection::IsKernelReceive() const
+{
+    return kernel_receive;
+}
+
+
+/*
+    Packets that arrived as early data, even in part, may be a replay, so
+    only the types set up as idempotent may come that way.
+*/
+bool TLSSocketConnection::AcceptFrame(PacketType type)
+{
+    bool early = early_state == EARLY_READING || early_tail;
+    early_tail = false;
+    return !early || (early_data_types && early_data_types[type]);
+}
+
+
+/*
+    Offers the server the newest session kept from earlier connections to
+    it that is still good, taking it if it is a TLS 1.3 ticket.  Must be
+    called before the handshake starts.
+*/
+void TLSSocketConnection::ResumeClientSession()
+{
+    SSL_set_app_data(_sslHandle, this);
+    if (session_key.empty())
+        return;
 
-        if (read_starved)
+    pthread_mutex_lock(&_client_session_mutex);
+    if (_client_sessions)
+    {
+        map<string, deque<SSL_SESSION*> >::iterator it = _client_sessions->find(session_key);
+        while (it != _client_sessions->end() && !it->second.empty())
         {
-            if (err == SSL_ERROR_WANT_READ)
-            {
-                int status = 0;
-                do
-                {
-                    pthread_testcancel();
-                    status = WaitUntilReadableOrTimeout(sc_arg->GetDescriptor(),250);
-                    if (status < 0)
-                    {
-                        LOG_ERROR_OUT("Unexpected starvation condition.");
-                        stay_alive = false;
-                        break;
-                    }
-                } while (status == 0);
-            }
-            else if (err == SSL_ERROR_WANT_WRITE)
+            SSL_SESSION* session = it->second.back();
+            bool single_use = SSL_SESSION_get_protocol_version(session) >= TLS1_3_VERSION;
+            bool resumable = SSL_SESSION_is_resumable(session) != 0;
+            if (resumable)
+                SSL_set_session(_sslHandle, session); // takes a reference of its own
+            if (single_use || !resumable)
             {
-                int status = 0;
-                do
-                {
-                    pthread_testcancel();
-                    status = WaitUntilWritableOrTimeout(sc_arg->GetDescriptor(), 250);
-                    if (status < 0)
-                    {
-                        LOG_ERROR_OUT("Unexpected starvation condition.");
-                        stay_alive = false;
-                        break;
-                    }
-                } while (status == 0);
+                it->second.pop_back();
+                SSL_SESSION_free(session);
             }
-            else
-            {
-                // This should never happen because the code above is should only be setting read_starved when SSL_ERROR_WANT_READ or SSL_ERROR_WANT_WRITE happen.
-                LOG_ERROR_OUT("Unexpected starvation condition.");
-                stay_alive = false;
+            if (resumable)
                 break;
-            }
         }
+    }
+    pthread_mutex_unlock(&_client_session_mutex);
+}
 
-        pthread_testcancel();
-    } // end of while
 
-    SocketConnectionOwner* owner = sc_arg->GetOwner();
-    if (owner)
-        owner->DeleteSocketConnection((SocketConnection_Base*)sc_arg);
-    else
-        sc_arg->Deactivate(); // TODO: This is a hack.  Client sockets need to clean up properly.
-    pthread_exit((void*)1);
-    return NULL;
+/*
+    Called by OpenSSL, from within the handshake, with each new session a
+    client connection has established, to be offered by the next
+    connection to the same server.  Returning 1 keeps the reference
+    OpenSSL passed in.
+*/
+int TLSSocketConnection::SaveClientSession(SSL* ssl, SSL_SESSION* session)
+{
+    TLSSocketConnection* connection = (TLSSocketConnection*)SSL_get_app_data(ssl);
+    if (connection == NULL || connection->session_key.empty())
+        return 0;
+
+    pthread_mutex_lock(&_client_session_mutex);
+    if (_client_sessions == NULL)
+        _client_sessions = new map<string, deque<SSL_SESSION*> >;
+    deque<SSL_SESSION*>& kept = (*_client_sessions)[connection->session_key];
+    size_t room = SSL_SESSION_get_protocol_version(session) >= TLS1_3_VERSION ? max_client_sessions - 1 : 0;
+    while (kept.size() > room)
+    {
+        SSL_SESSION_free(kept.front());
+        kept.pop_front();
+    }
+    kept.push_back(session);
+    pthread_mutex_unlock(&_client_session_mutex);
+    return 1;
 }
 
 
-void* TLSSocketConnection::Writer(void* void_arg)
+/*
+    OpenSSL doesn't pass a resumed TLS 1.2 session to SaveClientSession,
+    even when the server renewed its ticket, as it does once the ticket
+    key has rotated.  Keeping it again here means the next connection
+    offers the renewed ticket.  TLS 1.3 tickets arrive after the handshake
+    and always go to SaveClientSession.
+*/
+void TLSSocketConnection::KeepResumedSession()
 {
-    if (sizeof(PacketDataLength) != sizeof(uint32_t))
-        throw("major problem.  PacketDataLength does not equal sizeof(uint32_t), which breaks ntohl");
-
+    if (!session_reused || session_key.empty() || SSL_version(_sslHandle) >= TLS1_3_VERSION)
+        return;
+    SSL_SESSION* session = SSL_get1_session(_sslHandle);
+    if (session && !SaveClientSession(_sslHandle, session))
+        SSL_SESSION_free(session);
+}
 
-    TLSSocketConnection* sc_arg = (TLSSocketConnection*)void_arg;
-    pthread_mutex_lock(&(sc_arg->ssl_handle_mutex));
-    SSL* ssl = sc_arg->GetSSLHandle();
-    pthread_mutex_unlock(&(sc_arg->ssl_handle_mutex));
-    int write_accum_count = 0;
-    bool stay_alive = true;
-    string* temp = NULL;
-    bool write_starved = false;
 
-    DEBUG_REPORT_LOCATION;
+/*
+    Decides, before the ClientHello goes out, whether the frames given to
+    WriteEarly go with it.  Only a session the server said takes early
+    data, and at least this much, allows it.  Must be called after
+    ResumeClientSession.
+*/
+void TLSSocketConnection::OfferEarlyData()
+{
+    SSL_SESSION* session = SSL_get_session(_sslHandle);
+    if (!early_data.empty() && session && early_data.size() <= SSL_SESSION_get_max_early_data(session))
+        early_state = EARLY_WRITING;
+    else
+        string().swap(early_data);
+}
 
-    /*
-        PTHREAD_CANCEL_DEFERRED will ensure that the threads
-        are killed only when they're blocked.  This is much
-        safer than just killing the threads at random.
-    */
-    pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
 
-    while (stay_alive)
+/*
+    SSL_op_timeout-style wrapper around SSL_write_early_data, which may
+    take the early data in parts.  early_skip counts what has been taken
+    until the handshake shows whether the server kept it.
+*/
+int TLSSocketConnection::WriteEarlyData(SSL* ssl)
+{
+    TLSSocketConnection* connection = (TLSSocketConnection*)SSL_get_app_data(ssl);
+    while (connection->early_skip < connection->early_data.size())
     {
-        // WRITE
-        int err;
-        write_starved = false;
-        if (temp == NULL)
-            temp = sc_arg->output_buffer.Consumer();
+        size_t n = 0;
+        int ret = SSL_write_early_data(ssl, connection->early_data.data() + connection->early_skip,
+                                       connection->early_data.size() - connection->early_skip, &n);
+        if (ret != 1)
+            return ret;
+        connection->early_skip += n;
+    }
+    connection->early_state = EARLY_SENT;
+    return 1;
+}
 
-        if (temp == NULL)
-        {
-            write_starved = true;
-        }
-        else
-        {
-            pthread_mutex_lock(&(sc_arg->ssl_handle_mutex));
-            int n = SSL_write(ssl, temp->c_str() + write_accum_count, temp->size() - write_accum_count);
-            if (n < 0)
-            {
-                err = SSL_get_error(ssl, n);
-                pthread_mutex_unlock(&(sc_arg->ssl_handle_mutex));
 
-                if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
-                {
-                    write_starved = true;
-                }
-                else
-                {
-                    LOG_ERROR_OUT("Error: " << ERR_error_string(err, NULL));
-                    stay_alive = false;
-                    break;
-                }
-            }
-            else if (n == 0)
-            {
-                pthread_mutex_unlock(&(sc_arg->ssl_handle_mutex));
+/*
+    Once a client handshake is done, tells whether the server accepted
+    the early data.  If it didn't, the frames it was made from are still
+    queued and go out as usual.
+*/
+void TLSSocketConnection::ResolveEarlyData()
+{
+    if (early_state != EARLY_WRITING && early_state != EARLY_SENT)
+        return;
+    early_data_accepted = early_state == EARLY_SENT && SSL_get_early_data_status(_sslHandle) == SSL_EARLY_DATA_ACCEPTED;
+    if (!early_data_accepted)
+        early_skip = 0;
+    early_state = EARLY_NONE;
+    string().swap(early_data);
+}
 
-                // disconnected
-                LOG_DEBUG_OUT("Disconnected.");
-                stay_alive = false;
-                break;
-            }
-            else
-            {
-                pthread_mutex_unlock(&(sc_arg->ssl_handle_mutex));
 
-                write_accum_count += n;
-                if (write_accum_count >= temp->size())
-                {
-                    delete temp;
-                    temp = NULL;
-                    write_accum_count = 0;
-                }
-                /*
-                else
-                {
-                    // Continue writing because we're not done yet.  But, do it in a way that allows SSL_read to execute also.
-                }
-                */
-            }
+/*
+    Called once the handshake is done, to find out which directions
+    OpenSSL handed to the kernel (see SetProtocolOptions).  Sending is
+    taken over whenever the kernel seals the records; OpenSSL is still
+    used for close_notify, which goes out as a record of its own.
+    Receiving is only taken over for TLS 1.2, where nothing but alerts may
+    follow the handshake, and only if OpenSSL has read nothing ahead.
+    A TLS 1.3 peer can send tickets or key updates at any time, which
+    SSL_read has to see, even if the kernel decrypts them.
+*/
+void TLSSocketConnection::UseKernelTLS()
+{
+#if defined(__linux__) && defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    kernel_send = BIO_get_ktls_send(SSL_get_wbio(_sslHandle));
+    kernel_receive = BIO_get_ktls_recv(SSL_get_rbio(_sslHandle))
+        && SSL_version(_sslHandle) < TLS1_3_VERSION && !SSL_has_pending(_sslHandle);
+    LOG_DEBUG_OUT("kTLS send: " << kernel_send << " receive: " << kernel_receive);
+#endif
+}
+
+
+/*
+    Reads from a socket the kernel decrypts.  Each record other than
+    application data comes back by itself, tagged with its type: a
+    close_notify alert ends the connection like any other close, and any
+    other alert or a handshake message (renegotiation, which the kernel
+    can't follow) fails it.
+*/
+SocketConnection_Base::IOStatus TLSSocketConnection::ReceiveRecord(char* buffer, size_t length, size_t& transferred)
+{
+#if defined(__linux__)
+    char control[CMSG_SPACE(sizeof(unsigned char))];
+    iovec data;
+    data.iov_base = buffer;
+    data.iov_len = length;
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    ssize_t read_length = recvmsg(GetDescriptor(), &message, 0);
+    if (read_length == 0)
+        return IO_CLOSED;
+    if (read_length < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return IO_WANT_READ;
+        LOG_DEBUG_OUT("recvmsg() failed.  errno: " << errno);
+        tls_state = TLS_FAILED;
+        return IO_ERROR;
+    }
+
+    cmsghdr* header = CMSG_FIRSTHDR(&message);
+    if (header && header->cmsg_level == SOL_TLS && header->cmsg_type == TLS_GET_RECORD_TYPE
+        && *CMSG_DATA(header) != SSL3_RT_APPLICATION_DATA)
+    {
+        if (*CMSG_DATA(header) == SSL3_RT_ALERT && read_length >= 2 && buffer[1] == SSL3_AD_CLOSE_NOTIFY)
+        {
+            LOG_DEBUG_OUT("Disconnected.");
+            SSL_set_shutdown(_sslHandle, SSL_get_shutdown(_sslHandle) | SSL_RECEIVED_SHUTDOWN);
+            return IO_CLOSED;
         }
+        LOG_ERROR_OUT("Unexpected TLS record of type " << (int)*CMSG_DATA(header) << ".");
+        tls_state = TLS_FAILED;
+        return IO_ERROR;
+    }
+    transferred = read_length;
+    return IO_OK;
+#else
+    return IO_ERROR;
+#endif
+}
 
 
-        if (!stay_alive)
-            break;
+/*
+    Writes to a socket the kernel encrypts, the way SocketConnection
+    does.
+*/
+SocketConnection_Base::IOStatus TLSSocketConnection::SendRecords(const iovec* vector, int count, size_t& transferred)
+{
+#if defined(__linux__)
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = (iovec*)vector;
+    message.msg_iovlen = count;
+    ssize_t write_length = sendmsg(GetDescriptor(), &message, MSG_NOSIGNAL);
+    if (write_length > 0)
+    {
+        transferred = write_length;
+        return IO_OK;
+    }
+    if (write_length == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return IO_WANT_WRITE;
+    LOG_DEBUG_OUT("sendmsg() failed.  errno: " << errno);
+    tls_state = TLS_FAILED;
+    return IO_ERROR;
+#else
+    return IO_ERROR;
+#endif
+}
 
-        //pthread_testcancel(); // TODO: Wait. Won't this leak memory if we were in the middle of reading a packet above?
-                                    // Yes, it will.  See pthread_cleanup_push().
 
-        if (write_starved)
+/*
+    While a handshake begun by Start*Connection is under way,
+    ReceiveBytes and SendBytes carry it forward, and every event checks it
+    against its deadline.  The timer is armed again each time, since a flush latency
+    timer may have taken its place.
+*/
+void TLSSocketConnection::HandleEvents(uint32_t events)
+{
+    if (handshake_pending && handshake_timeout > 0)
+    {
+        int64_t remaining = handshake_started + handshake_timeout - MonotonicNanoseconds();
+        if (remaining <= 0)
         {
-            if (err == SSL_ERROR_WANT_READ)
-            {
-                int status = 0;
-                do
-                {
-                    pthread_testcancel();
-                    status = WaitUntilReadableOrTimeout(sc_arg->GetDescriptor(), 250);
-                    if (status < 0)
-                    {
-                        LOG_ERROR_OUT("Unexpected starvation condition.");
-                        stay_alive = false;
-                        break;
-                    }
-                } while (status == 0);
-            }
-            else if (err == SSL_ERROR_WANT_WRITE)
-            {
-                int status = 0;
-                do
-                {
-                    pthread_testcancel();
-                    status = WaitUntilWritableOrTimeout(sc_arg->GetDescriptor(), 250);
-                    if (status < 0)
-                    {
-                        LOG_ERROR_OUT("Unexpected starvation condition.");
-                        stay_alive = false;
-                        break;
-                    }
-                } while (status == 0);
-            }
-            else
-            {
-                // This should never happen because the code above is should only be setting read_starved when SSL_ERROR_WANT_READ or SSL_ERROR_WANT_WRITE happen.
-                LOG_ERROR_OUT("Unexpected starvation condition.");
-                stay_alive = false;
-                break;
-            }
+            LOG_DEBUG_OUT("TLS handshake timed out.");
+            Disconnect();
+            return;
         }
+        GetEventLoop()->ScheduleAfter(this, remaining);
+    }
+    SocketConnection_Base::HandleEvents(events);
+}
 
-        pthread_testcancel();
 
-    } // end of while
+void TLSSocketConnection::FinishHandshake(bool succeeded)
+{
+    handshake_pending = false;
+    handshake_complete = succeeded;
+    ReportHandshake(succeeded);
+}
+
 
-    SocketConnectionOwner* owner = sc_arg->GetOwner();
+/*
+    Tells the owner how the handshake went, once.  After a server has
+    reported a handshake on accepting early data, a failure later on
+    shows up as a dropped connection instead.
+*/
+void TLSSocketConnection::ReportHandshake(bool succeeded)
+{
+    if (handshake_reported)
+        return;
+    handshake_reported = true;
+    connect_reported = succeeded;
+    SocketConnectionOwner* owner = GetOwner();
     if (owner)
-        owner->DeleteSocketConnection((SocketConnection_Base*)sc_arg);
-    else
-        sc_arg->Deactivate(); // TODO: This is a hack.  Client sockets need to clean up properly.
-    pthread_exit((void*)1);
-    return NULL;
+        owner->HandshakeFinished(this, succeeded, MonotonicNanoseconds() - handshake_started);
 }
 
 
 
+/*
+    Runs func until it completes, waiting for the readiness it asks for in
+    between.  timeout_seconds bounds the whole operation rather than each
+    wait, so a peer that trickles bytes can't stretch it indefinitely.
+*/
 int SSL_op_timeout(SSL_func func, SSL* _sslHandle, int file_descriptor, int timeout_seconds)
 {
-    timeval timeout;
-    timeout.tv_sec = timeout_seconds;
-    timeout.tv_usec = 0;
-    bool ssl_func_failed = false;
-    bool keep_going = false;
+    int64_t deadline = MonotonicNanoseconds() + (int64_t)timeout_seconds * 1000000000LL;
     int ssl_err = 0;
-    do
+    while (1)
     {
-        keep_going = false;
+        ERR_clear_error(); // SSL_get_error() requires an empty error queue
         ssl_err = func(_sslHandle);
-        if (ssl_err <= 0)
+        if (ssl_err > 0)
+            break;
+
+        int sub_err = SSL_get_error(_sslHandle, ssl_err);
+        WaitDescriptor wait;
+        wait.file_descriptor = file_descriptor;
+        if (sub_err == SSL_ERROR_WANT_READ)
         {
-            int sub_err = SSL_get_error(_sslHandle, ssl_err);
-            if (sub_err == SSL_ERROR_WANT_READ)
-            {
-                keep_going = true;
-                sub_err = WaitUntilReadableWithTimeval(file_descriptor, &timeout);
-                if (sub_err < 0)
-                {
-                    LOG_ERROR_OUT("select failed.  Error: " << errno);
-                    ssl_func_failed = true;
-                    ssl_err = -1;
-                    break;
-                }
-                else if (sub_err == 0)
-                {
-                    LOG_DEBUG_OUT("timed out.");
-                    ssl_func_failed = true;
-                    ssl_err = -1;
-                    break;
-                }
-            }
-            else if (sub_err == SSL_ERROR_WANT_WRITE)
-            {
-                keep_going = true;
-                sub_err = WaitUntilWritableWithTimeval(file_descriptor, &timeout);
-                if (sub_err < 0)
-                {
-                    LOG_ERROR_OUT("select failed.  Error: " << errno);
-                    ssl_func_failed = true;
-                    ssl_err = -1;
-                    break;
-                }
-                else if (sub_err == 0)
-                {
-                    LOG_DEBUG_OUT("timed out.");
-                    ssl_func_failed = true;
-                    ssl_err = -1;
-                    break;
-                }
-            }
-            else
-            {
-                if (func == SSL_shutdown) // OpenSSL sucks so damn bad!  Docs say "erroneous SSL_ERROR_SYSCALL may be flagged."
-                {
-                    keep_going = true;
-                    continue;
-                }
-                LOG_ERROR_OUT("SSLFunc() failed: ssl_err:" << ssl_err << " sub_err:" << sub_err << " errno:" << errno /*<< " WSAGLE:" << WSAGetLastError()*/);
-                ssl_func_failed = true;
-                ssl_err = -1;
-                break;
-            }
+            wait.events = WAIT_READABLE;
+        }
+        else if (sub_err == SSL_ERROR_WANT_WRITE)
+        {
+            wait.events = WAIT_WRITABLE;
+        }
+        else
+        {
+            if (func == SSL_shutdown && ssl_err == 0) // the close_notify was sent; keep going to receive the peer's
+                continue;
+            LOG_ERROR_OUT("SSLFunc() failed: ssl_err:" << ssl_err << " sub_err:" << sub_err << " errno:" << errno /*<< " WSAGLE:" << WSAGetLastError()*/);
+            ssl_err = -1;
+            break;
         }
-    } while (keep_going && !ssl_func_failed);
+
+        int64_t remaining = deadline - MonotonicNanoseconds();
+        int ready = remaining > 0 ? WaitForDescriptors(&wait, 1, remaining) : 0;
+        if (ready < 0)
+        {
+            LOG_ERROR_OUT("WaitForDescriptors failed.  Error: " << errno);
+            ssl_err = -1;
+            break;
+        }
+        else if (ready == 0)
+        {
+            LOG_DEBUG_OUT("timed out.");
+            ssl_err = -1;
+            break;
+        }
+    }
 
     return ssl_err;
 }
@@ -1069,65 +1081,143 @@ bool TLSSocketConnection::GetActive() const
 
 
 
-void TLSSocketConnection::PrepareServerConnection()
+/*
+    Builds a context for server connections from PEM files.  The
+    certificate chain and key are loaded and checked against each other
+    here, once, rather than for every connection accepted.
+*/
+SSL_CTX* TLSSocketConnection::CreateServerContext(const string& certificate_file, const string& private_key_file)
 {
-    if (_client_vs_server_protect)
-        throw("You're only allowed to call PrepareServerConnection() and/or PrepareClientConnection() once on each TLSSocketConnection.");
-    else
-        _client_vs_server_protect = true;
-
-    if (_sslHandle)
-        throw("_sslHandle is already set.");
-
-    pthread_mutex_lock(&_server_ssl_context_mutex);
-    if (_server_ssl_context_refcount == UINT32_MAX)
-        throw("overflow");
-    if (_server_ssl_context_refcount == 0)
-        _server_ssl_context = SSL_CTX_new(TLSv1_2_server_method());
-    _server_ssl_context_refcount++;
-    if (_server_ssl_context == NULL)
+    SSL_CTX* context = SSL_CTX_new(TLS_server_method());
+    if (context == NULL)
         throw("SSL_CTX_new() allocation failed.");
-    _sslContext = _server_ssl_context;    
-    pthread_mutex_unlock(&_server_ssl_context_mutex);
+    SetProtocolOptions(context);
 
-    int use_cert = SSL_CTX_use_certificate_file(_sslContext, "./server.crt", SSL_FILETYPE_PEM);
-    if (use_cert <= 0)
+    if (SSL_CTX_use_certificate_chain_file(context, certificate_file.c_str()) <= 0)
     {
-        throw("SSL_CTX_use_certificate_file failed.");
+        LOG_ERROR_OUT("Failed to load certificate " << certificate_file << ": " << ERR_error_string(ERR_get_error(), NULL));
+        SSL_CTX_free(context);
+        throw("SSL_CTX_use_certificate_chain_file() failed.");
     }
-
-    int use_prv = SSL_CTX_use_PrivateKey_file(_sslContext, "./server.key", SSL_FILETYPE_PEM);
-    if (use_prv <= 0)
+    if (SSL_CTX_use_PrivateKey_file(context, private_key_file.c_str(), SSL_FILETYPE_PEM) <= 0)
     {
+        LOG_ERROR_OUT("Failed to load private key " << private_key_file << ": " << ERR_error_string(ERR_get_error(), NULL));
+        SSL_CTX_free(context);
         throw("SSL_CTX_use_PrivateKey_file() failed.");
     }
-    if (1 != SSL_CTX_check_private_key(_sslContext))
+    if (1 != SSL_CTX_check_private_key(context))
     {
         LOG_ERROR_OUT("Private key does not match the certificate public key.");
+        SSL_CTX_free(context);
         throw("Private key does not match the certificate public key.");
     }
 
+    // sessions cached by a context are only resumed by contexts with the same id
+    static const unsigned char session_id_context[] = "comlink";
+    SSL_CTX_set_session_id_context(context, session_id_context, sizeof(session_id_context) - 1);
+    SetSessionFriendlyOptions(context);
+    return context;
+}
+
+
+/*
+    The connection keeps its own reference, so the owner may replace or
+    free its context while the connection still uses this one.
+*/
+void TLSSocketConnection::SetServerContext(SSL_CTX* context)
+{
+    if (server_context)
+        throw("The server context is already set.");
+    if (context)
+        SSL_CTX_up_ref(context);
+    server_context = context;
+}
+
+
+void TLSSocketConnection::AcquireServerContext()
+{
+    if (_client_vs_server_protect)
+        throw("You're only allowed to call PrepareServerConnection() and/or PrepareClientConnection() once on each TLSSocketConnection.");
+    else
+        _client_vs_server_protect = true;
+
+    if (_sslHandle)
+        throw("_sslHandle is already set.");
+    if (server_context == NULL)
+        throw("No server context was set before preparing the connection.");
+    _sslContext = server_context;
+}
+
+
+void TLSSocketConnection::PrepareServerConnection()
+{
+    AcquireServerContext();
+
     if (!SetNonBlockingMode(GetDescriptor()))
     {
         LOG_ERROR_OUT("Failed to set connection to non-blocking mode.");
         CloseDescriptor(GetDescriptor());
         throw("SetNonBlockingMode() failed.");
     }
+    if (!SetNoDelay(GetDescriptor()))
+    {
+        LOG_DEBUG_OUT("Failed to set TCP_NODELAY.");
+    }
 
     _sslHandle = SSL_new(_sslContext);
     SSL_set_fd(_sslHandle, GetDescriptor());
+    SetRetryModes(_sslHandle);
 
     int ssl_err = SSL_op_timeout(SSL_accept, _sslHandle, GetDescriptor(), 10);
     if (ssl_err <= 0)
     {
         SSL_free(_sslHandle);
+        _sslHandle = NULL;
         CloseDescriptor(GetDescriptor());
         throw("SSL_accept() failed.");
     }
+    tls_state = TLS_OPEN;
 }
 
 
-void TLSSocketConnection::PrepareClientConnection()
+/*
+    Sets the connection up to answer the ClientHello and returns without
+    waiting for it.  Like StartClientConnection, the connection is marked
+    TLS_OPEN straight away and the handshake is completed on the EventLoop,
+    by ReceiveBytes and SendBytes, which report it to the owner when done.
+*/
+void TLSSocketConnection::StartServerConnection()
+{
+    AcquireServerContext();
+
+    int fd = GetDescriptor();
+    if (fd <= 0)
+        throw("descriptor isn't set");
+    if (!SetNonBlockingMode(fd))
+        throw("SetNonBlockingMode() failed.");
+    if (!SetNoDelay(fd))
+    {
+        LOG_DEBUG_OUT("Failed to set TCP_NODELAY.");
+    }
+
+    _sslHandle = SSL_new(_sslContext);
+    if (_sslHandle == NULL || !SSL_set_fd(_sslHandle, fd))
+    {
+        SSL_free(_sslHandle);
+        _sslHandle = NULL;
+        throw("SSL_new() or SSL_set_fd() failed.");
+    }
+    SetRetryModes(_sslHandle);
+    SSL_set_accept_state(_sslHandle);
+    if (early_data_types && SSL_get_max_early_data(_sslHandle) > 0)
+        early_state = EARLY_READING;
+    tls_state = TLS_OPEN;
+    handshake_started = MonotonicNanoseconds();
+    handshake_pending = true;
+}
+
+
+void TLSSocketConnection::AcquireClientContext()
 {
     if (_client_vs_server_protect)
         throw("You're only allowed to call PrepareServerConnection() and/or PrepareClientConnection() once on each TLSSocketConnection.");
@@ -1136,16 +1226,86 @@ void TLSSocketConnection::PrepareClientConnection()
 
     pthread_mutex_lock(&_client_ssl_context_mutex);
     if (_client_ssl_context_refcount == UINT32_MAX)
+    {
+        pthread_mutex_unlock(&_client_ssl_context_mutex);
         throw("overflow");
+    }
     if (_client_ssl_context_refcount == 0)
-        _client_ssl_context = SSL_CTX_new(TLSv1_2_client_method());
+    {
+        _client_ssl_context = SSL_CTX_new(TLS_client_method());
+        if (_client_ssl_context == NULL)
+        {
+            pthread_mutex_unlock(&_client_ssl_context_mutex);
+            throw("SSL_CTX_new() failed.");
+        }
+        SetProtocolOptions(_client_ssl_context);
+        // sessions are kept by SaveClientSession, per server rather than per context
+        SSL_CTX_set_session_cache_mode(_client_ssl_context, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(_client_ssl_context, SaveClientSession);
+        SetSessionFriendlyOptions(_client_ssl_context);
+    }
     _client_ssl_context_refcount++;
     _sslContext = _client_ssl_context;
     pthread_mutex_unlock(&_client_ssl_context_mutex);
+}
+
 
+void TLSSocketConnection::PrepareClientConnection()
+{
+    AcquireClientContext();
 
+    handshake_started = MonotonicNanoseconds();
     if (!SSLConnect())
         throw("SSLConnect() failed.");
+    FinishHandshake(true);
+}
+
+
+/*
+    Sends the ClientHello and returns.  The connection is marked TLS_OPEN
+    straight away: ReceiveBytes and SendBytes carry on with the handshake
+    when the EventLoop calls them, reporting IO_WANT_READ / IO_WANT_WRITE
+    until it is done, and then report it to the owner.
+*/
+void TLSSocketConnection::StartClientConnection()
+{
+    AcquireClientContext();
+
+    int fd = GetDescriptor();
+    if (fd <= 0)
+        throw("descriptor isn't set");
+    if (!SetNonBlockingMode(fd))
+        throw("SetNonBlockingMode() failed.");
+    if (!SetNoDelay(fd))
+    {
+        LOG_DEBUG_OUT("Failed to set TCP_NODELAY.");
+    }
+
+    _sslHandle = SSL_new(_sslContext);
+    if (_sslHandle == NULL || !SSL_set_fd(_sslHandle, fd))
+    {
+        SSL_free(_sslHandle);
+        _sslHandle = NULL;
+        throw("SSL_new() or SSL_set_fd() failed.");
+    }
+    SetRetryModes(_sslHandle);
+    ResumeClientSession();
+    OfferEarlyData();
+    SSL_set_connect_state(_sslHandle);
+
+    // sends the ClientHello, and the early data with it
+    ERR_clear_error();
+    bool finished = false;
+    IOStatus status = ContinueHandshake(finished);
+    if (status == IO_CLOSED || status == IO_ERROR)
+    {
+        SSL_free(_sslHandle);
+        _sslHandle = NULL;
+        throw("SSL_do_handshake() failed.");
+    }
+    tls_state = TLS_OPEN;
+    handshake_started = MonotonicNanoseconds();
+    handshake_pending = true;
 }
 
 
@@ -1157,16 +1317,12 @@ void TLSSocketConnection::SetSSLHandle(SSL* ssl)
 
 bool TLSSocketConnection::SSLConnect()
 {
-    pthread_mutex_lock(&ssl_handle_mutex);
-
     if (_sslHandle)
     {
-        pthread_mutex_unlock(&ssl_handle_mutex);
         return false;
     }
     if (!_sslContext)
     {
-        pthread_mutex_unlock(&ssl_handle_mutex);
         return false;
     }
 
@@ -1175,7 +1331,6 @@ bool TLSSocketConnection::SSLConnect()
     int fd = GetDescriptor();
     if (fd <= 0)
     {
-        pthread_mutex_unlock(&ssl_handle_mutex);
         throw("descriptor isn't set");
     }
     else
@@ -1186,7 +1341,6 @@ bool TLSSocketConnection::SSLConnect()
         _sslHandle = SSL_new(_sslContext);
         if (_sslHandle == NULL)
         {
-            pthread_mutex_unlock(&ssl_handle_mutex);
             LOG_ERROR_OUT("SSL_new() failed.");
             return false;
         }
@@ -1197,20 +1351,27 @@ bool TLSSocketConnection::SSLConnect()
             LOG_ERROR_OUT("SSL_set_fd() failed.");
             SSL_free(_sslHandle);
             _sslHandle = NULL;
-            pthread_mutex_unlock(&ssl_handle_mutex);
             return false;
         }
+        SetRetryModes(_sslHandle);
+        ResumeClientSession();
 
         if (!SetNonBlockingMode(fd))
         {
             LOG_ERROR_OUT("Failed to set non-blocking IO mode.");
             SSL_free(_sslHandle);
             _sslHandle = NULL;
-            pthread_mutex_unlock(&ssl_handle_mutex);
             return false;
         }
+        if (!SetNoDelay(fd))
+        {
+            LOG_DEBUG_OUT("Failed to set TCP_NODELAY.");
+        }
 
-        int ssl_err = SSL_op_timeout(SSL_connect, _sslHandle, fd, 10);
+        OfferEarlyData();
+        int ssl_err = early_state == EARLY_WRITING ? SSL_op_timeout(WriteEarlyData, _sslHandle, fd, 10) : 1;
+        if (ssl_err > 0)
+            ssl_err = SSL_op_timeout(SSL_connect, _sslHandle, fd, 10);
         if (ssl_err <= 0)
         {
             //shutdown(fd, SHUT_RDWR);
@@ -1222,11 +1383,14 @@ bool TLSSocketConnection::SSLConnect()
             SSL_free(_sslHandle);
             _sslHandle = NULL;
             //CloseDescriptor(fd);
-            pthread_mutex_unlock(&ssl_handle_mutex);
             return false;
         }
         else
         {
+            session_reused = SSL_session_reused(_sslHandle) != 0;
+            KeepResumedSession();
+            ResolveEarlyData();
+            UseKernelTLS();
             cout << "SSL connection using " << SSL_get_cipher(_sslHandle) << endl;
 
             /* Get server's certificate (note: beware of dynamic allocation) - opt */
@@ -1268,14 +1432,14 @@ bool TLSSocketConnection::SSLConnect()
             */
             /* We could do all sorts of certificate verification stuff here before
             deallocating the certificate. */
+            X509_free(server_cert); // SSL_get_peer_certificate took a reference
 
-            pthread_mutex_unlock(&ssl_handle_mutex);
+            tls_state = TLS_OPEN;
             return true;
         }
 
     }
 
-    pthread_mutex_unlock(&ssl_handle_mutex);
     return false;
 }
 
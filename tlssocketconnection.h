@@ -24,33 +24,244 @@ public:
     virtual void Deactivate();
     virtual void PrepareServerConnection();
     virtual void PrepareClientConnection();
+    virtual void StartServerConnection();
+    virtual void StartClientConnection();
+    virtual void HandleEvents(uint32_t events);
     bool GetActive() const;
     void SetSSLHandle(SSL* ssl);
     bool SSLConnect();
 
+    /*
+        CreateServerContext
+
+        Returns a new SSL_CTX for server connections, with the PEM
+        certificate chain and private key loaded from the given files.
+        Throws if they can't be loaded or don't match.  The caller frees
+        it with SSL_CTX_free.
+    */
+    static SSL_CTX* CreateServerContext(const string& certificate_file, const string& private_key_file);
+
+    /*
+        SetServerContext
+
+        Selects the context, made by CreateServerContext, that
+        Prepare/StartServerConnection use.  The connection holds a
+        reference to it for as long as it lives.  Must be called before
+        either of them.
+    */
+    void SetServerContext(SSL_CTX* context);
+
+    /*
+        SetFlushLatency
+
+        Queued frames are packed together into TLS records of up to 16 KB.
+        When less than a full record is waiting, the connection may hold it
+        back for up to microseconds in the hope that more frames arrive to
+        share the record.  0, the default, writes whatever is queued as soon
+        as the socket allows.
+    */
+    void SetFlushLatency(uint32_t microseconds);
+
+    /*
+        SetHandshakeTimeout
+
+        How long a handshake begun by Start*Connection may take before the
+        connection is dropped.  0 never times out.  Defaults to 10
+        seconds.  Must be called before Activate().
+    */
+    void SetHandshakeTimeout(uint32_t milliseconds);
+
+    /*
+        IsHandshakeComplete
+
+        True once a handshake begun by Start*Connection has succeeded.
+    */
+    bool IsHandshakeComplete() const;
+
+    /*
+        IsConnectReported
+
+        True once the owner has been told the handshake succeeded, which
+        a server accepting early data does before the handshake is
+        complete.  The owner hears of the disconnect only if so.
+    */
+    bool IsConnectReported() const;
+
+    /*
+        SetSessionKey
+
+        Names the server a client connection is for, typically its
+        address and port.  The session of the last handshake with that
+        server is kept, process wide, and offered to it again by the next
+        connection given the same key, which then only needs an
+        abbreviated handshake if the server still accepts it.  Must be
+        called before Prepare/StartClientConnection.
+    */
+    void SetSessionKey(const string& key);
+
+    /*
+        IsSessionReused
+
+        True once the handshake has completed by resuming an earlier
+        session rather than with a full handshake.
+    */
+    bool IsSessionReused() const;
+
+    /*
+        SetEarlyDataTypes
+
+        Lets a server connection take TLS 1.3 early (0-RTT) data from a
+        client resuming a session, if its context allows any (see
+        SSL_CTX_set_max_early_data).  types is indexed by packet type and
+        says which types may arrive that way.  Early data can be replayed
+        by an attacker, so only types whose handling is idempotent belong
+        there; a connection that sends any other type early is dropped.
+        The connection is reported to its owner as soon as its early data
+        is accepted, and may answer it before the handshake completes.
+        types must outlive the connection.  NULL, the default, refuses
+        early data.  Must be called before StartServerConnection.
+    */
+    void SetEarlyDataTypes(const bool* types);
+
+    /*
+        WriteEarly
+
+        Writes frame like Write, and also offers it to the server as early
+        data if the session being resumed allows it, so it arrives with the
+        ClientHello rather than a round trip later.  If the server refuses
+        it, it is sent again once the handshake completes.  Only for
+        packets that are safe to handle twice.  Must be called before
+        Prepare/StartClientConnection and before anything else is written.
+    */
+    bool WriteEarly(Frame* frame);
+
+    /*
+        IsEarlyDataAccepted
+
+        True once the peer has accepted early data on this connection.
+    */
+    bool IsEarlyDataAccepted() const;
+
+    /*
+        IsKernelSend / IsKernelReceive
+
+        True once the handshake has handed the encryption of outgoing
+        records, or the decryption of incoming ones, to the kernel (kTLS).
+        The connection then writes and reads the socket directly, as a
+        plaintext connection would, in that direction.
+    */
+    bool IsKernelSend() const;
+    bool IsKernelReceive() const;
+
+protected:
+    virtual IOStatus ReceiveBytes(char* buffer, size_t length, size_t& transferred);
+    virtual IOStatus SendBytes(const char* buffer, size_t length, size_t& transferred);
+    virtual IOStatus SendVector(const iovec* vector, int count, size_t& transferred);
+    virtual size_t GetCommittedBytes() const;
+    virtual bool AcceptFrame(PacketType type);
+
 private:
     /*
-        ReaderWriter
+        TLSState
 
-        Thread responsible for processing both incoming and outgoing data.
+        Start*Connection sets the handshake up and marks the connection
+        TLS_OPEN straight away, with the handshake pending.  The EventLoop
+        then drives it with SSL_do_handshake: ContinueHandshake runs before
+        every SSL_read and SSL_write until it is done, and AdvanceHandshake
+        runs it on its own where the outcome decides what to write.  Each
+        event checks it against the handshake timeout and drops the
+        connection once that passes.  FinishHandshake reports the outcome
+        to the owner (a server that accepts early data reports it earlier,
+        but still finishes the handshake the same way), and from then on
+        the loop drives SSL_read and SSL_write from socket readiness.
+        (Prepare*Connection instead completes the handshake before
+        returning.)  A fatal protocol or socket error moves it to
+        TLS_FAILED, after which close_notify must not be sent.  Deactivate
+        sends close_notify from TLS_OPEN, then the connection is
+        TLS_CLOSED.
     */
-    //static void* ReaderWriter(void* void_arg);
-    static void* Reader(void* void_arg);
-    static void* Writer(void* void_arg);
+    enum TLSState
+    {
+        TLS_NEW,
+        TLS_OPEN,
+        TLS_FAILED,
+        TLS_CLOSED
+    };
 
-    SSL* GetSSLHandle() const;
+    /*
+        EarlyDataState
+
+        A client with early data to offer starts at EARLY_WRITING if the
+        session it resumes allows that much, and moves to EARLY_SENT once
+        SSL_write_early_data has taken it.  A server reads early data from
+        EARLY_READING until the client ends it.
+    */
+    enum EarlyDataState
+    {
+        EARLY_NONE,
+        EARLY_WRITING,
+        EARLY_SENT,
+        EARLY_READING
+    };
+
+    IOStatus TranslateError(int ret, const char* operation);
+    IOStatus ContinueHandshake(bool& finished);
+    IOStatus AdvanceHandshake();
+    IOStatus ReadEarlyData(char* buffer, size_t length, size_t& transferred, bool& accepted);
+    void OfferEarlyData();
+    void ResolveEarlyData();
+    static int WriteEarlyData(SSL* ssl);
+    void UseKernelTLS();
+    IOStatus ReceiveRecord(char* buffer, size_t length, size_t& transferred);
+    IOStatus SendRecords(const iovec* vector, int count, size_t& transferred);
+    void SendCloseNotify();
+    void AcquireServerContext();
+    void AcquireClientContext();
+    void FinishHandshake(bool succeeded);
+    void ReportHandshake(bool succeeded);
+    void ResumeClientSession();
+    void KeepResumedSession();
+    static int SaveClientSession(SSL* ssl, SSL_SESSION* session);
 
-    //pthread_t reader_writer_id;
-    pthread_t reader_id;
-    pthread_t writer_id;
-    pthread_mutex_t ssl_handle_mutex;
+    SSL* GetSSLHandle() const;
 
+    /*
+        Only one thread uses the SSL handle at a time, so it has no lock:
+        the thread that prepares or starts the connection, until
+        Activate() hands it to the EventLoop, whose thread then makes
+        every SSL call, reading and writing alike, and after StopEvents()
+        the thread that deactivates it.  Other threads only ever touch the
+        connection's queues.
+    */
     SSL* _sslHandle;
     SSL_CTX* _sslContext;
-    
-    static SSL_CTX* _server_ssl_context;
+    SSL_CTX* server_context;        // referenced by SetServerContext
+
     static SSL_CTX* _client_ssl_context;
 
+    TLSState tls_state;
+
+    // plaintext packed for the next SSL_write, ahead of the frames it came from
+    string record_buffer;
+    int64_t flush_latency;          // nanoseconds
+    int64_t flush_pending_since;    // when a short record was first held back, 0 if none
+    int64_t handshake_timeout;      // nanoseconds
+    int64_t handshake_started;
+    bool handshake_pending;         // begun by Start*Connection and not yet done; the timeout applies
+    bool handshake_reported;        // the owner has heard the outcome, which early data can make happen first
+    bool connect_reported;          // ... and it was a success
+    bool handshake_complete;
+    bool session_reused;
+    string session_key;             // see SetSessionKey
+    EarlyDataState early_state;
+    string early_data;              // client: the frames given to WriteEarly, as sent
+    size_t early_skip;              // client: bytes of queued frames the server already took as early data
+    bool early_tail;                // server: a frame begun in early data has yet to be checked
+    bool early_data_accepted;
+    const bool* early_data_types;   // see SetEarlyDataTypes
+    bool kernel_send;               // see UseKernelTLS
+    bool kernel_receive;
+    bool write_pending;             // an SSL_write wants to be retried with the same bytes
     bool active;
     bool _client_vs_server_protect;
 
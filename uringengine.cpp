@@ -0,0 +1,724 @@
+
+#include "uringengine.h"
+#include "logger.h"
+#include <errno.h>
+#include <cstring>
+#include <climits>
+#include <unistd.h>
+#if defined(HAVE_IO_URING)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace std;
+
+#if defined(HAVE_IO_URING)
+
+static const unsigned ring_entries = 1024;
+static const unsigned buffer_count = 256;        // must be a power of two
+static const unsigned buffer_size = 8192;
+static const uint16_t buffer_group = 0;
+static const size_t max_iov_per_send = (IOV_MAX < 1024) ? IOV_MAX : 1024;
+
+
+static int io_uring_setup(unsigned entries, io_uring_params* params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+
+static int io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+
+static int io_uring_register(int ring_fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+
+URingEngine::URingEngine(EventLoop* loop)
+    : event_loop(loop), next_token(1), dispatching(NULL), submit_scheduled(false), unsubmitted(0), submit_count(0),
+      ring_descriptor(-1), sq_ring(MAP_FAILED), sq_ring_size(0), cq_ring(MAP_FAILED), cq_ring_size(0),
+      submissions(MAP_FAILED), submissions_size(0), buffer_ring(MAP_FAILED), buffer_ring_size(0), buffers(NULL), buffer_tail(0)
+{
+    DEBUG_REPORT_LOCATION;
+
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&dispatch_done, NULL);
+
+    try
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ring_descriptor = io_uring_setup(ring_entries, &params);
+        if (ring_descriptor == -1)
+            throw("io_uring_setup() failed.");
+        if (!(params.features & IORING_FEAT_NODROP))
+            throw("io_uring does not guarantee completion delivery on this kernel.");
+
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+        {
+            if (cq_ring_size > sq_ring_size)
+                sq_ring_size = cq_ring_size;
+            cq_ring_size = 0;
+        }
+
+        sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_descriptor, IORING_OFF_SQ_RING);
+        if (sq_ring == MAP_FAILED)
+            throw("mmap() of the io_uring submission queue failed.");
+        if (cq_ring_size)
+        {
+            cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_descriptor, IORING_OFF_CQ_RING);
+            if (cq_ring == MAP_FAILED)
+                throw("mmap() of the io_uring completion queue failed.");
+        }
+        char* cq_base = (char*)(cq_ring_size ? cq_ring : sq_ring);
+
+        submissions_size = params.sq_entries * sizeof(io_uring_sqe);
+        submissions = mmap(NULL, submissions_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_descriptor, IORING_OFF_SQES);
+        if (submissions == MAP_FAILED)
+            throw("mmap() of the io_uring submission entries failed.");
+
+        sq_head = (unsigned*)((char*)sq_ring + params.sq_off.head);
+        sq_tail = (unsigned*)((char*)sq_ring + params.sq_off.tail);
+        sq_mask = *(unsigned*)((char*)sq_ring + params.sq_off.ring_mask);
+        sq_entries = params.sq_entries;
+        sq_array = (unsigned*)((char*)sq_ring + params.sq_off.array);
+        cq_head = (unsigned*)(cq_base + params.cq_off.head);
+        cq_tail = (unsigned*)(cq_base + params.cq_off.tail);
+        cq_mask = *(unsigned*)(cq_base + params.cq_off.ring_mask);
+        completions = cq_base + params.cq_off.cqes;
+
+        // provided buffer ring: the kernel picks a buffer for each received chunk
+        buffer_ring_size = buffer_count * sizeof(io_uring_buf);
+        buffer_ring = mmap(NULL, buffer_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer_ring == MAP_FAILED)
+            throw("mmap() of the provided buffer ring failed.");
+        buffers = new char[buffer_count * buffer_size];
+
+        io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t)(uintptr_t)buffer_ring;
+        reg.ring_entries = buffer_count;
+        reg.bgid = buffer_group;
+        if (0 != io_uring_register(ring_descriptor, IORING_REGISTER_PBUF_RING, &reg, 1))
+            throw("io_uring provided buffer rings are not supported by this kernel.");
+        for (unsigned i = 0; i < buffer_count; i++)
+            RecycleBuffer((uint16_t)i);
+
+        if (!SelfTest())
+            throw("io_uring multishot receive is not supported by this kernel.");
+
+        event_loop->Add(this, ring_descriptor, EventLoop::EVENT_READABLE);
+    }
+    catch (const char*)
+    {
+        if (submissions != MAP_FAILED)
+            munmap(submissions, submissions_size);
+        if (cq_ring != MAP_FAILED)
+            munmap(cq_ring, cq_ring_size);
+        if (sq_ring != MAP_FAILED)
+            munmap(sq_ring, sq_ring_size);
+        if (ring_descriptor != -1)
+            close(ring_descriptor);
+        if (buffer_ring != MAP_FAILED)
+            munmap(buffer_ring, buffer_ring_size);
+        delete [] buffers;
+        pthread_cond_destroy(&dispatch_done);
+        pthread_mutex_destroy(&mutex);
+        throw;
+    }
+}
+
+
+URingEngine::~URingEngine()
+{
+    DEBUG_REPORT_LOCATION;
+
+    event_loop->Remove(this);
+
+    /*
+        Every connection has cancelled its operations by now, but the kernel
+        may still be reading from the frames of a send.  Wait for the last
+        completions before that memory goes away.
+    */
+    try
+    {
+        pthread_mutex_lock(&mutex);
+        for (map<uint64_t, Operation*>::iterator it = operations.begin(); it != operations.end(); ++it)
+        {
+            if (it->second->handler == NULL)
+                continue;
+            it->second->handler = NULL;
+            PrepareCancel(it->first);
+            QueueSubmission();
+        }
+        pthread_mutex_unlock(&mutex);
+
+        while (!operations.empty())
+        {
+            if (-1 == io_uring_enter(ring_descriptor, 0, 1, IORING_ENTER_GETEVENTS) && errno != EINTR)
+                break;
+            HandleEvents(0);
+        }
+    }
+    CATCHALL
+    {
+        LOG_ERROR_OUT("Failed to drain io_uring operations.");
+    }
+
+    // closing the ring cancels whatever is still in flight
+    close(ring_descriptor);
+    munmap(submissions, submissions_size);
+    if (cq_ring != MAP_FAILED)
+        munmap(cq_ring, cq_ring_size);
+    munmap(sq_ring, sq_ring_size);
+    munmap(buffer_ring, buffer_ring_size);
+    delete [] buffers;
+
+    for (map<uint64_t, Operation*>::iterator it = operations.begin(); it != operations.end(); ++it)
+        DeleteOperation(it->second);
+
+    pthread_cond_destroy(&dispatch_done);
+    pthread_mutex_destroy(&mutex);
+}
+
+
+/*
+    Headers new enough to define IORING_RECV_MULTISHOT say nothing about the
+    kernel we are running on, so arm a multishot receive on a socketpair and
+    make sure it both delivers into a provided buffer and stays armed.
+*/
+bool URingEngine::SelfTest()
+{
+    int pair[2];
+    if (0 != socketpair(AF_UNIX, SOCK_STREAM, 0, pair))
+        return false;
+
+    Operation probe;
+    probe.receive = true;
+    probe.handler = NULL;
+    probe.file_descriptor = pair[0];
+    PrepareReceive(0, &probe);
+    __atomic_store_n(sq_tail, *sq_tail + 1, __ATOMIC_RELEASE);
+
+    bool ok = false;
+    char byte = 0;
+    if (1 == write(pair[1], &byte, 1) && 1 == io_uring_enter(ring_descriptor, 1, 1, IORING_ENTER_GETEVENTS))
+    {
+        unsigned head = *cq_head;
+        if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+        {
+            io_uring_cqe* cqe = &((io_uring_cqe*)completions)[head & cq_mask];
+            ok = cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE) && (cqe->flags & IORING_CQE_F_BUFFER);
+            if (cqe->flags & IORING_CQE_F_BUFFER)
+                RecycleBuffer((uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT));
+            __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        }
+    }
+
+    // the peer hanging up ends the receive; wait for that so nothing refers to the pair
+    close(pair[1]);
+    if (ok)
+    {
+        unsigned head = *cq_head;
+        while (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+        {
+            if (-1 == io_uring_enter(ring_descriptor, 0, 1, IORING_ENTER_GETEVENTS) && errno != EINTR)
+                break;
+        }
+        while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+            head++;
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+    close(pair[0]);
+    return ok;
+}
+
+
+void URingEngine::Receive(URingHandler* handler, int file_descriptor)
+{
+    DEBUG_REPORT_LOCATION;
+    Operation* op = new Operation();
+    op->receive = true;
+    op->handler = handler;
+    op->file_descriptor = file_descriptor;
+    op->iov_index = 0;
+
+    pthread_mutex_lock(&mutex);
+    try
+    {
+        uint64_t token = next_token++;
+        PrepareReceive(token, op);
+        operations[token] = op;
+        QueueSubmission();
+    }
+    catch (const char*)
+    {
+        pthread_mutex_unlock(&mutex);
+        delete op;
+        throw;
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+
+void URingEngine::Send(URingHandler* handler, int file_descriptor, vector<Frame*>& frames)
+{
+    Operation* op = new Operation();
+    op->receive = false;
+    op->handler = handler;
+    op->file_descriptor = file_descriptor;
+    op->frames.swap(frames);
+    op->iov_index = 0;
+    for (size_t i = 0; i < op->frames.size(); i++)
+    {
+        iovec v[Frame::max_segments];
+        int count = op->frames[i]->Gather(v, 0);
+        op->iov.insert(op->iov.end(), v, v + count);
+    }
+
+    pthread_mutex_lock(&mutex);
+    try
+    {
+        uint64_t token = next_token++;
+        PrepareSend(token, op);
+        operations[token] = op;
+        QueueSubmission();
+    }
+    catch (const char*)
+    {
+        pthread_mutex_unlock(&mutex);
+        DeleteOperation(op);
+        throw;
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+
+void URingEngine::Cancel(URingHandler* handler)
+{
+    DEBUG_REPORT_LOCATION;
+    pthread_mutex_lock(&mutex);
+    for (map<uint64_t, Operation*>::iterator it = operations.begin(); it != operations.end(); ++it)
+    {
+        if (it->second->handler != handler)
+            continue;
+        it->second->handler = NULL;
+        try
+        {
+            PrepareCancel(it->first);
+            QueueSubmission();
+        }
+        catch (const char* e)
+        {
+            // the operation is already detached; it just finishes on its own
+            LOG_ERROR_OUT("Failed to cancel an io_uring operation: " << e);
+        }
+    }
+
+    if (!event_loop->IsLoopThread())
+    {
+        while (dispatching == handler)
+            pthread_cond_wait(&dispatch_done, &mutex);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+
+uint64_t URingEngine::GetSubmitCount() const
+{
+    return submit_count;
+}
+
+
+void* URingEngine::GetSubmission()
+{
+    unsigned tail = *sq_tail;
+    if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+    {
+        Submit();
+        if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+            throw("io_uring submission queue is full.");
+    }
+    io_uring_sqe* sqe = &((io_uring_sqe*)submissions)[tail & sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[tail & sq_mask] = tail & sq_mask;
+    return sqe;
+}
+
+
+void URingEngine::PrepareReceive(uint64_t token, Operation* op)
+{
+    io_uring_sqe* sqe = (io_uring_sqe*)GetSubmission();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = op->file_descriptor;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = buffer_group;
+    sqe->user_data = token;
+}
+
+
+void URingEngine::PrepareSend(uint64_t token, Operation* op)
+{
+    size_t count = op->iov.size() - op->iov_index;
+    if (count > max_iov_per_send)
+        count = max_iov_per_send;
+    memset(&op->message, 0, sizeof(op->message));
+    op->message.msg_iov = &op->iov[op->iov_index];
+    op->message.msg_iovlen = count;
+
+    io_uring_sqe* sqe = (io_uring_sqe*)GetSubmission();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = op->file_descriptor;
+    sqe->addr = (uint64_t)(uintptr_t)&op->message;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = token;
+}
+
+
+void URingEngine::PrepareCancel(uint64_t token)
+{
+    io_uring_sqe* sqe = (io_uring_sqe*)GetSubmission();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = token;
+    sqe->user_data = 0; // completions with no token are ignored
+}
+
+
+/*
+    Publishes the submission prepared by the last Prepare* call.  Off the loop
+    thread it is submitted right away.  On the loop thread, submissions made
+    while handling completions and scheduled events are gathered and handed
+    to the kernel with a single io_uring_enter() per loop pass.
+*/
+void URingEngine::QueueSubmission()
+{
+    __atomic_store_n(sq_tail, *sq_tail + 1, __ATOMIC_RELEASE);
+    unsubmitted++;
+
+    if (!event_loop->IsLoopThread())
+    {
+        Submit();
+    }
+    else if (!submit_scheduled)
+    {
+        submit_scheduled = true;
+        event_loop->Schedule(this);
+    }
+}
+
+
+void URingEngine::Submit()
+{
+    while (unsubmitted > 0)
+    {
+        int submitted = io_uring_enter(ring_descriptor, unsubmitted, 0, 0);
+        submit_count++;
+        if (submitted > 0)
+        {
+            unsubmitted -= submitted;
+            continue;
+        }
+        if (submitted == -1 && errno == EINTR)
+            continue;
+        if (submitted == -1 && (errno == EAGAIN || errno == EBUSY))
+        {
+            // completions must be reaped first; retry on the next pass
+            if (!submit_scheduled)
+            {
+                submit_scheduled = true;
+                event_loop->Schedule(this);
+            }
+            return;
+        }
+        LOG_ERROR_OUT("io_uring_enter() failed.  errno: " << errno);
+        return;
+    }
+}
+
+
+void URingEngine::RecycleBuffer(uint16_t buffer_id)
+{
+    /*
+        io_uring_buf_ring declares its entries as a flexible array, which C++
+        compilers lay out after the overlaid tail rather than on top of it.
+        Index the entries directly instead; the ring tail is the reserved
+        field of the first entry.
+    */
+    io_uring_buf* ring = (io_uring_buf*)buffer_ring;
+    io_uring_buf* buf = &ring[buffer_tail & (buffer_count - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(buffers + (size_t)buffer_id * buffer_size);
+    buf->len = buffer_size;
+    buf->bid = buffer_id;
+    buffer_tail++;
+    __atomic_store_n(&ring[0].resv, buffer_tail, __ATOMIC_RELEASE);
+}
+
+
+void URingEngine::DeleteOperation(Operation* op)
+{
+    for (size_t i = 0; i < op->frames.size(); i++)
+        op->frames[i]->Release();
+    delete op;
+}
+
+
+void URingEngine::Deliver(URingHandler* handler, bool receive, const char* data, int result)
+{
+    try
+    {
+        if (receive)
+            handler->ReceiveCompleted(data, result);
+        else
+            handler->SendCompleted(result);
+    }
+    catch (const char* e)
+    {
+        LOG_ERROR_OUT("Exception in io_uring completion: " << e);
+    }
+    CATCHALL
+    {
+        LOG_ERROR_OUT("Unknown exception in io_uring completion.");
+    }
+}
+
+
+void URingEngine::Complete(uint64_t token, int result, uint32_t flags)
+{
+    bool more = (flags & IORING_CQE_F_MORE) != 0;
+    const char* data = NULL;
+    uint16_t buffer_id = 0;
+    if (flags & IORING_CQE_F_BUFFER)
+    {
+        buffer_id = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+        data = buffers + (size_t)buffer_id * buffer_size;
+    }
+
+    pthread_mutex_lock(&mutex);
+    map<uint64_t, Operation*>::iterator it = operations.find(token);
+    if (it == operations.end())
+    {
+        pthread_mutex_unlock(&mutex);
+        if (data)
+            RecycleBuffer(buffer_id);
+        return;
+    }
+    Operation* op = it->second;
+    URingHandler* handler = op->handler;
+    bool receive = op->receive; // a finished send is deleted before we are done here
+    bool deliver = false;
+    int delivered_result = result;
+
+    if (receive)
+    {
+        // running out of provided buffers is transient; the receive is just re-armed
+        deliver = handler && result != -ENOBUFS;
+    }
+    else
+    {
+        if (result == 0)
+            result = -EPIPE; // nothing was accepted, and there is always something left to send here
+        if (result > 0)
+        {
+            size_t written = (size_t)result;
+            while (op->iov_index < op->iov.size() && written >= op->iov[op->iov_index].iov_len)
+                written -= op->iov[op->iov_index++].iov_len;
+            if (op->iov_index < op->iov.size())
+            {
+                op->iov[op->iov_index].iov_base = (char*)op->iov[op->iov_index].iov_base + written;
+                op->iov[op->iov_index].iov_len -= written;
+            }
+        }
+
+        if (result > 0 && op->iov_index < op->iov.size() && handler)
+        {
+            try
+            {
+                PrepareSend(token, op);
+                QueueSubmission();
+                pthread_mutex_unlock(&mutex);
+                return;
+            }
+            catch (const char*)
+            {
+                result = -EIO;
+            }
+        }
+        operations.erase(it);
+        deliver = handler != NULL;
+        delivered_result = result < 0 ? result : 0;
+    }
+
+    if (deliver)
+        dispatching = handler;
+    pthread_mutex_unlock(&mutex);
+
+    if (!receive)
+    {
+        if (deliver)
+            Deliver(handler, false, NULL, delivered_result);
+        DeleteOperation(op);
+    }
+    else
+    {
+        if (deliver)
+            Deliver(handler, true, data, result);
+        if (data)
+            RecycleBuffer(buffer_id);
+    }
+
+    pthread_mutex_lock(&mutex);
+    if (deliver)
+    {
+        dispatching = NULL;
+        pthread_cond_broadcast(&dispatch_done);
+    }
+    if (receive && !more)
+    {
+        // the multishot receive ended.  Keep it going unless it was cancelled or the stream is done.
+        bool rearm = op->handler && (result > 0 || result == -ENOBUFS);
+        if (rearm)
+        {
+            try
+            {
+                PrepareReceive(token, op);
+                QueueSubmission();
+            }
+            catch (const char* e)
+            {
+                LOG_ERROR_OUT("Failed to re-arm an io_uring receive: " << e);
+                rearm = false;
+            }
+        }
+        if (!rearm)
+        {
+            operations.erase(token);
+            delete op;
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+
+void URingEngine::HandleEvents(uint32_t /*events*/)
+{
+    pthread_mutex_lock(&mutex);
+    submit_scheduled = false;
+    pthread_mutex_unlock(&mutex);
+
+    // completions are read straight out of the shared ring, without a system call
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail)
+    {
+        io_uring_cqe* cqe = &((io_uring_cqe*)completions)[head & cq_mask];
+        uint64_t token = cqe->user_data;
+        int result = cqe->res;
+        uint32_t flags = cqe->flags;
+        head++;
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+        if (token != 0)
+            Complete(token, result, flags);
+
+        if (head == tail)
+            tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    }
+
+    pthread_mutex_lock(&mutex);
+    Submit();
+    pthread_mutex_unlock(&mutex);
+}
+
+#else // !HAVE_IO_URING
+
+URingEngine::URingEngine(EventLoop* loop)
+{
+    throw("io_uring is not available on this platform.");
+}
+
+
+URingEngine::~URingEngine()
+{
+}
+
+
+void URingEngine::Receive(URingHandler* handler, int file_descriptor)
+{
+    throw("io_uring is not available on this platform.");
+}
+
+
+void URingEngine::Send(URingHandler* handler, int file_descriptor, vector<Frame*>& frames)
+{
+    throw("io_uring is not available on this platform.");
+}
+
+
+void URingEngine::Cancel(URingHandler* handler)
+{
+}
+
+
+uint64_t URingEngine::GetSubmitCount() const
+{
+    return 0;
+}
+
+
+void URingEngine::HandleEvents(uint32_t events)
+{
+}
+
+#endif // HAVE_IO_URING
+
+/*
+------------------------------------------------------------------------------
+This software is available under 2 licenses -- choose whichever you prefer.
+------------------------------------------------------------------------------
+ALTERNATIVE A - MIT License
+Copyright (c) 2003-2019 Bobby G. Burrough
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to 
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+of the Software, and to permit persons to whom the Software is furnished to do 
+so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+SOFTWARE.
+------------------------------------------------------------------------------
+ALTERNATIVE B - Public Domain (www.unlicense.org)
+This is free and unencumbered software released into the public domain.
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this 
+software, either in source code form or as a compiled binary, for any purpose, 
+commercial or non-commercial, and by any means.
+In jurisdictions that recognize copyright laws, the author or authors of this 
+software dedicate any and all copyright interest in the software to the public 
+domain. We make this dedication for the benefit of the public at large and to 
+the detriment of our heirs and successors. We intend this dedication to be an 
+overt act of relinquishment in perpetuity of all present and future rights to 
+this software under copyright law.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN 
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION 
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+------------------------------------------------------------------------------
+*/
@@ -0,0 +1,203 @@
+#ifndef _URING_ENGINE_H_
+#define _URING_ENGINE_H_
+
+#include "eventloop.h"
+#include "frame.h"
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#if !(defined(WIN32) || defined(__WIN32) || defined(__WIN32__) || defined(FORCE_WIN32))
+#include <sys/uio.h>
+#include <sys/socket.h>
+#endif
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_CQE_F_MORE)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+using namespace std;
+
+
+class URingHandler
+{
+public:
+    virtual ~URingHandler() {}
+
+    /*
+        ReceiveCompleted
+
+        Called on the loop thread for each chunk of data received on the
+        descriptor passed to URingEngine::Receive.  result is the number of
+        bytes at data, 0 when the peer closed the connection, or a negative
+        errno.  data is only valid for the duration of the call.
+    */
+    virtual void ReceiveCompleted(const char* data, int result) = 0;
+
+    /*
+        SendCompleted
+
+        Called on the loop thread once every byte handed to URingEngine::Send
+        has been written (result is 0), or when the send failed (result is a
+        negative errno).
+    */
+    virtual void SendCompleted(int result) = 0;
+};
+
+
+class URingEngine : public EventHandler
+{
+public:
+    /*
+        URingEngine
+
+        Creates an io_uring instance with a ring of provided receive buffers
+        and registers its completion queue with loop.  Throws if the kernel
+        does not support multishot receive with provided buffer rings, in
+        which case the caller should stay on readiness events.
+    */
+    URingEngine(EventLoop* loop);
+    virtual ~URingEngine();
+
+    /*
+        Receive
+
+        Arms a multishot receive on file_descriptor.  Every chunk of incoming
+        data is reported through handler->ReceiveCompleted until the peer
+        closes, an error occurs, or Cancel is called.
+    */
+    void Receive(URingHandler* handler, int file_descriptor);
+
+    /*
+        Send
+
+        Writes frames, in order, to file_descriptor as a single gathered
+        submission, resubmitting the remainder after a short write.  Takes
+        over the caller's reference to each frame (the vector is cleared).
+        A handler should keep at most one send outstanding.
+    */
+    void Send(URingHandler* handler, int file_descriptor, vector<Frame*>& frames);
+
+    /*
+        Cancel
+
+        Cancels every operation submitted for handler.  When called from a
+        thread other than the loop thread, blocks until the handler is no
+        longer being called back.  After Cancel returns, the engine will never
+        call into the handler again, and any data it was still sending is
+        released by the engine once the kernel is done with it.
+    */
+    void Cancel(URingHandler* handler);
+
+    /*
+        GetSubmitCount
+
+        Number of io_uring_enter() calls made to submit work.
+    */
+    uint64_t GetSubmitCount() const;
+
+    virtual void HandleEvents(uint32_t events);
+
+private:
+    struct Operation
+    {
+        bool receive;
+        URingHandler* handler;      // NULL once cancelled
+        int file_descriptor;
+        vector<Frame*> frames;
+        vector<iovec> iov;
+        size_t iov_index;
+        msghdr message;
+    };
+
+    bool SelfTest();
+    void* GetSubmission();
+    void PrepareReceive(uint64_t token, Operation* op);
+    void PrepareSend(uint64_t token, Operation* op);
+    void PrepareCancel(uint64_t token);
+    void QueueSubmission();
+    void Submit();
+    void Complete(uint64_t token, int result, uint32_t flags);
+    void RecycleBuffer(uint16_t buffer_id);
+    void Deliver(URingHandler* handler, bool receive, const char* data, int result);
+    void DeleteOperation(Operation* op);
+
+    EventLoop* event_loop;
+    map<uint64_t, Operation*> operations;
+    uint64_t next_token;
+    URingHandler* dispatching;
+    pthread_mutex_t mutex;
+    pthread_cond_t dispatch_done;
+    bool submit_scheduled;
+    unsigned unsubmitted;
+    uint64_t submit_count;
+
+    int ring_descriptor;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    void* submissions;
+    size_t submissions_size;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    void* completions;
+
+    void* buffer_ring;
+    size_t buffer_ring_size;
+    char* buffers;
+    uint16_t buffer_tail;
+};
+
+#endif // _URING_ENGINE_H_
+
+/*
+------------------------------------------------------------------------------
+This software is available under 2 licenses -- choose whichever you prefer.
+------------------------------------------------------------------------------
+ALTERNATIVE A - MIT License
+Copyright (c) 2003-2019 Bobby G. Burrough
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to 
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+of the Software, and to permit persons to whom the Software is furnished to do 
+so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+SOFTWARE.
+------------------------------------------------------------------------------
+ALTERNATIVE B - Public Domain (www.unlicense.org)
+This is free and unencumbered software released into the public domain.
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this 
+software, either in source code form or as a compiled binary, for any purpose, 
+commercial or non-commercial, and by any means.
+In jurisdictions that recognize copyright laws, the author or authors of this 
+software dedicate any and all copyright interest in the software to the public 
+domain. We make this dedication for the benefit of the public at large and to 
+the detriment of our heirs and successors. We intend this dedication to be an 
+overt act of relinquishment in perpetuity of all present and future rights to 
+this software under copyright law.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN 
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION 
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+------------------------------------------------------------------------------
+*/
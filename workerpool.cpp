@@ -0,0 +1,181 @@
+#include "workerpool.h"
+#include "packet.h"
+#include "logger.h"
+#if !(defined(WIN32) || defined(__WIN32) || defined(__WIN32__) || defined(FORCE_WIN32))
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+
+// most packets a worker takes from its queue at once
+static const size_t worker_batch = 64;
+
+
+WorkerPool::WorkerPool(size_t count, PacketHandler handler_arg, void* context_arg)
+    : handler(handler_arg), context(context_arg), next_index(0), stopping(false)
+{
+    if(handler == NULL)
+        throw("A WorkerPool needs a packet handler.");
+
+    if(count == 0)
+    {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        count = online > 0 ? (size_t)online : 1;
+    }
+
+    for(size_t i = 0; i < count; i++)
+    {
+        Shard* shard = new Shard;
+        shard->pool = this;
+        shard->peak_queued = 0;
+        shard->processed = 0;
+        shards.push_back(shard);
+        pthread_create(&shard->thread, NULL, WorkerPool::WorkerThread, shard);
+    }
+}
+
+
+/*
+    A NULL entry normally tells a worker that a connection went away.  Once
+    stopping is set it tells the worker to exit instead.
+*/
+WorkerPool::~WorkerPool()
+{
+    stopping = true;
+    for(size_t i = 0; i < shards.size(); i++)
+    {
+        shards[i]->queue.Producer(NULL);
+        pthread_join(shards[i]->thread, NULL);
+
+        // NULL disconnect notices may still be mixed in with the packets
+        vector<Packet*> rest;
+        while(shards[i]->queue.ConsumeBatch(rest, worker_batch, 0))
+        {
+            for(size_t j = 0; j < rest.size(); j++)
+            {
+                if(rest[j] == NULL)
+                    continue;
+                SocketConnection_Base::PacketTaken(rest[j]);
+                Delete(rest[j]);
+            }
+            rest.clear();
+        }
+        delete shards[i];
+    }
+}
+
+
+PacketPtrSet* WorkerPool::Next()
+{
+    size_t index = __atomic_fetch_add(&next_index, 1, __ATOMIC_RELAXED);
+    return &shards[index % shards.size()]->queue;
+}
+
+
+size_t WorkerPool::GetCount() const
+{
+    return shards.size();
+}
+
+
+void WorkerPool::GetStats(size_t shard, WorkerStats& stats) const
+{
+    stats.queued = shards[shard]->queue.GetSize();
+    stats.peak_queued = __atomic_load_n(&shards[shard]->peak_queued, __ATOMIC_RELAXED);
+    stats.processed = __atomic_load_n(&shards[shard]->processed, __ATOMIC_RELAXED);
+}
+
+
+void* WorkerPool::WorkerThread(void* void_arg)
+{
+    Shard* shard = (Shard*)void_arg;
+    WorkerPool* pool = shard->pool;
+    vector<Packet*> batch;
+    batch.reserve(worker_batch);
+
+    for(;;)
+    {
+        batch.clear();
+        shard->queue.ConsumeBatch(batch, worker_batch);
+
+        size_t queued = batch.size() + shard->queue.GetSize();
+        if(queued > shard->peak_queued)
+            __atomic_store_n(&shard->peak_queued, queued, __ATOMIC_RELAXED);
+
+        for(size_t i = 0; i < batch.size(); i++)
+        {
+            Packet* pkt = batch[i];
+            if(pkt == NULL)
+            {
+                if(pool->stopping)
+                {
+                    // hand back the rest for the destructor to discard
+                    for(size_t j = i + 1; j < batch.size(); j++)
+                        shard->queue.Producer(batch[j]);
+                    return NULL;
+                }
+                continue;
+            }
+
+            SocketConnection_Base::PacketTaken(pkt);
+            try
+            {
+                pool->handler(pkt, pool->context);
+            }
+            catch(const char* str)
+            {
+                LOG_ERROR_OUT("Exception in packet handler: " << str);
+            }
+            CATCHALL
+            {
+                LOG_ERROR_OUT("Unknown exception in packet handler.");
+            }
+            Delete(pkt);
+            __atomic_add_fetch(&shard->processed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+/*
+------------------------------------------------------------------------------
+This software is available under 2 licenses -- choose whichever you prefer.
+------------------------------------------------------------------------------
+ALTERNATIVE A - MIT License
+Copyright (c) 2003-2019 Bobby G. Burrough
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to 
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+of the Software, and to permit persons to whom the Software is furnished to do 
+so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+SOFTWARE.
+------------------------------------------------------------------------------
+ALTERNATIVE B - Public Domain (www.unlicense.org)
+This is free and unencumbered software released into the public domain.
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this 
+software, either in source code form or as a compiled binary, for any purpose, 
+commercial or non-commercial, and by any means.
+In jurisdictions that recognize copyright laws, the author or authors of this 
+software dedicate any and all copyright interest in the software to the public 
+domain. We make this dedication for the benefit of the public at large and to 
+the detriment of our heirs and successors. We intend this dedication to be an 
+overt act of relinquishment in perpetuity of all present and future rights to 
+this software under copyright law.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN 
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION 
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+------------------------------------------------------------------------------
+*/
@@ -0,0 +1,133 @@
+#ifndef _WORKER_POOL_H_
+#define _WORKER_POOL_H_
+
+#include "threadutils.h"
+#include "socketconnection_base.h"
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+using namespace std;
+
+class Packet;
+
+
+/*
+    PacketHandler
+
+    Called on a worker thread for every packet received.  The packet is
+    deleted when the handler returns, so it must not be kept.  context is
+    whatever was given with the handler.
+*/
+typedef void (*PacketHandler)(Packet* pkt, void* context);
+
+
+struct WorkerStats
+{
+    size_t queued;          // packets waiting for the worker
+    size_t peak_queued;     // most packets the worker has found waiting
+    uint64_t processed;     // packets handed to the handler
+};
+
+
+/*
+    WorkerPool
+
+    Runs a PacketHandler on count worker threads, each with its own queue
+    (shard).  A connection is bound to one shard for its whole life and
+    delivers its packets straight into that shard's queue, so each
+    client's packets are handled in the order they arrived while different
+    clients are handled in parallel.
+*/
+class WorkerPool
+{
+public:
+    /*
+        WorkerPool
+
+        Starts count workers.  If count is 0, one worker is started per
+        online processor.
+    */
+    WorkerPool(size_t count, PacketHandler handler, void* context);
+
+    /*
+        ~WorkerPool
+
+        Stops the workers.  Packets still queued are discarded, so the
+        connections feeding the pool must be gone first.
+    */
+    ~WorkerPool();
+
+    /*
+        Next
+
+        Returns the shard queues in round-robin order, for each new
+        connection to deliver its packets into.
+    */
+    PacketPtrSet* Next();
+
+    size_t GetCount() const;
+    void GetStats(size_t shard, WorkerStats& stats) const;
+
+private:
+    struct Shard
+    {
+        WorkerPool* pool;
+        PacketPtrSet queue;
+        pthread_t thread;
+        size_t peak_queued;
+        uint64_t processed;
+    };
+
+    static void* WorkerThread(void* void_arg);
+
+    vector<Shard*> shards;
+    PacketHandler handler;
+    void* context;
+    size_t next_index;
+    volatile bool stopping;
+};
+
+#endif // _WORKER_POOL_H_
+
+/*
+------------------------------------------------------------------------------
+This software is available under 2 licenses -- choose whichever you prefer.
+------------------------------------------------------------------------------
+ALTERNATIVE A - MIT License
+Copyright (c) 2003-2019 Bobby G. Burrough
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to 
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+of the Software, and to permit persons to whom the Software is furnished to do 
+so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+SOFTWARE.
+------------------------------------------------------------------------------
+ALTERNATIVE B - Public Domain (www.unlicense.org)
+This is free and unencumbered software released into the public domain.
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this 
+software, either in source code form or as a compiled binary, for any purpose, 
+commercial or non-commercial, and by any means.
+In jurisdictions that recognize copyright laws, the author or authors of this 
+software dedicate any and all copyright interest in the software to the public 
+domain. We make this dedication for the benefit of the public at large and to 
+the detriment of our heirs and successors. We intend this dedication to be an 
+overt act of relinquishment in perpetuity of all present and future rights to 
+this software under copyright law.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN 
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION 
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+------------------------------------------------------------------------------
+*/
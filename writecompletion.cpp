@@ -0,0 +1,134 @@
+#include "writecompletion.h"
+#include "fdutils.h"
+#include <ctime>
+
+using namespace std;
+
+
+WriteCompletion::WriteCompletion(WriteCallback callback_arg, void* context_arg)
+    : refcount(1), state(WRITE_PENDING), callback(callback_arg), context(context_arg)
+{
+    pthread_mutex_init(&mutex, NULL);
+#if !(defined(WIN32) || defined(__WIN32) || defined(__WIN32__) || defined(FORCE_WIN32))
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&done, &attributes);
+    pthread_condattr_destroy(&attributes);
+#else
+    pthread_cond_init(&done, NULL);
+#endif
+}
+
+
+WriteCompletion::~WriteCompletion()
+{
+    pthread_cond_destroy(&done);
+    pthread_mutex_destroy(&mutex);
+}
+
+
+void WriteCompletion::AddRef()
+{
+    __atomic_add_fetch(&refcount, 1, __ATOMIC_RELAXED);
+}
+
+
+void WriteCompletion::Release()
+{
+    if(__atomic_sub_fetch(&refcount, 1, __ATOMIC_ACQ_REL) == 0)
+        delete this;
+}
+
+
+void WriteCompletion::Complete(bool sent)
+{
+    if(callback)
+        callback(sent, context);
+
+    pthread_mutex_lock(&mutex);
+    __atomic_store_n(&state, sent ? WRITE_SENT : WRITE_FAILED, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&done);
+    pthread_mutex_unlock(&mutex);
+}
+
+
+bool WriteCompletion::IsComplete() const
+{
+    return __atomic_load_n(&state, __ATOMIC_ACQUIRE) != WRITE_PENDING;
+}
+
+
+bool WriteCompletion::Wait(int64_t deadline_ns)
+{
+    pthread_mutex_lock(&mutex);
+    while(state == WRITE_PENDING)
+    {
+        if(deadline_ns == 0)
+        {
+            pthread_cond_wait(&done, &mutex);
+            continue;
+        }
+
+        int64_t remaining = deadline_ns - MonotonicNanoseconds();
+        if(remaining <= 0)
+            break;
+#if !(defined(WIN32) || defined(__WIN32) || defined(__WIN32__) || defined(FORCE_WIN32))
+        int64_t wake = deadline_ns;
+#else
+        // without pthread_condattr_setclock the wait is on the wall clock
+        timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        int64_t wake = (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec + remaining;
+#endif
+        timespec until;
+        until.tv_sec = wake / 1000000000LL;
+        until.tv_nsec = wake % 1000000000LL;
+        pthread_cond_timedwait(&done, &mutex, &until);
+    }
+    bool sent = state == WRITE_SENT;
+    pthread_mutex_unlock(&mutex);
+    return sent;
+}
+
+/*
+------------------------------------------------------------------------------
+This software is available under 2 licenses -- choose whichever you prefer.
+------------------------------------------------------------------------------
+ALTERNATIVE A - MIT License
+Copyright (c) 2003-2019 Bobby G. Burrough
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to 
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+of the Software, and to permit persons to whom the Software is furnished to do 
+so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+SOFTWARE.
+------------------------------------------------------------------------------
+ALTERNATIVE B - Public Domain (www.unlicense.org)
+This is free and unencumbered software released into the public domain.
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this 
+software, either in source code form or as a compiled binary, for any purpose, 
+commercial or non-commercial, and by any means.
+In jurisdictions that recognize copyright laws, the author or authors of this 
+software dedicate any and all copyright interest in the software to the public 
+domain. We make this dedication for the benefit of the public at large and to 
+the detriment of our heirs and successors. We intend this dedication to be an 
+overt act of relinquishment in perpetuity of all present and future rights to 
+this software under copyright law.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN 
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION 
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+------------------------------------------------------------------------------
+*/
@@ -0,0 +1,127 @@
+#ifndef _WRITE_COMPLETION_H_
+#define _WRITE_COMPLETION_H_
+
+#include "threadutils.h"
+#include <cstdint>
+#include <cstddef>
+
+using namespace std;
+
+
+/*
+    WriteCallback
+
+    Called once a tracked write has been handed to the kernel (sent is
+    true), or once it is known it never will be (sent is false).  It runs
+    on the connection's EventLoop thread, or on whichever thread tears the
+    connection down, so it must not block.
+*/
+typedef void (*WriteCallback)(bool sent, void* context);
+
+
+/*
+    WriteCompletion
+
+    Reports when the bytes of a write have left the connection's output
+    queue for the kernel.  It is reference counted: the connection holds
+    one reference until the write completes and the caller holds the one
+    it was given, releasing it with Release() when done.
+*/
+class WriteCompletion
+{
+public:
+    /*
+        WriteCompletion
+
+        Starts with one reference.  callback, if not NULL, is called when
+        the write completes.
+    */
+    WriteCompletion(WriteCallback callback = NULL, void* context = NULL);
+
+    void AddRef();
+    void Release();
+
+    /*
+        Complete
+
+        Called once, by the connection, to resolve the write.
+    */
+    void Complete(bool sent);
+
+    bool IsComplete() const;
+
+    /*
+        Wait
+
+        Blocks until the write completes or deadline_ns, a time on the
+        MonotonicNanoseconds() clock, passes.  A deadline of 0 waits for
+        as long as it takes.  Returns true only if the write completed and
+        was sent.
+    */
+    bool Wait(int64_t deadline_ns);
+
+private:
+    ~WriteCompletion();
+
+    enum State
+    {
+        WRITE_PENDING,
+        WRITE_SENT,
+        WRITE_FAILED
+    };
+
+    uint32_t refcount;
+    uint32_t state;
+    WriteCallback callback;
+    void* context;
+    pthread_mutex_t mutex;
+    pthread_cond_t done;
+
+    // Disallow copying, completions are only ever shared by reference
+    WriteCompletion(const WriteCompletion&);
+    WriteCompletion& operator=(const WriteCompletion&);
+};
+
+#endif // _WRITE_COMPLETION_H_
+
+/*
+------------------------------------------------------------------------------
+This software is available under 2 licenses -- choose whichever you prefer.
+------------------------------------------------------------------------------
+ALTERNATIVE A - MIT License
+Copyright (c) 2003-2019 Bobby G. Burrough
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to 
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+of the Software, and to permit persons to whom the Software is furnished to do 
+so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+SOFTWARE.
+------------------------------------------------------------------------------
+ALTERNATIVE B - Public Domain (www.unlicense.org)
+This is free and unencumbered software released into the public domain.
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this 
+software, either in source code form or as a compiled binary, for any purpose, 
+commercial or non-commercial, and by any means.
+In jurisdictions that recognize copyright laws, the author or authors of this 
+software dedicate any and all copyright interest in the software to the public 
+domain. We make this dedication for the benefit of the public at large and to 
+the detriment of our heirs and successors. We intend this dedication to be an 
+overt act of relinquishment in perpetuity of all present and future rights to 
+this software under copyright law.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN 
+ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION 
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+------------------------------------------------------------------------------
+*/